@@ -13,11 +13,358 @@
 #include <random>
 #include <memory>
 #include <set>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+#include <deque>
+#include <tuple>
+#include <type_traits>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
 
-#define DEBUG_PRINT
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class CheckpointReader;
+
+// Allocator returning memory aligned to 'Alignment' bytes, for buffers that
+// are consumed by vector kernels or written to disk with O_DIRECT.
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t count)
+    {
+#if defined(_WIN32)
+        void* memory = _aligned_malloc(count * sizeof(T), Alignment);
+#else
+        void* memory = nullptr;
+        if (posix_memalign(&memory, Alignment, count * sizeof(T)) != 0)
+        {
+            memory = nullptr;
+        }
+#endif
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* memory, size_t)
+    {
+#if defined(_WIN32)
+        _aligned_free(memory);
+#else
+        free(memory);
+#endif
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// 64 bit checksum used for checkpoint sections. Four independent lanes are
+// mixed 32 bytes at a time so that hashing runs close to memory bandwidth.
+uint64_t Checksum64(const void* data, size_t size)
+{
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t lane) { return rotl(acc + lane * prime2, 31) * prime1; };
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+    size_t offset = 0;
+    for (; offset + 32 <= size; offset += 32)
+    {
+        uint64_t words[4];
+        memcpy(words, bytes + offset, sizeof(words));
+        for (int i = 0; i < 4; ++i)
+        {
+            lanes[i] = round(lanes[i], words[i]);
+        }
+    }
+
+    uint64_t hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+    hash += size;
+    for (; offset < size; ++offset)
+    {
+        hash = rotl(hash ^ (bytes[offset] * prime1), 11) * prime2;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Read only view of a whole file. On POSIX the file is mapped privately
+// (copy on write), so callers may modify the pages in place without the
+// changes ever reaching the file. Other platforms fall back to reading
+// the file into memory.
+class MappedFile
+{
+public:
+    MappedFile()
+        : _data(nullptr),
+        _size(0)
+    {}
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path)
+    {
+        close();
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _data = static_cast<uint8_t*>(mapping);
+        _size = info.st_size;
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            return false;
+        }
+
+        _fallback.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(_fallback.data()), _fallback.size());
+        _data = _fallback.data();
+        _size = _fallback.size();
+#endif
+        return true;
+    }
+
+    void close()
+    {
+#if !defined(_WIN32)
+        if (_data != nullptr)
+        {
+            munmap(_data, _size);
+        }
+#else
+        _fallback.clear();
+#endif
+        _data = nullptr;
+        _size = 0;
+    }
+
+    uint8_t* data() { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    uint8_t* _data;
+    size_t _size;
+#if defined(_WIN32)
+    std::vector<uint8_t> _fallback;
+#endif
+};
+
+// size of the per core L2 cache in bytes, 256 KB when it cannot be queried.
+size_t L2CacheBytes()
+{
+    static const size_t bytes = []()
+    {
+        long size = 0;
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+#if defined(__linux__)
+        if (size <= 0)
+        {
+            // "2048K" style sizes, also where glibc leaves the sysconf value 0.
+            std::ifstream file("/sys/devices/system/cpu/cpu0/cache/index2/size");
+            char unit = 0;
+            if (file >> size >> unit)
+            {
+                size *= (unit == 'M') ? 1024 * 1024 : (unit == 'K') ? 1024 : 1;
+            }
+        }
+#endif
+        return size > 0 ? static_cast<size_t>(size) : static_cast<size_t>(256 * 1024);
+    }();
+    return bytes;
+}
+
+// Contiguous float storage for the parameters of a layer.
+// The buffer either owns its memory, or views a section of a memory mapped
+// checkpoint, or views memory owned by someone else (the Optimizer arena).
+// In the latter cases the owner is kept alive by the buffer, and a
+// checkpoint section checksum is verified the first time the layer uses it.
+class WeightBuffer
+{
+public:
+    WeightBuffer()
+        : _data(nullptr),
+        _size(0),
+        _section(0)
+    {}
+
+    WeightBuffer(const WeightBuffer& other)
+    {
+        *this = other;
+    }
+
+    WeightBuffer& operator=(const WeightBuffer& other)
+    {
+        if (this != &other)
+        {
+            _storage.assign(other.begin(), other.end());
+            _data = _storage.data();
+            _size = _storage.size();
+            _source.reset();
+            _owner.reset();
+            _section = 0;
+        }
+        return *this;
+    }
+
+    void reserve(size_t count) { _storage.reserve(count); }
+
+    // grow or shrink to 'count' floats keeping the contents, new ones are
+    // 'value'. Growing is amortized like std::vector; a view is copied first.
+    void resize(size_t count, float value)
+    {
+        if (_data != _storage.data())
+        {
+            _storage.assign(begin(), end());
+            _source.reset();
+            _owner.reset();
+            _section = 0;
+        }
+        _storage.resize(count, value);
+        _data = _storage.data();
+        _size = count;
+    }
+
+    void assign(size_t count, float value)
+    {
+        _source.reset();
+        _owner.reset();
+        _storage.assign(count, value);
+        _data = _storage.data();
+        _size = count;
+    }
+
+    // view 'count' floats living inside section 'section' of a checkpoint.
+    void attach(float* data, size_t count, std::shared_ptr<CheckpointReader> source, uint32_t section)
+    {
+        _storage.clear();
+        _storage.shrink_to_fit();
+        _data = data;
+        _size = count;
+        _source = source;
+        _owner.reset();
+        _section = section;
+    }
+
+    // view 'count' floats of memory kept alive by 'owner'.
+    void attach(float* data, size_t count, std::shared_ptr<const void> owner)
+    {
+        _storage.clear();
+        _storage.shrink_to_fit();
+        _data = data;
+        _size = count;
+        _source.reset();
+        _owner = owner;
+        _section = 0;
+    }
+
+    void ensureVerified() const;
+
+    float* data() { return _data; }
+    const float* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    float* begin() { return _data; }
+    float* end() { return _data + _size; }
+    const float* begin() const { return _data; }
+    const float* end() const { return _data + _size; }
+
+    float& operator[](size_t index) { return _data[index]; }
+    const float& operator[](size_t index) const { return _data[index]; }
+
+private:
+    std::vector<float> _storage;
+    float* _data;
+    size_t _size;
+    std::shared_ptr<CheckpointReader> _source;
+    std::shared_ptr<const void> _owner;
+    uint32_t _section;
+};
 
 // utility class
-void VectorRandomInitialize(std::vector<float>& input)
+void VectorRandomInitialize(WeightBuffer& input)
 {
     std::cout << "Random Initializing Weights: " << input.size() << std::endl;
     assert(input.size() > 0);
@@ -29,300 +376,10456 @@ void VectorRandomInitialize(std::vector<float>& input)
 }
 
 ///////////////////////////////////////////////////
-// Layer Implementations
-// inputDimension - number of neurons in previous layer
-// outputDimension - number of neurons in the current layer
-//
-// In this implementation, the weights are owned by the layers. 
-// All the layers implement a common interface and provide implementation
-// to the forward and backward propagation operations on the weights in those layers
+// Kernels
+// Shared by the layers and the inference engine. Matrices are row major
+// and weights are stored input-major: weights[i * outputDim + j] connects
+// input neuron i to output neuron j.
 //////////////////////////////////////////////////
 
-// Base Layer that all layers should inherit
-class BaseLayer
+// Values are persisted in checkpoints, so never renumber existing entries.
+enum class ActivationKind : uint32_t
 {
-public:
-    BaseLayer(
-        int32_t inputDim, 
-        int32_t outputDim)
-        : _inputDim(inputDim),
-        _outputDim(outputDim)
-    {}
+    Identity = 1,
+    Sigmoid = 2,
+    Relu = 3,
+    LeakyRelu = 4,
+    Tanh = 5,
+    Gelu = 6,
+};
 
-    virtual void initializeWeights() = 0;
-    virtual void forwardProp(std::vector<float>& input, std::vector<float>& output) = 0;
-    virtual void backProp() = 0;
+// Minimal SIMD wrapper: the widest float vector the target is compiled for
+// (AVX, SSE, or a plain float), so kernels are written once.
+// SimdRound rounds to the nearest integer, SimdPow2 returns 2^n for integral n.
+#if defined(__AVX__)
+typedef __m256 SimdFloat;
+const int32_t SimdWidth = 8;
+inline SimdFloat SimdZero() { return _mm256_setzero_ps(); }
+inline SimdFloat SimdBroadcast(float value) { return _mm256_set1_ps(value); }
+inline SimdFloat SimdLoad(const float* data) { return _mm256_loadu_ps(data); }
+inline void SimdStore(float* data, SimdFloat value) { _mm256_storeu_ps(data, value); }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a, b); }
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+inline SimdFloat SimdRound(SimdFloat a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+#if defined(__FMA__)
+inline SimdFloat SimdMulAdd(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+inline SimdFloat SimdMulAdd(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+#if defined(__AVX2__)
+inline SimdFloat SimdPow2(SimdFloat n)
+{
+    __m256i exponent = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(exponent, 23));
+}
+#else
+inline SimdFloat SimdPow2(SimdFloat n)
+{
+    // AVX has no 256 bit integer ops, build the exponent bits one half at a time.
+    __m256i integer = _mm256_cvtps_epi32(n);
+    __m128i bias = _mm_set1_epi32(127);
+    __m128i low = _mm_slli_epi32(_mm_add_epi32(_mm256_castsi256_si128(integer), bias), 23);
+    __m128i high = _mm_slli_epi32(_mm_add_epi32(_mm256_extractf128_si256(integer, 1), bias), 23);
+    return _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+}
+#endif
+inline float SimdSum(SimdFloat value)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+typedef __m128 SimdFloat;
+const int32_t SimdWidth = 4;
+inline SimdFloat SimdZero() { return _mm_setzero_ps(); }
+inline SimdFloat SimdBroadcast(float value) { return _mm_set1_ps(value); }
+inline SimdFloat SimdLoad(const float* data) { return _mm_loadu_ps(data); }
+inline void SimdStore(float* data, SimdFloat value) { _mm_storeu_ps(data, value); }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm_div_ps(a, b); }
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm_sqrt_ps(a); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+inline SimdFloat SimdRound(SimdFloat a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+inline SimdFloat SimdMulAdd(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+inline SimdFloat SimdPow2(SimdFloat n)
+{
+    __m128i exponent = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+    return _mm_castsi128_ps(_mm_slli_epi32(exponent, 23));
+}
+inline float SimdSum(SimdFloat value)
+{
+    __m128 sum = _mm_add_ps(value, _mm_movehl_ps(value, value));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#else
+typedef float SimdFloat;
+const int32_t SimdWidth = 1;
+inline SimdFloat SimdZero() { return 0.0f; }
+inline SimdFloat SimdBroadcast(float value) { return value; }
+inline SimdFloat SimdLoad(const float* data) { return *data; }
+inline void SimdStore(float* data, SimdFloat value) { *data = value; }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return a + b; }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return a - b; }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return a * b; }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return a / b; }
+inline SimdFloat SimdSqrt(SimdFloat a) { return std::sqrt(a); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return std::max(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return std::min(a, b); }
+inline SimdFloat SimdRound(SimdFloat a) { return std::nearbyint(a); }
+inline SimdFloat SimdMulAdd(SimdFloat a, SimdFloat b, SimdFloat c) { return a * b + c; }
+inline SimdFloat SimdPow2(SimdFloat n) { return std::ldexp(1.0f, static_cast<int>(n)); }
+inline float SimdSum(SimdFloat value) { return value; }
+#endif
 
-    int32_t InputDim() { return _inputDim; }
-    int32_t OutputDim() { return _outputDim; }
+// hint that the cache line holding 'data' is read soon.
+inline void Prefetch(const void* data)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    _mm_prefetch(static_cast<const char*>(data), _MM_HINT_T0);
+#else
+    (void)data;
+#endif
+}
 
-protected:
-    std::vector<float> _weights;
-    int32_t _inputDim;
-    int32_t _outputDim;
+// e^x with a degree 6 polynomial after range reduction by ln 2, accurate to
+// a couple of ulp. Inputs are clamped to the range where the result is a
+// normal float.
+inline SimdFloat SimdExp(SimdFloat x)
+{
+    x = SimdMin(SimdMax(x, SimdBroadcast(-87.3f)), SimdBroadcast(88.3f));
+    SimdFloat n = SimdRound(SimdMul(x, SimdBroadcast(1.44269504089f)));
+    SimdFloat r = SimdSub(x, SimdMul(n, SimdBroadcast(0.693359375f)));
+    r = SimdSub(r, SimdMul(n, SimdBroadcast(-2.12194440e-4f)));
+
+    SimdFloat p = SimdBroadcast(1.9875691500e-4f);
+    p = SimdMulAdd(p, r, SimdBroadcast(1.3981999507e-3f));
+    p = SimdMulAdd(p, r, SimdBroadcast(8.3334519073e-3f));
+    p = SimdMulAdd(p, r, SimdBroadcast(4.1665795894e-2f));
+    p = SimdMulAdd(p, r, SimdBroadcast(1.6666665459e-1f));
+    p = SimdMulAdd(p, r, SimdBroadcast(5.0000001201e-1f));
+    SimdFloat y = SimdAdd(SimdMulAdd(p, SimdMul(r, r), r), SimdBroadcast(1.0f));
+    return SimdMul(y, SimdPow2(n));
+}
+
+// Activation policies, used as template arguments of the fully connected
+// layers so every activation gets its own inlined epilogue.
+//
+// Apply / ApplySimd compute the activation. Derivative takes whichever
+// value is cheaper to keep from the forward pass: the layer output when it
+// determines the derivative, otherwise the pre-activation
+// (FromPreActivation), which the layer then caches.
+struct IdentityActivation
+{
+    static const ActivationKind Kind = ActivationKind::Identity;
+    static const bool FromPreActivation = false;
+    static float Apply(float x) { return x; }
+    static SimdFloat ApplySimd(SimdFloat x) { return x; }
+    static float Derivative(float) { return 1.0f; }
 };
 
-// For InputLayer, inputDim = outputDim
-// and there are no weights shared.
-class InputLayer : public BaseLayer
+struct SigmoidActivation
 {
-public:
+    static const ActivationKind Kind = ActivationKind::Sigmoid;
+    static const bool FromPreActivation = false;
+    static float Apply(float x) { return 1.0f / (1.0f + std::exp(-x)); }
+    static SimdFloat ApplySimd(SimdFloat x)
+    {
+        SimdFloat one = SimdBroadcast(1.0f);
+        return SimdDiv(one, SimdAdd(one, SimdExp(SimdSub(SimdZero(), x))));
+    }
+    static float Derivative(float output) { return output * (1.0f - output); }
+};
 
-    InputLayer(int32_t inputDim)
-        : BaseLayer(inputDim, inputDim)
-    {}
+struct ReluActivation
+{
+    static const ActivationKind Kind = ActivationKind::Relu;
+    static const bool FromPreActivation = false;
+    static float Apply(float x) { return std::max(x, 0.0f); }
+    static SimdFloat ApplySimd(SimdFloat x) { return SimdMax(x, SimdZero()); }
+    static float Derivative(float output) { return output > 0.0f ? 1.0f : 0.0f; }
+};
 
-    void initializeWeights()
-    {    
-        // Nothing to Do for the input layer.
+struct LeakyReluActivation
+{
+    static const ActivationKind Kind = ActivationKind::LeakyRelu;
+    static const bool FromPreActivation = false;
+    static constexpr float Slope = 0.01f;
+    static float Apply(float x) { return std::max(x, Slope * x); }
+    static SimdFloat ApplySimd(SimdFloat x) { return SimdMax(x, SimdMul(SimdBroadcast(Slope), x)); }
+    static float Derivative(float output) { return output > 0.0f ? 1.0f : Slope; }
+};
+
+struct TanhActivation
+{
+    static const ActivationKind Kind = ActivationKind::Tanh;
+    static const bool FromPreActivation = false;
+    static float Apply(float x) { return std::tanh(x); }
+    static SimdFloat ApplySimd(SimdFloat x)
+    {
+        // tanh(x) = 1 - 2 / (1 + e^2x)
+        SimdFloat one = SimdBroadcast(1.0f);
+        SimdFloat e = SimdExp(SimdAdd(x, x));
+        return SimdSub(one, SimdDiv(SimdBroadcast(2.0f), SimdAdd(one, e)));
+    }
+    static float Derivative(float output) { return 1.0f - output * output; }
+};
+
+// tanh approximation of GELU, its derivative needs the pre-activation.
+struct GeluActivation
+{
+    static const ActivationKind Kind = ActivationKind::Gelu;
+    static const bool FromPreActivation = true;
+    static constexpr float Scale = 0.7978845608f;   // sqrt(2 / pi)
+    static constexpr float Cubic = 0.044715f;
+    static float Apply(float x)
+    {
+        return 0.5f * x * (1.0f + std::tanh(Scale * (x + Cubic * x * x * x)));
+    }
+    static SimdFloat ApplySimd(SimdFloat x)
+    {
+        SimdFloat x3 = SimdMul(SimdMul(x, x), x);
+        SimdFloat inner = SimdMul(SimdBroadcast(Scale), SimdMulAdd(SimdBroadcast(Cubic), x3, x));
+        SimdFloat half = SimdMul(SimdBroadcast(0.5f), x);
+        return SimdMulAdd(half, TanhActivation::ApplySimd(inner), half);
+    }
+    static float Derivative(float x)
+    {
+        float t = std::tanh(Scale * (x + Cubic * x * x * x));
+        return 0.5f * (1.0f + t) + 0.5f * x * (1.0f - t * t) * Scale * (1.0f + 3.0f * Cubic * x * x);
+    }
+};
+
+template <typename Activation>
+inline void ApplyActivation(float* values, int32_t count)
+{
+    int32_t i = 0;
+    for (; i + SimdWidth <= count; i += SimdWidth)
+    {
+        SimdStore(values + i, Activation::ApplySimd(SimdLoad(values + i)));
+    }
+    for (; i < count; ++i)
+    {
+        values[i] = Activation::Apply(values[i]);
+    }
+}
+
+// values[i] *= derivative, from the output or pre-activation in 'source' as the activation requires.
+template <typename Activation>
+inline void ApplyActivationDerivative(float* values, const float* source, int32_t count)
+{
+    for (int32_t i = 0; i < count; ++i)
+    {
+        values[i] *= Activation::Derivative(source[i]);
+    }
+}
+
+// Calls f(Policy()) with the activation policy for 'activation'. This is
+// how code that only knows the activation at run time (inference plans,
+// checkpoints) reaches the inlined policies: one switch per call, never
+// per element.
+template <typename F>
+auto DispatchActivation(ActivationKind activation, F&& f) -> decltype(f(IdentityActivation()))
+{
+    switch (activation)
+    {
+    case ActivationKind::Sigmoid: return f(SigmoidActivation());
+    case ActivationKind::Relu: return f(ReluActivation());
+    case ActivationKind::LeakyRelu: return f(LeakyReluActivation());
+    case ActivationKind::Tanh: return f(TanhActivation());
+    case ActivationKind::Gelu: return f(GeluActivation());
+    case ActivationKind::Identity: break;
+    }
+    return f(IdentityActivation());
+}
+
+inline float Activate(ActivationKind activation, float value)
+{
+    return DispatchActivation(activation, [&](auto policy) { return decltype(policy)::Apply(value); });
+}
+
+void ApplyActivation(ActivationKind activation, float* values, int32_t count)
+{
+    DispatchActivation(activation, [&](auto policy) { ApplyActivation<decltype(policy)>(values, count); });
+}
+
+void ApplyActivationDerivative(ActivationKind activation, float* values, const float* source, int32_t count)
+{
+    DispatchActivation(activation, [&](auto policy) { ApplyActivationDerivative<decltype(policy)>(values, source, count); });
+}
+
+bool ActivationNeedsPreActivation(ActivationKind activation)
+{
+    return DispatchActivation(activation, [](auto policy) { return decltype(policy)::FromPreActivation; });
+}
+
+// DenseForward works on register tiles of up to four samples by
+// DenseTileColumns outputs. The accumulators stay in registers for the
+// whole reduction over the inputs, so each weight vector that is loaded
+// feeds every sample of the tile.
+const int32_t DenseTileColumns = 2 * SimdWidth;
+
+inline void DenseTile4(
+    const float* __restrict input,
+    const float* __restrict weights,
+    float* __restrict output,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    const float* in1 = input + inputDim;
+    const float* in2 = in1 + inputDim;
+    const float* in3 = in2 + inputDim;
+    SimdFloat acc00 = SimdZero(), acc01 = SimdZero();
+    SimdFloat acc10 = SimdZero(), acc11 = SimdZero();
+    SimdFloat acc20 = SimdZero(), acc21 = SimdZero();
+    SimdFloat acc30 = SimdZero(), acc31 = SimdZero();
+    for (int32_t i = 0; i < inputDim; ++i)
+    {
+        const float* row = weights + static_cast<size_t>(i) * outputDim;
+        SimdFloat w0 = SimdLoad(row);
+        SimdFloat w1 = SimdLoad(row + SimdWidth);
+        SimdFloat x = SimdBroadcast(input[i]);
+        acc00 = SimdMulAdd(x, w0, acc00);
+        acc01 = SimdMulAdd(x, w1, acc01);
+        x = SimdBroadcast(in1[i]);
+        acc10 = SimdMulAdd(x, w0, acc10);
+        acc11 = SimdMulAdd(x, w1, acc11);
+        x = SimdBroadcast(in2[i]);
+        acc20 = SimdMulAdd(x, w0, acc20);
+        acc21 = SimdMulAdd(x, w1, acc21);
+        x = SimdBroadcast(in3[i]);
+        acc30 = SimdMulAdd(x, w0, acc30);
+        acc31 = SimdMulAdd(x, w1, acc31);
+    }
+
+    SimdStore(output, acc00);
+    SimdStore(output + SimdWidth, acc01);
+    output += outputDim;
+    SimdStore(output, acc10);
+    SimdStore(output + SimdWidth, acc11);
+    output += outputDim;
+    SimdStore(output, acc20);
+    SimdStore(output + SimdWidth, acc21);
+    output += outputDim;
+    SimdStore(output, acc30);
+    SimdStore(output + SimdWidth, acc31);
+}
+
+inline void DenseTile1(
+    const float* __restrict input,
+    const float* __restrict weights,
+    float* __restrict output,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    SimdFloat acc0 = SimdZero(), acc1 = SimdZero();
+    for (int32_t i = 0; i < inputDim; ++i)
+    {
+        const float* row = weights + static_cast<size_t>(i) * outputDim;
+        SimdFloat x = SimdBroadcast(input[i]);
+        acc0 = SimdMulAdd(x, SimdLoad(row), acc0);
+        acc1 = SimdMulAdd(x, SimdLoad(row + SimdWidth), acc1);
+    }
+    SimdStore(output, acc0);
+    SimdStore(output + SimdWidth, acc1);
+}
+
+// bias[j] added to values[j], vectorized.
+inline void AddBias(float* values, const float* bias, int32_t count)
+{
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        SimdStore(values + j, SimdAdd(SimdLoad(values + j), SimdLoad(bias + j)));
+    }
+    for (; j < count; ++j)
+    {
+        values[j] += bias[j];
+    }
+}
+
+// Epilogue of DenseForward that adds the bias (if any) and applies the
+// activation to each tile. Unless preActivations is null, the biased
+// values are also stored there (row major, outputDim per row) before the
+// activation overwrites them.
+template <typename Activation>
+struct ActivationEpilogue
+{
+    const float* bias;
+    float* preActivations;
+    int32_t outputDim;
+
+    void operator()(int32_t row, int32_t column, float* values, int32_t count) const
+    {
+        if (bias != nullptr)
+        {
+            AddBias(values, bias + column, count);
+        }
+        if (preActivations != nullptr)
+        {
+            std::copy(values, values + count, preActivations + static_cast<size_t>(row) * outputDim + column);
+        }
+        ApplyActivation<Activation>(values, count);
+    }
+};
+
+// output[b, j] = sum_i input[b, i] * weights[i, j] for a batch of samples,
+// followed by epilogue(b, j, &output[b, j], count) on every stored tile
+// segment while it is still in L1. The epilogue is where activations and
+// anything else elementwise on the layer output get fused in. Output
+// columns that do not fill a tile fall back to a plain loop.
+template <typename Epilogue>
+void DenseForward(
+    const float* __restrict input,
+    const float* __restrict weights,
+    float* __restrict output,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim,
+    Epilogue epilogue)
+{
+    int32_t tiledColumns = outputDim - outputDim % DenseTileColumns;
+    for (int32_t b = 0; b < batch; b += 4)
+    {
+        int32_t rows = std::min(4, batch - b);
+        const float* in = input + static_cast<size_t>(b) * inputDim;
+        float* out = output + static_cast<size_t>(b) * outputDim;
+        for (int32_t j0 = 0; j0 < tiledColumns; j0 += DenseTileColumns)
+        {
+            if (rows == 4)
+            {
+                DenseTile4(in, weights + j0, out + j0, inputDim, outputDim);
+            }
+            else
+            {
+                for (int32_t r = 0; r < rows; ++r)
+                {
+                    DenseTile1(in + static_cast<size_t>(r) * inputDim, weights + j0,
+                        out + static_cast<size_t>(r) * outputDim + j0, inputDim, outputDim);
+                }
+            }
+
+            for (int32_t r = 0; r < rows; ++r)
+            {
+                epilogue(b + r, j0, out + static_cast<size_t>(r) * outputDim + j0, DenseTileColumns);
+            }
+        }
+
+        for (int32_t r = 0; r < rows && tiledColumns < outputDim; ++r)
+        {
+            const float* sample = in + static_cast<size_t>(r) * inputDim;
+            float* tail = out + static_cast<size_t>(r) * outputDim + tiledColumns;
+            int32_t tailColumns = outputDim - tiledColumns;
+            std::fill(tail, tail + tailColumns, 0.0f);
+            for (int32_t i = 0; i < inputDim; ++i)
+            {
+                const float* row = weights + static_cast<size_t>(i) * outputDim + tiledColumns;
+                for (int32_t j = 0; j < tailColumns; ++j)
+                {
+                    tail[j] += sample[i] * row[j];
+                }
+            }
+            epilogue(b + r, tiledColumns, tail, tailColumns);
+        }
+    }
+}
+
+void DenseForward(
+    const float* input,
+    const float* weights,
+    const float* bias,
+    float* output,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim,
+    ActivationKind activation)
+{
+    DispatchActivation(activation, [&](auto policy)
+    {
+        typedef decltype(policy) Activation;
+        DenseForward(input, weights, output, batch, inputDim, outputDim, ActivationEpilogue<Activation>{ bias, nullptr, outputDim });
+    });
+}
+
+// Weights of a dense layer (input major, as everywhere else) with most
+// blocks zero, a block being the DenseTileColumns weights of one input
+// row in one panel of DenseTileColumns output columns. Each panel keeps
+// only its nonzero blocks, packed one after the other with their input
+// row, so BlockSparseForward streams exactly the weights that matter. The
+// last panel is zero padded when outputDim is not a multiple of the panel width.
+struct BlockSparseWeights
+{
+    int32_t inputDim = 0;
+    int32_t outputDim = 0;
+    std::vector<int32_t> panelStart;      // first block of each panel, panels + 1 entries
+    std::vector<int32_t> blockRow;        // input row of each block
+    std::vector<float, AlignedAllocator<float, 64>> values;   // DenseTileColumns per block
+
+    int32_t panelCount() const { return static_cast<int32_t>(panelStart.size()) - 1; }
+
+    // fraction of blocks kept, what the forward pass costs relative to dense.
+    double density() const
+    {
+        size_t total = static_cast<size_t>(panelCount()) * inputDim;
+        return total > 0 ? static_cast<double>(blockRow.size()) / total : 0.0;
+    }
+
+    static BlockSparseWeights FromDense(const float* weights, int32_t inputDim, int32_t outputDim)
+    {
+        BlockSparseWeights sparse;
+        sparse.inputDim = inputDim;
+        sparse.outputDim = outputDim;
+        int32_t panels = (outputDim + DenseTileColumns - 1) / DenseTileColumns;
+        sparse.panelStart.push_back(0);
+        for (int32_t p = 0; p < panels; ++p)
+        {
+            int32_t j0 = p * DenseTileColumns;
+            int32_t count = std::min(DenseTileColumns, outputDim - j0);
+            for (int32_t i = 0; i < inputDim; ++i)
+            {
+                const float* block = weights + static_cast<size_t>(i) * outputDim + j0;
+                if (std::any_of(block, block + count, [](float w) { return w != 0.0f; }))
+                {
+                    sparse.blockRow.push_back(i);
+                    sparse.values.insert(sparse.values.end(), block, block + count);
+                    sparse.values.insert(sparse.values.end(), DenseTileColumns - count, 0.0f);
+                }
+            }
+            sparse.panelStart.push_back(static_cast<int32_t>(sparse.blockRow.size()));
+        }
+        return sparse;
+    }
+};
+
+// the DenseTile4 micro-kernel over the nonzero blocks of one panel.
+inline void BlockSparseTile4(
+    const float* __restrict input,
+    const float* __restrict values,
+    const int32_t* __restrict blockRow,
+    int32_t blocks,
+    float* __restrict output,
+    int32_t inputDim,
+    int32_t outputStride)
+{
+    const float* in1 = input + inputDim;
+    const float* in2 = in1 + inputDim;
+    const float* in3 = in2 + inputDim;
+    SimdFloat acc00 = SimdZero(), acc01 = SimdZero();
+    SimdFloat acc10 = SimdZero(), acc11 = SimdZero();
+    SimdFloat acc20 = SimdZero(), acc21 = SimdZero();
+    SimdFloat acc30 = SimdZero(), acc31 = SimdZero();
+    for (int32_t k = 0; k < blocks; ++k)
+    {
+        int32_t i = blockRow[k];
+        const float* block = values + static_cast<size_t>(k) * DenseTileColumns;
+        SimdFloat w0 = SimdLoad(block);
+        SimdFloat w1 = SimdLoad(block + SimdWidth);
+        SimdFloat x = SimdBroadcast(input[i]);
+        acc00 = SimdMulAdd(x, w0, acc00);
+        acc01 = SimdMulAdd(x, w1, acc01);
+        x = SimdBroadcast(in1[i]);
+        acc10 = SimdMulAdd(x, w0, acc10);
+        acc11 = SimdMulAdd(x, w1, acc11);
+        x = SimdBroadcast(in2[i]);
+        acc20 = SimdMulAdd(x, w0, acc20);
+        acc21 = SimdMulAdd(x, w1, acc21);
+        x = SimdBroadcast(in3[i]);
+        acc30 = SimdMulAdd(x, w0, acc30);
+        acc31 = SimdMulAdd(x, w1, acc31);
+    }
+
+    SimdStore(output, acc00);
+    SimdStore(output + SimdWidth, acc01);
+    output += outputStride;
+    SimdStore(output, acc10);
+    SimdStore(output + SimdWidth, acc11);
+    output += outputStride;
+    SimdStore(output, acc20);
+    SimdStore(output + SimdWidth, acc21);
+    output += outputStride;
+    SimdStore(output, acc30);
+    SimdStore(output + SimdWidth, acc31);
+}
+
+inline void BlockSparseTile1(
+    const float* __restrict input,
+    const float* __restrict values,
+    const int32_t* __restrict blockRow,
+    int32_t blocks,
+    float* __restrict output)
+{
+    SimdFloat acc0 = SimdZero(), acc1 = SimdZero();
+    for (int32_t k = 0; k < blocks; ++k)
+    {
+        const float* block = values + static_cast<size_t>(k) * DenseTileColumns;
+        SimdFloat x = SimdBroadcast(input[blockRow[k]]);
+        acc0 = SimdMulAdd(x, SimdLoad(block), acc0);
+        acc1 = SimdMulAdd(x, SimdLoad(block + SimdWidth), acc1);
+    }
+    SimdStore(output, acc0);
+    SimdStore(output + SimdWidth, acc1);
+}
+
+// DenseForward for BlockSparseWeights, with the same epilogue contract.
+// The work is proportional to the number of nonzero blocks.
+template <typename Epilogue>
+void BlockSparseForward(
+    const float* __restrict input,
+    const BlockSparseWeights& weights,
+    float* __restrict output,
+    int32_t batch,
+    Epilogue epilogue)
+{
+    int32_t inputDim = weights.inputDim;
+    int32_t outputDim = weights.outputDim;
+    for (int32_t b = 0; b < batch; b += 4)
+    {
+        int32_t rows = std::min(4, batch - b);
+        const float* in = input + static_cast<size_t>(b) * inputDim;
+        float* out = output + static_cast<size_t>(b) * outputDim;
+        for (int32_t p = 0; p < weights.panelCount(); ++p)
+        {
+            int32_t j0 = p * DenseTileColumns;
+            int32_t count = std::min(DenseTileColumns, outputDim - j0);
+            int32_t first = weights.panelStart[p];
+            int32_t blocks = weights.panelStart[p + 1] - first;
+            const float* values = weights.values.data() + static_cast<size_t>(first) * DenseTileColumns;
+            const int32_t* blockRow = weights.blockRow.data() + first;
+
+            // a partial last panel goes through a scratch tile.
+            float scratch[4 * DenseTileColumns];
+            bool full = (count == DenseTileColumns);
+            float* target = full ? out + j0 : scratch;
+            int32_t stride = full ? outputDim : DenseTileColumns;
+            if (rows == 4)
+            {
+                BlockSparseTile4(in, values, blockRow, blocks, target, inputDim, stride);
+            }
+            else
+            {
+                for (int32_t r = 0; r < rows; ++r)
+                {
+                    BlockSparseTile1(in + static_cast<size_t>(r) * inputDim, values, blockRow, blocks,
+                        target + static_cast<size_t>(r) * stride);
+                }
+            }
+
+            for (int32_t r = 0; r < rows; ++r)
+            {
+                float* segment = out + static_cast<size_t>(r) * outputDim + j0;
+                if (!full)
+                {
+                    std::copy(scratch + r * DenseTileColumns, scratch + r * DenseTileColumns + count, segment);
+                }
+                epilogue(b + r, j0, segment, count);
+            }
+        }
+    }
+}
+
+void BlockSparseForward(
+    const float* input,
+    const BlockSparseWeights& weights,
+    const float* bias,
+    float* output,
+    int32_t batch,
+    ActivationKind activation)
+{
+    DispatchActivation(activation, [&](auto policy)
+    {
+        typedef decltype(policy) Activation;
+        BlockSparseForward(input, weights, output, batch, ActivationEpilogue<Activation>{ bias, nullptr, weights.outputDim });
+    });
+}
+
+// One row of DenseBackwardWeights: row[j] += sum_b input[b, i] * delta[b, j].
+// With WithBias the column sums of delta are accumulated into 'bias' in
+// the same loop, so the bias gradient costs no pass of its own over delta.
+template <bool WithBias>
+void DenseGradientRow(
+    const float* __restrict input,
+    const float* __restrict delta,
+    float* __restrict row,
+    float* __restrict bias,
+    int32_t i,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    int32_t vectorColumns = outputDim - outputDim % SimdWidth;
+    int32_t b = 0;
+    for (; b + 4 <= batch; b += 4)
+    {
+        const float* d0 = delta + static_cast<size_t>(b) * outputDim;
+        const float* d1 = d0 + outputDim;
+        const float* d2 = d1 + outputDim;
+        const float* d3 = d2 + outputDim;
+        float x0 = input[static_cast<size_t>(b) * inputDim + i];
+        float x1 = input[static_cast<size_t>(b + 1) * inputDim + i];
+        float x2 = input[static_cast<size_t>(b + 2) * inputDim + i];
+        float x3 = input[static_cast<size_t>(b + 3) * inputDim + i];
+        SimdFloat v0 = SimdBroadcast(x0), v1 = SimdBroadcast(x1), v2 = SimdBroadcast(x2), v3 = SimdBroadcast(x3);
+        int32_t j = 0;
+        for (; j < vectorColumns; j += SimdWidth)
+        {
+            SimdFloat e0 = SimdLoad(d0 + j), e1 = SimdLoad(d1 + j), e2 = SimdLoad(d2 + j), e3 = SimdLoad(d3 + j);
+            SimdFloat acc = SimdLoad(row + j);
+            acc = SimdMulAdd(v0, e0, acc);
+            acc = SimdMulAdd(v1, e1, acc);
+            acc = SimdMulAdd(v2, e2, acc);
+            acc = SimdMulAdd(v3, e3, acc);
+            SimdStore(row + j, acc);
+            if (WithBias)
+            {
+                SimdStore(bias + j, SimdAdd(SimdLoad(bias + j), SimdAdd(SimdAdd(e0, e1), SimdAdd(e2, e3))));
+            }
+        }
+        for (; j < outputDim; ++j)
+        {
+            row[j] += x0 * d0[j] + x1 * d1[j] + x2 * d2[j] + x3 * d3[j];
+            if (WithBias)
+            {
+                bias[j] += d0[j] + d1[j] + d2[j] + d3[j];
+            }
+        }
+    }
+
+    for (; b < batch; ++b)
+    {
+        const float* d = delta + static_cast<size_t>(b) * outputDim;
+        float x = input[static_cast<size_t>(b) * inputDim + i];
+        SimdFloat v = SimdBroadcast(x);
+        int32_t j = 0;
+        for (; j < vectorColumns; j += SimdWidth)
+        {
+            SimdFloat e = SimdLoad(d + j);
+            SimdStore(row + j, SimdMulAdd(v, e, SimdLoad(row + j)));
+            if (WithBias)
+            {
+                SimdStore(bias + j, SimdAdd(SimdLoad(bias + j), e));
+            }
+        }
+        for (; j < outputDim; ++j)
+        {
+            row[j] += x * d[j];
+            if (WithBias)
+            {
+                bias[j] += d[j];
+            }
+        }
+    }
+}
+
+// gradient[i, j] += sum_b input[b, i] * delta[b, j], and unless biasGradient
+// is null, biasGradient[j] += sum_b delta[b, j] fused into the first row.
+// Each gradient row is loaded and stored once per four samples.
+void DenseBackwardWeights(
+    const float* input,
+    const float* delta,
+    float* gradient,
+    float* biasGradient,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    for (int32_t i = 0; i < inputDim; ++i)
+    {
+        float* row = gradient + static_cast<size_t>(i) * outputDim;
+        if (i == 0 && biasGradient != nullptr)
+        {
+            DenseGradientRow<true>(input, delta, row, biasGradient, i, batch, inputDim, outputDim);
+        }
+        else
+        {
+            DenseGradientRow<false>(input, delta, row, nullptr, i, batch, inputDim, outputDim);
+        }
+    }
+}
+
+// inputDelta[b, i] = (sum_j weights[i, j] * delta[b, j]) * activation'(source[b, i])
+// The derivative of the activation that produced the input is applied to
+// each row while it is still in L1, so the previous layer receives the
+// delta of its pre-activation and never makes its own pass over it.
+// 'source' is the layer input, or its pre-activation for activations
+// whose derivative needs it.
+template <typename Activation>
+void DenseBackwardInput(
+    const float* __restrict delta,
+    const float* __restrict weights,
+    const float* __restrict source,
+    float* __restrict inputDelta,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    int32_t vectorColumns = outputDim - outputDim % SimdWidth;
+    for (int32_t b = 0; b < batch; ++b)
+    {
+        const float* d = delta + static_cast<size_t>(b) * outputDim;
+        float* out = inputDelta + static_cast<size_t>(b) * inputDim;
+        for (int32_t i = 0; i < inputDim; ++i)
+        {
+            const float* row = weights + static_cast<size_t>(i) * outputDim;
+            SimdFloat acc = SimdZero();
+            int32_t j = 0;
+            for (; j < vectorColumns; j += SimdWidth)
+            {
+                acc = SimdMulAdd(SimdLoad(row + j), SimdLoad(d + j), acc);
+            }
+            float sum = SimdSum(acc);
+            for (; j < outputDim; ++j)
+            {
+                sum += row[j] * d[j];
+            }
+            out[i] = sum;
+        }
+        ApplyActivationDerivative<Activation>(out, source + static_cast<size_t>(b) * inputDim, inputDim);
+    }
+}
+
+void DenseBackwardInput(
+    const float* delta,
+    const float* weights,
+    const float* source,
+    float* inputDelta,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim,
+    ActivationKind inputActivation)
+{
+    DispatchActivation(inputActivation, [&](auto policy)
+    {
+        DenseBackwardInput<decltype(policy)>(delta, weights, source, inputDelta, batch, inputDim, outputDim);
+    });
+}
+
+inline float MaxValue(const float* values, int32_t count)
+{
+    float result = -std::numeric_limits<float>::infinity();
+    int32_t j = 0;
+    if (count >= SimdWidth)
+    {
+        SimdFloat acc = SimdLoad(values);
+        for (j = SimdWidth; j + SimdWidth <= count; j += SimdWidth)
+        {
+            acc = SimdMax(acc, SimdLoad(values + j));
+        }
+        float lanes[SimdWidth];
+        SimdStore(lanes, acc);
+        result = *std::max_element(lanes, lanes + SimdWidth);
+    }
+    for (; j < count; ++j)
+    {
+        result = std::max(result, values[j]);
+    }
+    return result;
+}
+
+// sum_j exp(values[j] - shift)
+inline float SumExp(const float* values, int32_t count, float shift)
+{
+    SimdFloat offset = SimdBroadcast(shift);
+    SimdFloat acc = SimdZero();
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        acc = SimdAdd(acc, SimdExp(SimdSub(SimdLoad(values + j), offset)));
+    }
+    float sum = SimdSum(acc);
+    for (; j < count; ++j)
+    {
+        sum += std::exp(values[j] - shift);
+    }
+    return sum;
+}
+
+inline float Dot(const float* a, const float* b, int32_t count)
+{
+    SimdFloat acc = SimdZero();
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        acc = SimdMulAdd(SimdLoad(a + j), SimdLoad(b + j), acc);
+    }
+    float sum = SimdSum(acc);
+    for (; j < count; ++j)
+    {
+        sum += a[j] * b[j];
+    }
+    return sum;
+}
+
+// Online softmax normalizer of a row that is produced in segments, e.g.
+// one GEMM tile at a time: the maximum so far and sum_j exp(x_j - max),
+// rescaled whenever the maximum grows. Never overflows, and lets the
+// normalizer be computed while each segment is still in L1.
+struct SoftmaxAccumulator
+{
+    float max;
+    float sum;
+
+    void reset()
+    {
+        max = -std::numeric_limits<float>::infinity();
+        sum = 0.0f;
+    }
+
+    void add(const float* values, int32_t count)
+    {
+        float segmentMax = MaxValue(values, count);
+        if (segmentMax > max)
+        {
+            sum *= std::exp(max - segmentMax);
+            max = segmentMax;
+        }
+        sum += SumExp(values, count, max);
+    }
+
+    // log sum_j exp(x_j)
+    float logSum() const { return max + std::log(sum); }
+};
+
+// values[j] = exp(values[j] - max) / sum for the normalizer of the row.
+inline void SoftmaxNormalize(float* values, int32_t count, const SoftmaxAccumulator& normalizer)
+{
+    SimdFloat offset = SimdBroadcast(normalizer.max);
+    SimdFloat scale = SimdBroadcast(1.0f / normalizer.sum);
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        SimdStore(values + j, SimdMul(SimdExp(SimdSub(SimdLoad(values + j), offset)), scale));
+    }
+    for (; j < count; ++j)
+    {
+        values[j] = std::exp(values[j] - normalizer.max) / normalizer.sum;
+    }
+}
+
+// softmax over each of the 'batch' rows of 'values', in place.
+void SoftmaxRows(float* values, int32_t batch, int32_t count)
+{
+    for (int32_t b = 0; b < batch; ++b)
+    {
+        float* row = values + static_cast<size_t>(b) * count;
+        SoftmaxAccumulator normalizer;
+        normalizer.reset();
+        normalizer.add(row, count);
+        SoftmaxNormalize(row, count, normalizer);
+    }
+}
+
+// Turns a row of logits into probabilities p, and writes
+// delta[j] = gradientScale * (p[j] - target[j]), the gradient of the cross
+// entropy with respect to the logits, in the same pass.
+inline void SoftmaxCrossEntropyRow(
+    float* __restrict values,
+    const float* __restrict target,
+    float* __restrict delta,
+    int32_t count,
+    const SoftmaxAccumulator& normalizer,
+    float gradientScale)
+{
+    SimdFloat offset = SimdBroadcast(normalizer.max);
+    SimdFloat scale = SimdBroadcast(1.0f / normalizer.sum);
+    SimdFloat deltaScale = SimdBroadcast(gradientScale);
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        SimdFloat p = SimdMul(SimdExp(SimdSub(SimdLoad(values + j), offset)), scale);
+        SimdStore(values + j, p);
+        SimdStore(delta + j, SimdMul(deltaScale, SimdSub(p, SimdLoad(target + j))));
+    }
+    for (; j < count; ++j)
+    {
+        float p = std::exp(values[j] - normalizer.max) / normalizer.sum;
+        values[j] = p;
+        delta[j] = gradientScale * (p - target[j]);
+    }
+}
+
+// y[j] += a * x[j]
+inline void Axpy(float a, const float* __restrict x, float* __restrict y, int32_t count)
+{
+    SimdFloat scale = SimdBroadcast(a);
+    int32_t j = 0;
+    for (; j + SimdWidth <= count; j += SimdWidth)
+    {
+        SimdStore(y + j, SimdMulAdd(scale, SimdLoad(x + j), SimdLoad(y + j)));
+    }
+    for (; j < count; ++j)
+    {
+        y[j] += a * x[j];
+    }
+}
+
+// logits[r] = rows[r] . input + bias[r] for 'count' consecutive rows of a
+// class major weight matrix (one contiguous row of inputDim weights per
+// class). Used by output layers that only evaluate some of their classes.
+inline void ClassMajorLogits(
+    const float* input,
+    const float* rows,
+    const float* bias,
+    float* logits,
+    int32_t count,
+    int32_t inputDim)
+{
+    for (int32_t r = 0; r < count; ++r)
+    {
+        logits[r] = Dot(rows + static_cast<size_t>(r) * inputDim, input, inputDim) + bias[r];
+    }
+}
+
+// softmax(weights . input + bias) over all outputDim classes of a class major weight matrix.
+void ClassMajorSoftmaxForward(
+    const float* input,
+    const float* weights,
+    const float* bias,
+    float* output,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim)
+{
+    for (int32_t b = 0; b < batch; ++b)
+    {
+        ClassMajorLogits(input + static_cast<size_t>(b) * inputDim, weights, bias,
+            output + static_cast<size_t>(b) * outputDim, outputDim, inputDim);
+    }
+    SoftmaxRows(output, batch, outputDim);
+}
+
+// Two level softmax: class c belongs to cluster c / clusterSize, and
+// p(c) = p(cluster) * p(c | cluster). Writes the full distribution.
+void HierarchicalSoftmaxForward(
+    const float* input,
+    const float* classWeights,
+    const float* classBiases,
+    const float* clusterWeights,
+    const float* clusterBiases,
+    float* output,
+    int32_t batch,
+    int32_t inputDim,
+    int32_t outputDim,
+    int32_t clusterSize)
+{
+    int32_t clusterCount = (outputDim + clusterSize - 1) / clusterSize;
+    std::vector<float> clusterProbabilities(clusterCount);
+    for (int32_t b = 0; b < batch; ++b)
+    {
+        const float* x = input + static_cast<size_t>(b) * inputDim;
+        float* out = output + static_cast<size_t>(b) * outputDim;
+        ClassMajorLogits(x, clusterWeights, clusterBiases, clusterProbabilities.data(), clusterCount, inputDim);
+        SoftmaxRows(clusterProbabilities.data(), 1, clusterCount);
+        for (int32_t k = 0; k < clusterCount; ++k)
+        {
+            int32_t first = k * clusterSize;
+            int32_t count = std::min(clusterSize, outputDim - first);
+            ClassMajorLogits(x, classWeights + static_cast<size_t>(first) * inputDim, classBiases + first, out + first, count, inputDim);
+            SoftmaxRows(out + first, 1, count);
+            for (int32_t j = 0; j < count; ++j)
+            {
+                out[first + j] *= clusterProbabilities[k];
+            }
+        }
+    }
+}
+
+// A batch of sparse samples in CSR form: sample b has the nonzero features
+// indices[offsets[b]] .. indices[offsets[b + 1] - 1] with the matching
+// values, every other feature is zero.
+struct SparseBatch
+{
+    std::vector<int32_t> offsets;     // batch size + 1 entries, starting at 0
+    std::vector<int32_t> indices;
+    std::vector<float> values;
+
+    int32_t batchSize() const { return offsets.empty() ? 0 : static_cast<int32_t>(offsets.size()) - 1; }
+
+    void clear()
+    {
+        offsets.assign(1, 0);
+        indices.clear();
+        values.clear();
+    }
+
+    void addSample(const int32_t* sampleIndices, const float* sampleValues, size_t count)
+    {
+        if (offsets.empty())
+        {
+            offsets.push_back(0);
+        }
+        indices.insert(indices.end(), sampleIndices, sampleIndices + count);
+        values.insert(values.end(), sampleValues, sampleValues + count);
+        offsets.push_back(static_cast<int32_t>(indices.size()));
+    }
+};
+
+// output[b, :] = sum_k values[k] * weights[indices[k], :] over the nonzeros
+// of each sample, then the epilogue on the whole row. Weights are input
+// major, so every active feature is one contiguous weight row and the cost
+// is O(nnz * outputDim) instead of O(inputDim * outputDim).
+template <typename Epilogue>
+void SparseDenseForward(
+    const SparseBatch& input,
+    const float* __restrict weights,
+    float* __restrict output,
+    int32_t outputDim,
+    Epilogue epilogue)
+{
+    for (int32_t b = 0; b < input.batchSize(); ++b)
+    {
+        float* out = output + static_cast<size_t>(b) * outputDim;
+        std::fill(out, out + outputDim, 0.0f);
+        for (int32_t k = input.offsets[b]; k < input.offsets[b + 1]; ++k)
+        {
+            Axpy(input.values[k], weights + static_cast<size_t>(input.indices[k]) * outputDim, out, outputDim);
+        }
+        epilogue(b, 0, out, outputDim);
+    }
+}
+
+void SparseDenseForward(
+    const SparseBatch& input,
+    const float* weights,
+    const float* bias,
+    float* output,
+    int32_t outputDim,
+    ActivationKind activation)
+{
+    DispatchActivation(activation, [&](auto policy)
+    {
+        typedef decltype(policy) Activation;
+        SparseDenseForward(input, weights, output, outputDim, ActivationEpilogue<Activation>{ bias, nullptr, outputDim });
+    });
+}
+
+// gradient[indices[k], :] += values[k] * delta[b, :] and biasGradient += delta[b, :],
+// touching only the weight rows of active features.
+void SparseDenseBackwardWeights(
+    const SparseBatch& input,
+    const float* delta,
+    float* gradient,
+    float* biasGradient,
+    int32_t outputDim)
+{
+    for (int32_t b = 0; b < input.batchSize(); ++b)
+    {
+        const float* d = delta + static_cast<size_t>(b) * outputDim;
+        for (int32_t k = input.offsets[b]; k < input.offsets[b + 1]; ++k)
+        {
+            Axpy(input.values[k], d, gradient + static_cast<size_t>(input.indices[k]) * outputDim, outputDim);
+        }
+        Axpy(1.0f, d, biasGradient, outputDim);
+    }
+}
+
+// table row of a float id, -1 unless it lies in [0, vocabularySize).
+inline int64_t EmbeddingRow(float id, int32_t vocabularySize)
+{
+    // written so that NaN fails the test too.
+    return (id >= 0.0f && id < static_cast<float>(vocabularySize)) ? static_cast<int64_t>(id) : -1;
+}
+
+// output[b, f, :] = table[ids[b, f], :] for 'fields' ids per sample. The
+// ids are floats holding integers, so they travel through the usual dense
+// input. Rows are scattered over a table far larger than the caches, so
+// the row needed a few lookups ahead is prefetched while the current one
+// is copied. Ids outside the table come straight from the data and are
+// not trusted: they look up zeros. Returns how many there were.
+size_t EmbeddingLookup(
+    const float* __restrict ids,
+    const float* __restrict table,
+    float* __restrict output,
+    int32_t batch,
+    int32_t fields,
+    int32_t dim,
+    int32_t vocabularySize)
+{
+    const size_t prefetchDistance = 8;
+    size_t lookups = static_cast<size_t>(batch) * fields;
+    size_t invalid = 0;
+    for (size_t k = 0; k < lookups; ++k)
+    {
+        if (k + prefetchDistance < lookups)
+        {
+            int64_t ahead = EmbeddingRow(ids[k + prefetchDistance], vocabularySize);
+            for (int32_t j = 0; ahead >= 0 && j < dim; j += 16)
+            {
+                Prefetch(table + ahead * dim + j);
+            }
+        }
+        int64_t row = EmbeddingRow(ids[k], vocabularySize);
+        if (row < 0)
+        {
+            std::fill(output + k * dim, output + (k + 1) * dim, 0.0f);
+            invalid++;
+            continue;
+        }
+        std::copy(table + row * dim, table + (row + 1) * dim, output + k * dim);
+    }
+    return invalid;
+}
+
+///////////////////////////////////////////////////
+// Layer Implementations
+// inputDimension - number of neurons in previous layer
+// outputDimension - number of neurons in the current layer
+//
+// In this implementation, the weights are owned by the layers. 
+// All the layers implement a common interface and provide implementation
+// to the forward and backward propagation operations on the weights in those layers
+//////////////////////////////////////////////////
+
+// Identifies the concrete layer type, e.g. in the checkpoint topology.
+// Values are persisted, so never renumber existing entries.
+enum class LayerKind : uint32_t
+{
+    Input = 1,
+    FullyConnectedHidden = 2,
+    FullyConnectedOutput = 3,
+    SoftmaxCrossEntropyOutput = 4,
+    SampledSoftmaxOutput = 5,
+    HierarchicalSoftmaxOutput = 6,
+    Embedding = 7,
+    LowRank = 8,
+};
+
+// A parameter array of a layer together with the number of floats it is
+// expected to hold, and the array its gradient is accumulated into.
+struct ParameterRef
+{
+    WeightBuffer* buffer;
+    size_t count;
+    WeightBuffer* gradient;
+    // set for parameters with row sparse gradients (embedding tables): the
+    // gradient then holds only rows->size() rows of rowSize values, row k
+    // being the gradient of parameter row (*rows)[k]. Rows not listed have
+    // a zero gradient and must be left alone by whatever applies updates.
+    // Layers may switch between sparse and dense gradients from step to
+    // step, so take the rows from a fresh parameters() call.
+    const std::vector<int32_t>* rows = nullptr;
+    int32_t rowSize = 0;
+    // the gradient is the full array and the listed rows sit at their own
+    // place in it instead of packed (fully connected layers fed sparse input).
+    bool rowsInPlace = false;
+};
+
+// Base Layer that all layers should inherit
+//
+// Layers work on batches of row major samples: 'input' holds
+// batchSize x InputDim() values and 'output' batchSize x OutputDim().
+class BaseLayer
+{
+public:
+    BaseLayer(
+        int32_t inputDim, 
+        int32_t outputDim)
+        : _inputDim(inputDim),
+        _outputDim(outputDim)
+    {}
+
+    virtual ~BaseLayer() {}
+
+    virtual LayerKind Kind() const = 0;
+    virtual void initializeWeights() = 0;
+    virtual void forwardProp(const float* input, float* output, int32_t batchSize) = 0;
+
+    // outputDelta is dLoss/d(pre-activation) of this layer. Accumulates the
+    // parameter gradients and, unless inputDelta is null, writes
+    // dLoss/d(pre-activation) of the previous layer, whose output 'input'
+    // was produced by 'inputActivation'. inputPreActivation is the
+    // previous layer's PreActivations(), only read for activations whose
+    // derivative needs it.
+    virtual void backProp(
+        const float* input,
+        const float* outputDelta,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) = 0;
+
+    // activation applied to the output of this layer.
+    virtual ActivationKind OutputActivation() const { return ActivationKind::Identity; }
+
+    // layer specific setting persisted with the topology, e.g. the number
+    // of sampled classes of a SampledSoftmaxOutputLayer. 0 if unused.
+    virtual uint32_t Option() const { return 0; }
+
+    // clear the gradients accumulated by backProp. Layers that only touch
+    // a few rows of their parameters per step clear just those.
+    virtual void zeroGradients()
+    {
+        for (auto& param : parameters())
+        {
+            std::fill(param.gradient->begin(), param.gradient->end(), 0.0f);
+        }
+    }
+
+    // Layers that can be the first stage of a network with sparse input
+    // (see InputLayer) override these. They work like forwardProp and
+    // backProp, the first stage never needs an input delta.
+    virtual bool AcceptsSparseInput() const { return false; }
+
+    virtual void forwardPropSparse(const SparseBatch&, float*)
+    {
+        assert(false && "layer does not accept sparse input");
+    }
+
+    virtual void backPropSparse(const SparseBatch&, const float*)
+    {
+        assert(false && "layer does not accept sparse input");
+    }
+
+    // pre-activation values of the last forwardProp, kept by layers whose
+    // activation derivative cannot be computed from the output, null otherwise.
+    virtual const float* PreActivations() const { return nullptr; }
+
+    // parameter arrays of this layer, always in the same order.
+    // Layers without weights return an empty list.
+    virtual std::vector<ParameterRef> parameters()
+    {
+        return { { &_weights, static_cast<size_t>(_inputDim) * _outputDim, &_weightGradients } };
+    }
+
+    // true once every parameter array holds its expected number of values,
+    // either from initializeWeights or from a restored checkpoint.
+    bool hasWeights()
+    {
+        for (auto& param : parameters())
+        {
+            if (param.buffer->size() != param.count)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int32_t InputDim() { return _inputDim; }
+    int32_t OutputDim() { return _outputDim; }
+
+protected:
+    WeightBuffer _weights;
+    WeightBuffer _weightGradients;
+    int32_t _inputDim;
+    int32_t _outputDim;
+};
+
+// Implemented by output layers, which compute the loss as part of their forward pass.
+class ILossLayer
+{
+public:
+    virtual ~ILossLayer() {}
+
+    // forward 'input' and compare the result with 'target'. Writes the
+    // output, and dLoss/d(pre-activation) scaled by gradientScale to 'delta'.
+    // Returns the loss summed over the batch.
+    //
+    // Layers that only evaluate some of their outputs while training
+    // (SampledSoftmaxOutputLayer, HierarchicalSoftmaxOutputLayer) leave
+    // 'output' and 'delta' untouched and keep the gradient of the outputs
+    // they did evaluate for their backProp.
+    virtual float forwardLoss(
+        const float* input,
+        const float* target,
+        float* output,
+        float* delta,
+        int32_t batchSize,
+        float gradientScale) = 0;
+};
+
+// For InputLayer, inputDim = outputDim
+// and there are no weights shared.
+class InputLayer : public BaseLayer
+{
+public:
+
+    // with 'sparse' the network is fed SparseBatches (InputData::_sparse),
+    // which go straight to the first layer after this one.
+    InputLayer(int32_t inputDim, bool sparse = false)
+        : BaseLayer(inputDim, inputDim),
+        _sparse(sparse)
+    {}
+
+    LayerKind Kind() const override { return LayerKind::Input; }
+    uint32_t Option() const override { return _sparse ? 1 : 0; }
+    bool Sparse() const { return _sparse; }
+
+    void initializeWeights()
+    {    
+        // Nothing to Do for the input layer.
+    }
+
+    std::vector<ParameterRef> parameters() override
+    {
+        return {};
+    }
+
+    // simply return the input as output.
+    void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        // copy input to output, as the input layer does not apply any transformation.
+        std::copy(input, input + static_cast<size_t>(batchSize) * _inputDim, output);
+    }
+
+    void backProp(
+        const float* input,
+        const float* outputDelta,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) override
+    {
+        if (inputDelta == nullptr)
+        {
+            return;
+        }
+
+        size_t count = static_cast<size_t>(batchSize) * _inputDim;
+        const float* source = ActivationNeedsPreActivation(inputActivation) ? inputPreActivation : input;
+        std::copy(outputDelta, outputDelta + count, inputDelta);
+        ApplyActivationDerivative(inputActivation, inputDelta, source, static_cast<int32_t>(count));
+    }
+
+private:
+    bool _sparse;
+};
+
+// Embedding lookup for categorical features. Each sample holds InputDim()
+// feature ids (one per field, as floats holding integers below 2^24) and
+// the output is their embedding rows concatenated, InputDim() x
+// EmbeddingDim() values. The table has Option() rows.
+//
+// Only the rows looked up in a step get a gradient: it is kept compact,
+// one row per distinct id in the order first seen, and parameters()
+// reports those ids as the gradient rows, so updates and any per row
+// optimizer state only ever touch the rows a step used. Ids have no
+// gradient, so an embedding has to directly follow the InputLayer.
+class EmbeddingLayer : public BaseLayer
+{
+public:
+    EmbeddingLayer(int32_t fields, int32_t embeddingDim, int32_t vocabularySize)
+        : BaseLayer(fields, fields * embeddingDim),
+        _embeddingDim(embeddingDim),
+        _vocabularySize(vocabularySize)
+    {
+        assert(vocabularySize > 0 && vocabularySize <= (1 << 24));
+    }
+
+    LayerKind Kind() const override { return LayerKind::Embedding; }
+    uint32_t Option() const override { return static_cast<uint32_t>(_vocabularySize); }
+    int32_t EmbeddingDim() const { return _embeddingDim; }
+
+    std::vector<ParameterRef> parameters() override
+    {
+        ParameterRef table = { &_weights, static_cast<size_t>(_vocabularySize) * _embeddingDim, &_weightGradients };
+        table.rows = &_gradientRows;
+        table.rowSize = _embeddingDim;
+        return { table };
+    }
+
+    void initializeWeights() override
+    {
+        _weights.assign(static_cast<size_t>(_vocabularySize) * _embeddingDim, 0.0f);
+        VectorRandomInitialize(_weights);
+    }
+
+    void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        _weights.ensureVerified();
+        size_t invalid = EmbeddingLookup(input, _weights.data(), output, batchSize, _inputDim, _embeddingDim, _vocabularySize);
+        if (invalid > 0 && _invalidIds == 0)
+        {
+            std::cerr << "embedding ids outside [0, " << _vocabularySize << ") in the input, they look up zeros" << std::endl;
+        }
+        _invalidIds += invalid;
+    }
+
+    // ids outside the table seen so far, see EmbeddingLookup.
+    uint64_t InvalidIds() const { return _invalidIds; }
+
+    void backProp(
+        const float* input,
+        const float* outputDelta,
+        float* inputDelta,
+        ActivationKind,
+        const float*,
+        int32_t batchSize) override
+    {
+        assert(inputDelta == nullptr);
+        (void)inputDelta;
+        size_t lookups = static_cast<size_t>(batchSize) * _inputDim;
+
+        // give every id seen for the first time since zeroGradients its gradient row.
+        if (_gradientSlot.size() != static_cast<size_t>(_vocabularySize))
+        {
+            _gradientSlot.assign(_vocabularySize, -1);
+        }
+        for (size_t k = 0; k < lookups; ++k)
+        {
+            // invalid ids looked up zeros and get no gradient.
+            int64_t id = EmbeddingRow(input[k], _vocabularySize);
+            if (id >= 0 && _gradientSlot[id] < 0)
+            {
+                _gradientSlot[id] = static_cast<int32_t>(_gradientRows.size());
+                _gradientRows.push_back(static_cast<int32_t>(id));
+            }
+        }
+        // micro-batches of one step keep adding rows, the buffer grows in
+        // place and zeroGradients keeps its capacity for the next step.
+        _weightGradients.resize(_gradientRows.size() * _embeddingDim, 0.0f);
+
+        for (size_t k = 0; k < lookups; ++k)
+        {
+            int64_t id = EmbeddingRow(input[k], _vocabularySize);
+            if (id < 0)
+            {
+                continue;
+            }
+            size_t slot = static_cast<size_t>(_gradientSlot[id]);
+            Axpy(1.0f, outputDelta + k * _embeddingDim, _weightGradients.data() + slot * _embeddingDim, _embeddingDim);
+        }
+    }
+
+    void zeroGradients() override
+    {
+        for (int32_t id : _gradientRows)
+        {
+            _gradientSlot[id] = -1;
+        }
+        _gradientRows.clear();
+        _weightGradients.assign(0, 0.0f);
+    }
+
+private:
+    int32_t _embeddingDim;
+    int32_t _vocabularySize;
+    std::vector<int32_t> _gradientRows;     // table row of each gradient row
+    std::vector<int32_t> _gradientSlot;     // gradient row of each table row, -1 if none
+    uint64_t _invalidIds = 0;
+};
+
+// Implementation of a Fully Connected Layer. The activation is a policy
+// (see SigmoidActivation and friends) so the GEMM epilogue is compiled
+// for it, with no per-element dispatch.
+template <typename Activation>
+class FullyConnectedLayer : public BaseLayer
+{
+
+public:
+
+    FullyConnectedLayer(
+        int32_t inputDim, 
+        int32_t outputDim)
+        : BaseLayer(inputDim, outputDim)
+    {
+    }
+
+    virtual LayerKind Kind() const override { return LayerKind::FullyConnectedHidden; }
+    virtual ActivationKind OutputActivation() const override { return Activation::Kind; }
+
+    virtual const float* PreActivations() const override
+    {
+        return Activation::FromPreActivation ? _preActivations.data() : nullptr;
+    }
+
+    // weights, then one bias per output neuron. After sparse input only
+    // the weight rows of its active features have a gradient.
+    virtual std::vector<ParameterRef> parameters() override
+    {
+        ParameterRef weights = { &_weights, static_cast<size_t>(_inputDim) * _outputDim, &_weightGradients };
+        if (_sparseGradients)
+        {
+            weights.rows = &_touchedRows;
+            weights.rowSize = _outputDim;
+            weights.rowsInPlace = true;
+        }
+        return { weights, { &_biases, static_cast<size_t>(_outputDim), &_biasGradients } };
+    }
+
+protected:
+
+    virtual void initializeWeights() override
+    {
+        _weights.reserve(_inputDim * _outputDim);
+        _weights.assign(_inputDim * _outputDim, 0.0);
+        VectorRandomInitialize(_weights);
+        _biases.assign(_outputDim, 0.0f);
+    }
+    
+    // bias and activation are applied in the epilogue of the GEMM, so the
+    // pre-activation never makes a round trip through memory unless the
+    // activation derivative needs it.
+    virtual void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        _weights.ensureVerified();
+        _biases.ensureVerified();
+        DenseForward(input, _weights.data(), output, batchSize, _inputDim, _outputDim,
+            ActivationEpilogue<Activation>{ _biases.data(), preActivationBuffer(batchSize), _outputDim });
+    }
+
+    virtual void backProp(
+        const float* input,
+        const float* outputDelta,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) override
+    {
+        DenseBackwardWeights(input, outputDelta, _weightGradients.data(), _biasGradients.data(), batchSize, _inputDim, _outputDim);
+        if (inputDelta != nullptr)
+        {
+            const float* source = ActivationNeedsPreActivation(inputActivation) ? inputPreActivation : input;
+            DenseBackwardInput(outputDelta, _weights.data(), source, inputDelta, batchSize, _inputDim, _outputDim, inputActivation);
+        }
+    }
+
+    virtual bool AcceptsSparseInput() const override { return true; }
+
+    virtual void forwardPropSparse(const SparseBatch& input, float* output) override
+    {
+        _weights.ensureVerified();
+        _biases.ensureVerified();
+        SparseDenseForward(input, _weights.data(), output, _outputDim,
+            ActivationEpilogue<Activation>{ _biases.data(), preActivationBuffer(input.batchSize()), _outputDim });
+    }
+
+    // only the weight rows of the active features get a gradient, and
+    // zeroGradients clears only those.
+    virtual void backPropSparse(const SparseBatch& input, const float* outputDelta) override
+    {
+        SparseDenseBackwardWeights(input, outputDelta, _weightGradients.data(), _biasGradients.data(), _outputDim);
+        if (_rowTouched.size() != static_cast<size_t>(_inputDim))
+        {
+            _rowTouched.assign(_inputDim, 0);
+        }
+        for (int32_t i : input.indices)
+        {
+            if (!_rowTouched[i])
+            {
+                _rowTouched[i] = 1;
+                _touchedRows.push_back(i);
+            }
+        }
+        _sparseGradients = true;
+    }
+
+    virtual void zeroGradients() override
+    {
+        if (!_sparseGradients)
+        {
+            BaseLayer::zeroGradients();
+            return;
+        }
+        for (int32_t i : _touchedRows)
+        {
+            float* row = _weightGradients.data() + static_cast<size_t>(i) * _outputDim;
+            std::fill(row, row + _outputDim, 0.0f);
+            _rowTouched[i] = 0;
+        }
+        std::fill(_biasGradients.begin(), _biasGradients.end(), 0.0f);
+        _touchedRows.clear();
+        _sparseGradients = false;
+    }
+
+    // storage for the pre-activations of a batch, null when the activation does not need them.
+    float* preActivationBuffer(int32_t batchSize)
+    {
+        if (!Activation::FromPreActivation)
+        {
+            return nullptr;
+        }
+        _preActivations.resize(static_cast<size_t>(batchSize) * _outputDim);
+        return _preActivations.data();
+    }
+
+    WeightBuffer _biases;
+    WeightBuffer _biasGradients;
+    std::vector<float> _preActivations;
+    std::vector<int32_t> _touchedRows;      // weight rows with a gradient from backPropSparse, each once
+    std::vector<uint8_t> _rowTouched;       // per weight row, listed in _touchedRows
+    bool _sparseGradients = false;
+};
+
+typedef FullyConnectedLayer<SigmoidActivation> FullyConnectedHiddenLayer;
+
+// Fully connected layer with its weights factorized as W = U * V, U being
+// InputDim() x Rank() and V Rank() x OutputDim(), both input major like
+// every weight matrix here. The forward pass is two thin GEMMs through a
+// Rank() wide intermediate, so FLOPs and weight memory shrink by
+// Rank() * (in + out) / (in * out). See FactorizeLayer to create one from
+// a trained FullyConnectedLayer.
+template <typename Activation>
+class LowRankLayer : public BaseLayer
+{
+public:
+    LowRankLayer(int32_t inputDim, int32_t outputDim, int32_t rank)
+        : BaseLayer(inputDim, outputDim),
+        _rank(rank)
+    {
+        assert(rank > 0);
+    }
+
+    LayerKind Kind() const override { return LayerKind::LowRank; }
+    ActivationKind OutputActivation() const override { return Activation::Kind; }
+    uint32_t Option() const override { return static_cast<uint32_t>(_rank); }
+    int32_t Rank() const { return _rank; }
+
+    const float* PreActivations() const override
+    {
+        return Activation::FromPreActivation ? _preActivations.data() : nullptr;
+    }
+
+    // U, then V, then one bias per output neuron.
+    std::vector<ParameterRef> parameters() override
+    {
+        return {
+            { &_weights, static_cast<size_t>(_inputDim) * _rank, &_weightGradients },
+            { &_factor, static_cast<size_t>(_rank) * _outputDim, &_factorGradients },
+            { &_biases, static_cast<size_t>(_outputDim), &_biasGradients }
+        };
+    }
+
+    void initializeWeights() override
+    {
+        _weights.assign(static_cast<size_t>(_inputDim) * _rank, 0.0f);
+        VectorRandomInitialize(_weights);
+        _factor.assign(static_cast<size_t>(_rank) * _outputDim, 0.0f);
+        VectorRandomInitialize(_factor);
+        _biases.assign(_outputDim, 0.0f);
+    }
+
+    void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        _weights.ensureVerified();
+        _factor.ensureVerified();
+        _biases.ensureVerified();
+        // the intermediate is kept for backProp.
+        _hidden.resize(static_cast<size_t>(batchSize) * _rank);
+        DenseForward(input, _weights.data(), nullptr, _hidden.data(), batchSize, _inputDim, _rank, ActivationKind::Identity);
+        float* preActivations = nullptr;
+        if (Activation::FromPreActivation)
+        {
+            _preActivations.resize(static_cast<size_t>(batchSize) * _outputDim);
+            preActivations = _preActivations.data();
+        }
+        DenseForward(_hidden.data(), _factor.data(), output, batchSize, _rank, _outputDim,
+            ActivationEpilogue<Activation>{ _biases.data(), preActivations, _outputDim });
+    }
+
+    void backProp(
+        const float* input,
+        const float* outputDelta,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) override
+    {
+        _hiddenDelta.resize(static_cast<size_t>(batchSize) * _rank);
+        DenseBackwardWeights(_hidden.data(), outputDelta, _factorGradients.data(), _biasGradients.data(), batchSize, _rank, _outputDim);
+        DenseBackwardInput<IdentityActivation>(outputDelta, _factor.data(), _hidden.data(), _hiddenDelta.data(), batchSize, _rank, _outputDim);
+        DenseBackwardWeights(input, _hiddenDelta.data(), _weightGradients.data(), nullptr, batchSize, _inputDim, _rank);
+        if (inputDelta != nullptr)
+        {
+            const float* source = ActivationNeedsPreActivation(inputActivation) ? inputPreActivation : input;
+            DenseBackwardInput(_hiddenDelta.data(), _weights.data(), source, inputDelta, batchSize, _inputDim, _rank, inputActivation);
+        }
+    }
+
+private:
+    int32_t _rank;
+    WeightBuffer _factor;           // V, _weights holds U
+    WeightBuffer _factorGradients;
+    WeightBuffer _biases;
+    WeightBuffer _biasGradients;
+    std::vector<float> _hidden;
+    std::vector<float> _hiddenDelta;
+    std::vector<float> _preActivations;
+};
+
+// Output layer trained on the squared error 0.5 * (output - target)^2.
+template <typename Activation>
+class SquaredErrorOutputLayer : public FullyConnectedLayer<Activation>, public ILossLayer
+{
+public:
+
+    SquaredErrorOutputLayer(int32_t inputDim, int32_t outputDim)
+        : FullyConnectedLayer<Activation>(inputDim, outputDim)
+    {
+
+    }
+
+    LayerKind Kind() const override { return LayerKind::FullyConnectedOutput; }
+
+    // activation, loss and the delta of the pre-activation are all computed
+    // in the GEMM epilogue, one pass over each output tile.
+    float forwardLoss(
+        const float* input,
+        const float* target,
+        float* output,
+        float* delta,
+        int32_t batchSize,
+        float gradientScale) override
+    {
+        this->_weights.ensureVerified();
+        this->_biases.ensureVerified();
+        float loss = 0;
+        int32_t outputDim = this->_outputDim;
+        const float* bias = this->_biases.data();
+        float* preActivations = this->preActivationBuffer(batchSize);
+        DenseForward(input, this->_weights.data(), output, batchSize, this->_inputDim, outputDim,
+            [&](int32_t row, int32_t column, float* values, int32_t count)
+        {
+            size_t offset = static_cast<size_t>(row) * outputDim + column;
+            const float* t = target + offset;
+            float* d = delta + offset;
+            AddBias(values, bias + column, count);
+            if (Activation::FromPreActivation)
+            {
+                std::copy(values, values + count, preActivations + offset);
+            }
+            ApplyActivation<Activation>(values, count);
+            for (int32_t j = 0; j < count; ++j)
+            {
+                float y = values[j];
+                float error = y - t[j];
+                loss += 0.5f * error * error;
+                float source = Activation::FromPreActivation ? preActivations[offset + j] : y;
+                d[j] = gradientScale * error * Activation::Derivative(source);
+            }
+        });
+        return loss;
+    }
+};
+
+typedef SquaredErrorOutputLayer<SigmoidActivation> FullyConnectedOutputLayer;
+
+// Softmax output layer trained on the cross entropy -sum_j target[j] * log(p[j]).
+// Targets are expected to be distributions over the classes, usually one hot.
+//
+// Softmax and loss are fused: the GEMM epilogue adds the bias, folds each
+// tile into an online softmax normalizer and accumulates target . logits,
+// which gives the loss as sum(target) * logSum - target . logits without
+// ever taking the log of a probability. One more pass per row then writes
+// the probabilities and the gradient p - target. There is no softmax
+// Jacobian and no buffer besides the output.
+class SoftmaxCrossEntropyOutputLayer : public FullyConnectedLayer<IdentityActivation>, public ILossLayer
+{
+public:
+
+    SoftmaxCrossEntropyOutputLayer(int32_t inputDim, int32_t outputDim)
+        : FullyConnectedLayer<IdentityActivation>(inputDim, outputDim)
+    {
+    }
+
+    LayerKind Kind() const override { return LayerKind::SoftmaxCrossEntropyOutput; }
+
+    float forwardLoss(
+        const float* input,
+        const float* target,
+        float* output,
+        float* delta,
+        int32_t batchSize,
+        float gradientScale) override
+    {
+        _weights.ensureVerified();
+        _biases.ensureVerified();
+        _rows.resize(batchSize);
+        for (auto& row : _rows)
+        {
+            row.normalizer.reset();
+            row.targetDot = 0.0f;
+            row.targetSum = 0.0f;
+        }
+
+        int32_t outputDim = _outputDim;
+        const float* bias = _biases.data();
+        DenseForward(input, _weights.data(), output, batchSize, _inputDim, outputDim,
+            [&](int32_t row, int32_t column, float* values, int32_t count)
+        {
+            const float* t = target + static_cast<size_t>(row) * outputDim + column;
+            RowState& state = _rows[row];
+            AddBias(values, bias + column, count);
+            state.normalizer.add(values, count);
+            state.targetDot += Dot(t, values, count);
+            for (int32_t j = 0; j < count; ++j)
+            {
+                state.targetSum += t[j];
+            }
+        });
+
+        float loss = 0;
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            const RowState& state = _rows[b];
+            size_t offset = static_cast<size_t>(b) * outputDim;
+            loss += state.targetSum * state.normalizer.logSum() - state.targetDot;
+            SoftmaxCrossEntropyRow(output + offset, target + offset, delta + offset, outputDim, state.normalizer, gradientScale);
+        }
+        return loss;
+    }
+
+private:
+    struct RowState
+    {
+        SoftmaxAccumulator normalizer;
+        float targetDot;
+        float targetSum;
+    };
+
+    std::vector<RowState> _rows;
+};
+
+// Classes are assumed to be numbered by decreasing frequency, as in most
+// vocabularies, and are drawn with replacement from the log uniform
+// (Zipfian) distribution P(c) = log((c + 2) / (c + 1)) / log(classCount + 1).
+class LogUniformSampler
+{
+public:
+    LogUniformSampler(int32_t classCount, uint32_t seed)
+        : _classCount(classCount),
+        _logRange(std::log(static_cast<double>(classCount) + 1.0)),
+        _random(seed)
+    {
+    }
+
+    int32_t sample()
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(_random);
+        int32_t c = static_cast<int32_t>(std::exp(u * _logRange)) - 1;
+        return std::min(std::max(c, 0), _classCount - 1);
+    }
+
+    double probability(int32_t c) const
+    {
+        return std::log((c + 2.0) / (c + 1.0)) / _logRange;
+    }
+
+private:
+    int32_t _classCount;
+    double _logRange;
+    std::mt19937 _random;
+};
+
+// Returns the class of a one hot target row, or the most likely class of a distribution.
+inline int32_t TargetClass(const float* target, int32_t outputDim)
+{
+    return static_cast<int32_t>(std::max_element(target, target + outputDim) - target);
+}
+
+// Base of the output layers for very large class counts. The weights are
+// class major, one contiguous row of InputDim() weights per class, so the
+// few classes evaluated per sample are read as whole rows. backProp
+// accumulates gradients only for the rows in _touchedRows, and
+// zeroGradients clears only those.
+class ClassMajorOutputLayer : public BaseLayer, public ILossLayer
+{
+public:
+    ClassMajorOutputLayer(int32_t inputDim, int32_t outputDim)
+        : BaseLayer(inputDim, outputDim)
+    {
+    }
+
+    std::vector<ParameterRef> parameters() override
+    {
+        return {
+            { &_weights, static_cast<size_t>(_inputDim) * _outputDim, &_weightGradients },
+            { &_biases, static_cast<size_t>(_outputDim), &_biasGradients }
+        };
+    }
+
+    void initializeWeights() override
+    {
+        _weights.assign(static_cast<size_t>(_inputDim) * _outputDim, 0.0f);
+        VectorRandomInitialize(_weights);
+        _biases.assign(_outputDim, 0.0f);
+    }
+
+    void zeroGradients() override
+    {
+        for (int32_t c : _touchedRows)
+        {
+            float* row = _weightGradients.data() + static_cast<size_t>(c) * _inputDim;
+            std::fill(row, row + _inputDim, 0.0f);
+            _biasGradients[c] = 0.0f;
+        }
+        _touchedRows.clear();
+    }
+
+protected:
+    // gradient of the logit of class c for sample x, scaled by 'delta':
+    // accumulates the class row gradient and, unless null, adds the
+    // contribution of the class to the input delta of the sample.
+    void backPropClass(int32_t c, float delta, const float* x, float* inputDelta)
+    {
+        if (delta == 0.0f)
+        {
+            return;
+        }
+        size_t row = static_cast<size_t>(c) * _inputDim;
+        Axpy(delta, x, _weightGradients.data() + row, _inputDim);
+        _biasGradients[c] += delta;
+        if (inputDelta != nullptr)
+        {
+            Axpy(delta, _weights.data() + row, inputDelta, _inputDim);
+        }
+        _touchedRows.push_back(c);
+    }
+
+    WeightBuffer _biases;
+    WeightBuffer _biasGradients;
+    std::vector<int32_t> _touchedRows;
+};
+
+// Softmax cross entropy output for very large class counts, trained with
+// sampled softmax: per batch a set of Option() negative classes is drawn
+// from a LogUniformSampler, and every sample only evaluates the logits of
+// its own target class and of those negatives. Each logit is corrected by
+// subtracting log(expected count of its class in the sample), which makes
+// the sampled loss an unbiased approximation of the full softmax gradient,
+// and negatives that hit the sample's target are dropped.
+//
+// The per sample cost is (Option() + 1) dot products instead of
+// OutputDim(). Finding the target class still scans the target row, but
+// that is OutputDim() reads, not OutputDim() x InputDim() multiply-adds.
+// forwardProp, used for evaluation and inference, computes the full softmax.
+class SampledSoftmaxOutputLayer : public ClassMajorOutputLayer
+{
+public:
+    SampledSoftmaxOutputLayer(int32_t inputDim, int32_t outputDim, int32_t sampleCount)
+        : ClassMajorOutputLayer(inputDim, outputDim),
+        _sampleCount(sampleCount),
+        _sampler(outputDim, 0x5eed)
+    {
+        assert(sampleCount > 0);
+    }
+
+    LayerKind Kind() const override { return LayerKind::SampledSoftmaxOutput; }
+    uint32_t Option() const override { return static_cast<uint32_t>(_sampleCount); }
+
+    // restart the negative sampler, the batches that follow draw the same
+    // negatives every time it is restarted with the same seed.
+    void reseed(uint32_t seed)
+    {
+        _sampler = LogUniformSampler(_outputDim, seed);
+    }
+
+    void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        _weights.ensureVerified();
+        _biases.ensureVerified();
+        ClassMajorSoftmaxForward(input, _weights.data(), _biases.data(), output, batchSize, _inputDim, _outputDim);
+    }
+
+    float forwardLoss(
+        const float* input,
+        const float* target,
+        float*,
+        float*,
+        int32_t batchSize,
+        float gradientScale) override
+    {
+        _weights.ensureVerified();
+        _biases.ensureVerified();
+
+        // one set of negatives for the whole batch, so their rows stay in cache across samples.
+        _sampled.resize(_sampleCount);
+        _sampledCorrection.resize(_sampleCount);
+        for (int32_t s = 0; s < _sampleCount; ++s)
+        {
+            _sampled[s] = _sampler.sample();
+            _sampledCorrection[s] = logExpectedCount(_sampled[s]);
+        }
+
+        int32_t width = _sampleCount + 1;
+        _labels.resize(batchSize);
+        _sampledDelta.resize(static_cast<size_t>(batchSize) * width);
+        float loss = 0;
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            const float* x = input + static_cast<size_t>(b) * _inputDim;
+            float* logits = _sampledDelta.data() + static_cast<size_t>(b) * width;
+            int32_t label = TargetClass(target + static_cast<size_t>(b) * _outputDim, _outputDim);
+            _labels[b] = label;
+
+            // column 0 is the target class, the negatives follow.
+            ClassMajorLogits(x, _weights.data() + static_cast<size_t>(label) * _inputDim, _biases.data() + label, logits, 1, _inputDim);
+            logits[0] -= logExpectedCount(label);
+            for (int32_t s = 0; s < _sampleCount; ++s)
+            {
+                int32_t c = _sampled[s];
+                logits[s + 1] = (c == label) ? -std::numeric_limits<float>::infinity() :
+                    Dot(_weights.data() + static_cast<size_t>(c) * _inputDim, x, _inputDim) + _biases[c] - _sampledCorrection[s];
+            }
+
+            SoftmaxAccumulator normalizer;
+            normalizer.reset();
+            normalizer.add(logits, width);
+            loss += normalizer.logSum() - logits[0];
+            SoftmaxNormalize(logits, width, normalizer);
+            logits[0] -= 1.0f;
+            for (int32_t k = 0; k < width; ++k)
+            {
+                logits[k] *= gradientScale;
+            }
+        }
+        return loss;
+    }
+
+    void backProp(
+        const float* input,
+        const float*,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) override
+    {
+        int32_t width = _sampleCount + 1;
+        if (inputDelta != nullptr)
+        {
+            std::fill(inputDelta, inputDelta + static_cast<size_t>(batchSize) * _inputDim, 0.0f);
+        }
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            const float* x = input + static_cast<size_t>(b) * _inputDim;
+            const float* d = _sampledDelta.data() + static_cast<size_t>(b) * width;
+            float* dx = inputDelta ? inputDelta + static_cast<size_t>(b) * _inputDim : nullptr;
+            backPropClass(_labels[b], d[0], x, dx);
+            for (int32_t s = 0; s < _sampleCount; ++s)
+            {
+                backPropClass(_sampled[s], d[s + 1], x, dx);
+            }
+        }
+        if (inputDelta != nullptr)
+        {
+            const float* source = ActivationNeedsPreActivation(inputActivation) ? inputPreActivation : input;
+            ApplyActivationDerivative(inputActivation, inputDelta, source, batchSize * _inputDim);
+        }
+    }
+
+private:
+    float logExpectedCount(int32_t c) const
+    {
+        return static_cast<float>(std::log(_sampleCount * _sampler.probability(c)));
+    }
+
+    int32_t _sampleCount;
+    LogUniformSampler _sampler;
+    std::vector<int32_t> _sampled;
+    std::vector<float> _sampledCorrection;
+    std::vector<int32_t> _labels;
+    std::vector<float> _sampledDelta;     // logits, then their gradient, batch x (sampleCount + 1)
+};
+
+// number of classes per cluster of a HierarchicalSoftmaxOutputLayer.
+inline int32_t HierarchicalClusterSize(int32_t outputDim)
+{
+    return std::max(1, static_cast<int32_t>(std::ceil(std::sqrt(static_cast<double>(outputDim)))));
+}
+
+// Two level softmax cross entropy output (see HierarchicalSoftmaxForward):
+// the classes are split into about sqrt(OutputDim()) clusters of
+// consecutive ids, a softmax picks the cluster and a second softmax the
+// class inside it. The loss of a sample only needs the cluster logits and
+// the logits of its target's cluster, O(sqrt(OutputDim())) dot products,
+// and so do classProbability and predict at inference time. The gradient
+// is exact. forwardProp writes the full distribution.
+class HierarchicalSoftmaxOutputLayer : public ClassMajorOutputLayer
+{
+public:
+    HierarchicalSoftmaxOutputLayer(int32_t inputDim, int32_t outputDim)
+        : ClassMajorOutputLayer(inputDim, outputDim),
+        _clusterSize(HierarchicalClusterSize(outputDim)),
+        _clusterCount((outputDim + _clusterSize - 1) / _clusterSize)
+    {
+    }
+
+    LayerKind Kind() const override { return LayerKind::HierarchicalSoftmaxOutput; }
+
+    // class rows and biases, then cluster rows and biases.
+    std::vector<ParameterRef> parameters() override
+    {
+        auto params = ClassMajorOutputLayer::parameters();
+        params.push_back({ &_clusterWeights, static_cast<size_t>(_clusterCount) * _inputDim, &_clusterWeightGradients });
+        params.push_back({ &_clusterBiases, static_cast<size_t>(_clusterCount), &_clusterBiasGradients });
+        return params;
+    }
+
+    void initializeWeights() override
+    {
+        ClassMajorOutputLayer::initializeWeights();
+        _clusterWeights.assign(static_cast<size_t>(_clusterCount) * _inputDim, 0.0f);
+        VectorRandomInitialize(_clusterWeights);
+        _clusterBiases.assign(_clusterCount, 0.0f);
+    }
+
+    void zeroGradients() override
+    {
+        ClassMajorOutputLayer::zeroGradients();
+        std::fill(_clusterWeightGradients.begin(), _clusterWeightGradients.end(), 0.0f);
+        std::fill(_clusterBiasGradients.begin(), _clusterBiasGradients.end(), 0.0f);
+    }
+
+    void forwardProp(const float* input, float* output, int32_t batchSize) override
+    {
+        ensureVerified();
+        HierarchicalSoftmaxForward(input, _weights.data(), _biases.data(), _clusterWeights.data(), _clusterBiases.data(),
+            output, batchSize, _inputDim, _outputDim, _clusterSize);
+    }
+
+    float forwardLoss(
+        const float* input,
+        const float* target,
+        float*,
+        float*,
+        int32_t batchSize,
+        float gradientScale) override
+    {
+        ensureVerified();
+        _labels.resize(batchSize);
+        _clusterDelta.resize(static_cast<size_t>(batchSize) * _clusterCount);
+        _classDelta.resize(static_cast<size_t>(batchSize) * _clusterSize);
+        float loss = 0;
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            const float* x = input + static_cast<size_t>(b) * _inputDim;
+            int32_t label = TargetClass(target + static_cast<size_t>(b) * _outputDim, _outputDim);
+            _labels[b] = label;
+            int32_t cluster = label / _clusterSize;
+            int32_t first = cluster * _clusterSize;
+
+            float* clusterLogits = _clusterDelta.data() + static_cast<size_t>(b) * _clusterCount;
+            ClassMajorLogits(x, _clusterWeights.data(), _clusterBiases.data(), clusterLogits, _clusterCount, _inputDim);
+            loss += crossEntropy(clusterLogits, _clusterCount, cluster, gradientScale);
+
+            float* classLogits = _classDelta.data() + static_cast<size_t>(b) * _clusterSize;
+            int32_t count = clusterClassCount(cluster);
+            ClassMajorLogits(x, _weights.data() + static_cast<size_t>(first) * _inputDim, _biases.data() + first, classLogits, count, _inputDim);
+            loss += crossEntropy(classLogits, count, label - first, gradientScale);
+        }
+        return loss;
+    }
+
+    void backProp(
+        const float* input,
+        const float*,
+        float* inputDelta,
+        ActivationKind inputActivation,
+        const float* inputPreActivation,
+        int32_t batchSize) override
+    {
+        if (inputDelta != nullptr)
+        {
+            std::fill(inputDelta, inputDelta + static_cast<size_t>(batchSize) * _inputDim, 0.0f);
+        }
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            const float* x = input + static_cast<size_t>(b) * _inputDim;
+            float* dx = inputDelta ? inputDelta + static_cast<size_t>(b) * _inputDim : nullptr;
+            const float* clusterDelta = _clusterDelta.data() + static_cast<size_t>(b) * _clusterCount;
+            for (int32_t k = 0; k < _clusterCount; ++k)
+            {
+                size_t row = static_cast<size_t>(k) * _inputDim;
+                Axpy(clusterDelta[k], x, _clusterWeightGradients.data() + row, _inputDim);
+                _clusterBiasGradients[k] += clusterDelta[k];
+                if (dx != nullptr)
+                {
+                    Axpy(clusterDelta[k], _clusterWeights.data() + row, dx, _inputDim);
+                }
+            }
+
+            int32_t cluster = _labels[b] / _clusterSize;
+            const float* classDelta = _classDelta.data() + static_cast<size_t>(b) * _clusterSize;
+            for (int32_t j = 0; j < clusterClassCount(cluster); ++j)
+            {
+                backPropClass(cluster * _clusterSize + j, classDelta[j], x, dx);
+            }
+        }
+        if (inputDelta != nullptr)
+        {
+            const float* source = ActivationNeedsPreActivation(inputActivation) ? inputPreActivation : input;
+            ApplyActivationDerivative(inputActivation, inputDelta, source, batchSize * _inputDim);
+        }
+    }
+
+    // p(c | input) of one sample without evaluating the other clusters.
+    float classProbability(const float* input, int32_t c)
+    {
+        ensureVerified();
+        int32_t cluster = c / _clusterSize;
+        int32_t first = cluster * _clusterSize;
+        std::vector<float> clusterProbabilities(_clusterCount);
+        std::vector<float> classProbabilities(clusterClassCount(cluster));
+        ClassMajorLogits(input, _clusterWeights.data(), _clusterBiases.data(), clusterProbabilities.data(), _clusterCount, _inputDim);
+        SoftmaxRows(clusterProbabilities.data(), 1, _clusterCount);
+        ClassMajorLogits(input, _weights.data() + static_cast<size_t>(first) * _inputDim, _biases.data() + first,
+            classProbabilities.data(), clusterClassCount(cluster), _inputDim);
+        SoftmaxRows(classProbabilities.data(), 1, clusterClassCount(cluster));
+        return clusterProbabilities[cluster] * classProbabilities[c - first];
+    }
+
+    // most likely class of one sample, decided greedily: the best class of
+    // the most likely cluster. Usually, but not always, the overall argmax.
+    int32_t predict(const float* input)
+    {
+        ensureVerified();
+        std::vector<float> logits(std::max(_clusterCount, _clusterSize));
+        ClassMajorLogits(input, _clusterWeights.data(), _clusterBiases.data(), logits.data(), _clusterCount, _inputDim);
+        int32_t cluster = static_cast<int32_t>(std::max_element(logits.begin(), logits.begin() + _clusterCount) - logits.begin());
+        int32_t first = cluster * _clusterSize;
+        int32_t count = clusterClassCount(cluster);
+        ClassMajorLogits(input, _weights.data() + static_cast<size_t>(first) * _inputDim, _biases.data() + first, logits.data(), count, _inputDim);
+        return first + static_cast<int32_t>(std::max_element(logits.begin(), logits.begin() + count) - logits.begin());
+    }
+
+    int32_t ClusterSize() const { return _clusterSize; }
+
+private:
+    int32_t clusterClassCount(int32_t cluster) const
+    {
+        return std::min(_clusterSize, _outputDim - cluster * _clusterSize);
+    }
+
+    void ensureVerified()
+    {
+        for (auto& param : parameters())
+        {
+            param.buffer->ensureVerified();
+        }
+    }
+
+    // turns 'logits' into the scaled gradient of the cross entropy against
+    // class 'label' and returns that cross entropy.
+    static float crossEntropy(float* logits, int32_t count, int32_t label, float gradientScale)
+    {
+        SoftmaxAccumulator normalizer;
+        normalizer.reset();
+        normalizer.add(logits, count);
+        float loss = normalizer.logSum() - logits[label];
+        SoftmaxNormalize(logits, count, normalizer);
+        logits[label] -= 1.0f;
+        for (int32_t k = 0; k < count; ++k)
+        {
+            logits[k] *= gradientScale;
+        }
+        return loss;
+    }
+
+    int32_t _clusterSize;
+    int32_t _clusterCount;
+    WeightBuffer _clusterWeights;
+    WeightBuffer _clusterWeightGradients;
+    WeightBuffer _clusterBiases;
+    WeightBuffer _clusterBiasGradients;
+    std::vector<int32_t> _labels;
+    std::vector<float> _clusterDelta;     // cluster logits, then their gradient, batch x clusterCount
+    std::vector<float> _classDelta;       // same for the classes of the target cluster, batch x clusterSize
+};
+
+typedef std::vector<std::shared_ptr<BaseLayer>> LayerSet;
+
+////////////////////////////////////////
+// Optimizers
+//
+// An Optimizer applies the gradients a Trainer step left in the layers.
+// It moves every parameter array of the network into one arena, each array
+// directly followed by the optimizer state it needs (momentum, second
+// moment), and points the layers' WeightBuffers at it. The update of an
+// array is a single fused pass reading weights, gradient and state and
+// writing them back: optimizer steps are memory bound, so every byte is
+// streamed once. Networks larger than a chunk are updated by several
+// threads, a chunk at a time.
+//
+// Parameters with row sparse gradients (ParameterRef::rows) are updated
+// lazily: only the listed rows and their state move.
+////////////////////////////////////////
+
+enum class OptimizerKind : uint32_t
+{
+    Sgd = 1,
+    Momentum = 2,       // heavy ball
+    Nesterov = 3,
+    Adam = 4,
+    AdamW = 5,          // Adam with decoupled weight decay
+};
+
+struct OptimizerOptions
+{
+    OptimizerKind kind = OptimizerKind::Adam;
+    float learningRate = 0.001f;
+    float momentum = 0.9f;          // Momentum and Nesterov
+    float beta1 = 0.9f;             // Adam and AdamW
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weightDecay = 0.01f;      // AdamW
+    int32_t threads = 0;            // 0 = one per hardware thread
+};
+
+// number of state arrays kept per parameter array.
+int32_t OptimizerStateCount(OptimizerKind kind)
+{
+    switch (kind)
+    {
+    case OptimizerKind::Sgd:
+        return 0;
+    case OptimizerKind::Momentum:
+    case OptimizerKind::Nesterov:
+        return 1;
+    case OptimizerKind::Adam:
+    case OptimizerKind::AdamW:
+        return 2;
+    }
+    return 0;
+}
+
+// w -= rate * g
+void SgdUpdate(float* weights, const float* gradient, size_t count, float rate)
+{
+    SimdFloat negativeRate = SimdBroadcast(-rate);
+    size_t k = 0;
+    for (; k + SimdWidth <= count; k += SimdWidth)
+    {
+        SimdStore(weights + k, SimdMulAdd(negativeRate, SimdLoad(gradient + k), SimdLoad(weights + k)));
+    }
+    for (; k < count; ++k)
+    {
+        weights[k] -= rate * gradient[k];
+    }
+}
+
+// v = momentum * v + g, then w -= rate * v, or w -= rate * (g + momentum * v) for Nesterov.
+template <bool Nesterov>
+void MomentumUpdate(float* weights, float* velocity, const float* gradient, size_t count, float rate, float momentum)
+{
+    SimdFloat negativeRate = SimdBroadcast(-rate);
+    SimdFloat mu = SimdBroadcast(momentum);
+    size_t k = 0;
+    for (; k + SimdWidth <= count; k += SimdWidth)
+    {
+        SimdFloat g = SimdLoad(gradient + k);
+        SimdFloat v = SimdMulAdd(mu, SimdLoad(velocity + k), g);
+        SimdFloat direction = Nesterov ? SimdMulAdd(mu, v, g) : v;
+        SimdStore(velocity + k, v);
+        SimdStore(weights + k, SimdMulAdd(negativeRate, direction, SimdLoad(weights + k)));
+    }
+    for (; k < count; ++k)
+    {
+        float v = momentum * velocity[k] + gradient[k];
+        velocity[k] = v;
+        weights[k] -= rate * (Nesterov ? gradient[k] + momentum * v : v);
+    }
+}
+
+// Adam as in Kingma and Ba, with the bias corrections folded into
+// stepSize = rate * sqrt(1 - beta2^t) / (1 - beta1^t). The weights are
+// scaled by 'decay' first: 1 for Adam, 1 - rate * weightDecay for AdamW.
+void AdamUpdate(
+    float* weights,
+    float* mean,
+    float* variance,
+    const float* gradient,
+    size_t count,
+    float stepSize,
+    float beta1,
+    float beta2,
+    float epsilon,
+    float decay)
+{
+    SimdFloat b1 = SimdBroadcast(beta1);
+    SimdFloat b2 = SimdBroadcast(beta2);
+    SimdFloat oneMinusB1 = SimdBroadcast(1.0f - beta1);
+    SimdFloat oneMinusB2 = SimdBroadcast(1.0f - beta2);
+    SimdFloat eps = SimdBroadcast(epsilon);
+    SimdFloat negativeStep = SimdBroadcast(-stepSize);
+    SimdFloat scale = SimdBroadcast(decay);
+    size_t k = 0;
+    for (; k + SimdWidth <= count; k += SimdWidth)
+    {
+        SimdFloat g = SimdLoad(gradient + k);
+        SimdFloat m = SimdMulAdd(b1, SimdLoad(mean + k), SimdMul(oneMinusB1, g));
+        SimdFloat v = SimdMulAdd(b2, SimdLoad(variance + k), SimdMul(oneMinusB2, SimdMul(g, g)));
+        SimdStore(mean + k, m);
+        SimdStore(variance + k, v);
+        SimdFloat direction = SimdDiv(m, SimdAdd(SimdSqrt(v), eps));
+        SimdStore(weights + k, SimdMulAdd(negativeStep, direction, SimdMul(scale, SimdLoad(weights + k))));
+    }
+    for (; k < count; ++k)
+    {
+        float g = gradient[k];
+        float m = beta1 * mean[k] + (1.0f - beta1) * g;
+        float v = beta2 * variance[k] + (1.0f - beta2) * g * g;
+        mean[k] = m;
+        variance[k] = v;
+        weights[k] = decay * weights[k] - stepSize * m / (std::sqrt(v) + epsilon);
+    }
+}
+
+class Optimizer
+{
+public:
+    // state arrays per parameter array are numbered from this slot on, see stateArrays().
+    static const uint32_t kStateSlots = 2;
+    // values updated per work item; arrays up to this size are a single item.
+    static const size_t kChunk = 1 << 16;
+
+    // moves the weights of 'layers', which must all be initialized and
+    // outlive the Optimizer, into the arena.
+    Optimizer(LayerSet& layers, const OptimizerOptions& options)
+        : _options(options),
+        _stateCount(OptimizerStateCount(options.kind)),
+        _threads(options.threads > 0 ? options.threads : static_cast<int32_t>(std::max(1u, std::thread::hardware_concurrency())))
+    {
+        // every array starts on a cache line.
+        auto padded = [](size_t count) { return (count + 15) & ~static_cast<size_t>(15); };
+        size_t total = 0;
+        for (uint32_t layerIndex = 0; layerIndex < layers.size(); ++layerIndex)
+        {
+            auto params = layers[layerIndex]->parameters();
+            for (uint32_t slot = 0; slot < params.size(); ++slot)
+            {
+                assert(params[slot].buffer->size() == params[slot].count);
+                size_t stride = padded(params[slot].count);
+                _arrays.push_back({ layerIndex, slot, layers[layerIndex].get(), params[slot], total, stride });
+                total += stride * (1 + _stateCount);
+            }
+        }
+
+        _arena = std::make_shared<Arena>(total, 0.0f);
+        for (auto& array : _arrays)
+        {
+            WeightBuffer* buffer = array.param.buffer;
+            buffer->ensureVerified();
+            float* weights = _arena->data() + array.offset;
+            std::copy(buffer->begin(), buffer->end(), weights);
+            buffer->attach(weights, array.param.count, _arena);
+        }
+
+        // the calling thread takes part in every step, the others wait in run() between steps.
+        for (int32_t i = 1; i < _threads; ++i)
+        {
+            _workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~Optimizer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& thread : _workers)
+        {
+            thread.join();
+        }
+    }
+
+    const OptimizerOptions& Options() const { return _options; }
+    uint64_t Step() const { return _step; }
+    void setStep(uint64_t step) { _step = step; }
+
+    // apply the gradients currently held by the layers.
+    void step()
+    {
+        ++_step;
+        _work.clear();
+        // which rows have a gradient changes from step to step.
+        BaseLayer* owner = nullptr;
+        std::vector<ParameterRef> params;
+        for (auto& array : _arrays)
+        {
+            if (array.owner != owner)
+            {
+                owner = array.owner;
+                params = owner->parameters();
+            }
+            array.param.rows = params[array.slot].rows;
+            array.param.rowSize = params[array.slot].rowSize;
+            array.param.rowsInPlace = params[array.slot].rowsInPlace;
+        }
+        for (auto& array : _arrays)
+        {
+            if (array.param.rows != nullptr)
+            {
+                size_t rows = array.param.rows->size();
+                size_t rowsPerItem = std::max<size_t>(1, kChunk / array.param.rowSize);
+                for (size_t begin = 0; begin < rows; begin += rowsPerItem)
+                {
+                    _work.push_back({ &array, begin, std::min(rows, begin + rowsPerItem) });
+                }
+            }
+            else
+            {
+                for (size_t begin = 0; begin < array.param.count; begin += kChunk)
+                {
+                    _work.push_back({ &array, begin, std::min(array.param.count, begin + kChunk) });
+                }
+            }
+        }
+
+        double t = static_cast<double>(_step);
+        _stepSize = static_cast<float>(_options.learningRate *
+            std::sqrt(1.0 - std::pow(_options.beta2, t)) / (1.0 - std::pow(_options.beta1, t)));
+        _decay = _options.kind == OptimizerKind::AdamW ? 1.0f - _options.learningRate * _options.weightDecay : 1.0f;
+
+        _next = 0;
+        if (_workers.empty() || _work.size() <= 1)
+        {
+            drain();
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_generation;
+        _busy = static_cast<int32_t>(_workers.size());
+        lock.unlock();
+        _wake.notify_all();
+        drain();
+        lock.lock();
+        _idle.wait(lock, [this]() { return _busy == 0; });
+    }
+
+    // optimizer state of one parameter array, 'slot' being the parameter
+    // slot * kStateSlots + the index of the state array.
+    struct StateArray
+    {
+        uint32_t layer;
+        uint32_t slot;
+        float* data;
+        size_t count;
+    };
+
+    std::vector<StateArray> stateArrays() const
+    {
+        std::vector<StateArray> states;
+        for (auto& array : _arrays)
+        {
+            for (int32_t k = 0; k < _stateCount; ++k)
+            {
+                states.push_back({ array.layer, array.slot * kStateSlots + k, state(array, k), array.param.count });
+            }
+        }
+        return states;
+    }
+
+private:
+    typedef std::vector<float, AlignedAllocator<float, 64>> Arena;
+
+    struct Array
+    {
+        uint32_t layer;
+        uint32_t slot;
+        BaseLayer* owner;
+        ParameterRef param;
+        size_t offset;      // of the weights in the arena, state k follows at offset + (k + 1) * stride
+        size_t stride;
+    };
+
+    // values [begin, end) of a dense array, or rows [begin, end) of param.rows.
+    struct WorkItem
+    {
+        Array* array;
+        size_t begin;
+        size_t end;
+    };
+
+    // worker thread: runs its share of the items of every step until the Optimizer is destroyed.
+    void run()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [&]() { return _stop || _generation != seen; });
+            if (_stop)
+            {
+                break;
+            }
+
+            seen = _generation;
+            lock.unlock();
+            drain();
+            lock.lock();
+            if (--_busy == 0)
+            {
+                _idle.notify_all();
+            }
+        }
+    }
+
+    // update work items until none are left.
+    void drain()
+    {
+        for (size_t k = _next++; k < _work.size(); k = _next++)
+        {
+            update(_work[k]);
+        }
+    }
+
+    float* state(const Array& array, int32_t k) const
+    {
+        return _arena->data() + array.offset + (k + 1) * array.stride;
+    }
+
+    void update(const WorkItem& item)
+    {
+        const Array& array = *item.array;
+        const float* gradient = array.param.gradient->data();
+        if (array.param.rows == nullptr)
+        {
+            update(array, item.begin, gradient + item.begin, item.end - item.begin);
+            return;
+        }
+        size_t rowSize = static_cast<size_t>(array.param.rowSize);
+        for (size_t k = item.begin; k < item.end; ++k)
+        {
+            size_t first = static_cast<size_t>((*array.param.rows)[k]) * rowSize;
+            update(array, first, gradient + (array.param.rowsInPlace ? first : k * rowSize), rowSize);
+        }
+    }
+
+    // update the 'count' values from 'first' on with 'gradient'.
+    void update(const Array& array, size_t first, const float* gradient, size_t count)
+    {
+        float* weights = _arena->data() + array.offset + first;
+        switch (_options.kind)
+        {
+        case OptimizerKind::Sgd:
+            SgdUpdate(weights, gradient, count, _options.learningRate);
+            break;
+        case OptimizerKind::Momentum:
+            MomentumUpdate<false>(weights, state(array, 0) + first, gradient, count, _options.learningRate, _options.momentum);
+            break;
+        case OptimizerKind::Nesterov:
+            MomentumUpdate<true>(weights, state(array, 0) + first, gradient, count, _options.learningRate, _options.momentum);
+            break;
+        case OptimizerKind::Adam:
+        case OptimizerKind::AdamW:
+            AdamUpdate(weights, state(array, 0) + first, state(array, 1) + first, gradient, count,
+                _stepSize, _options.beta1, _options.beta2, _options.epsilon, _decay);
+            break;
+        }
+    }
+
+    OptimizerOptions _options;
+    int32_t _stateCount;
+    int32_t _threads;
+    std::vector<Array> _arrays;
+    std::shared_ptr<Arena> _arena;
+    std::vector<WorkItem> _work;
+    uint64_t _step = 0;
+    float _stepSize = 0;
+    float _decay = 1;
+
+    // the pool step() hands _work to; _next is the next item to take.
+    std::vector<std::thread> _workers;
+    std::atomic<size_t> _next{ 0 };
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    uint64_t _generation = 0;   // steps handed to the pool so far
+    int32_t _busy = 0;          // workers still in the current step
+    bool _stop = false;
+};
+
+////////////////////////////////////////
+// Input Data and Data Source Related Stuff
+////////////////////////////////////////
+
+struct InputData
+{
+    InputData() {}
+
+    // a dense sample.
+    InputData(std::vector<float> input, std::vector<float> target)
+        : _input(std::move(input)),
+        _target(std::move(target))
+    {
+    }
+
+    std::vector<float> _input;
+    std::vector<float> _target;
+    // sparse samples keep only their nonzero features: feature
+    // _inputIndices[k] has the value _input[k], all others are zero.
+    bool _sparse = false;
+    std::vector<int32_t> _inputIndices;
+};
+
+// dense samples stored row major, ready for Trainer::trainStep.
+struct MiniBatch
+{
+    std::vector<float> inputs;      // size x input dimension
+    std::vector<float> targets;     // size x target dimension
+    int32_t size = 0;
+
+    void clear()
+    {
+        inputs.clear();
+        targets.clear();
+        size = 0;
+    }
+
+    void add(const float* input, size_t inputCount, const float* target, size_t targetCount)
+    {
+        inputs.insert(inputs.end(), input, input + inputCount);
+        targets.insert(targets.end(), target, target + targetCount);
+        size++;
+    }
+};
+
+// source for the input data to neural network
+// This is a generic class that exposes an interface to fetch input sample
+// one by one. Concrete implementations can be backed by either a database, or a static dataset
+class IDataFeed
+{
+public:
+    virtual ~IDataFeed() {}
+
+    virtual bool getNext(InputData& input) = 0;   
+
+    // the next up to 'maxSamples' dense samples, false once the feed is
+    // exhausted. Feeds that parse into flat arrays override this; the
+    // default gathers samples from getNext.
+    virtual bool getNextBatch(int32_t maxSamples, MiniBatch& batch)
+    {
+        batch.clear();
+        InputData input;
+        while (batch.size < maxSamples && getNext(input))
+        {
+            if (input._sparse)
+            {
+                // their value arrays differ in length, see Trainer for sparse batches.
+                std::cerr << "sparse samples cannot be gathered into a dense batch" << std::endl;
+                batch.clear();
+                return false;
+            }
+            batch.add(input._input.data(), input._input.size(), input._target.data(), input._target.size());
+        }
+        return batch.size > 0;
+    }
+
+    // like getNextBatch, but 'batch' may point at a batch the feed owns
+    // instead of at 'scratch', valid until the next call on the feed.
+    // Feeds that share their batches override this to save the copy.
+    virtual bool getNextBatchView(int32_t maxSamples, MiniBatch& scratch, const MiniBatch*& batch)
+    {
+        batch = &scratch;
+        return getNextBatch(maxSamples, scratch);
+    }
+
+    // rewind for another epoch, in a new order if the feed shuffles.
+    // Feeds that cannot be replayed return false.
+    virtual bool reset() { return false; }
+};
+
+// Sample orders for successive epochs of a feed with 'count' samples.
+// Only indices are permuted, never the samples themselves. The order of
+// the following epoch is computed on a background thread while the
+// current one is consumed, so reset() never waits on the shuffle.
+//
+// With a 'blockSize' the shuffle is block local: the blocks of blockSize
+// consecutive samples are visited in random order and the samples inside
+// a block in random order, so a feed reading from a mapped file touches
+// every block once per epoch, in one short burst.
+class EpochShuffler
+{
+public:
+    EpochShuffler(size_t count, uint64_t seed, size_t blockSize = 0)
+        : _count(count),
+        _seed(seed),
+        _blockSize(blockSize)
+    {
+        assert(count <= std::numeric_limits<uint32_t>::max());
+        prepare();
+    }
+
+    ~EpochShuffler()
+    {
+        if (_pending.valid())
+        {
+            _pending.wait();
+        }
+    }
+
+    // order of the next epoch, the first call gives epoch 0.
+    const std::vector<uint32_t>& next()
+    {
+        _order = _pending.get();
+        ++_epoch;
+        prepare();
+        return _order;
+    }
+
+    const std::vector<uint32_t>& Order() const { return _order; }
+
+    static std::vector<uint32_t> Permutation(size_t count, uint64_t seed, uint32_t epoch, size_t blockSize)
+    {
+        std::seed_seq sequence = { static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32), epoch };
+        std::mt19937 engine(sequence);
+        std::vector<uint32_t> order(count);
+        if (blockSize == 0 || blockSize >= count)
+        {
+            for (uint32_t k = 0; k < count; ++k)
+            {
+                order[k] = k;
+            }
+            std::shuffle(order.begin(), order.end(), engine);
+            return order;
+        }
+
+        std::vector<uint32_t> blocks((count + blockSize - 1) / blockSize);
+        for (uint32_t b = 0; b < blocks.size(); ++b)
+        {
+            blocks[b] = b;
+        }
+        std::shuffle(blocks.begin(), blocks.end(), engine);
+        auto out = order.begin();
+        for (uint32_t b : blocks)
+        {
+            auto first = out;
+            size_t begin = static_cast<size_t>(b) * blockSize;
+            size_t end = std::min(count, begin + blockSize);
+            for (size_t k = begin; k < end; ++k)
+            {
+                *out++ = static_cast<uint32_t>(k);
+            }
+            std::shuffle(first, out, engine);
+        }
+        return order;
+    }
+
+private:
+    void prepare()
+    {
+        size_t count = _count;
+        uint64_t seed = _seed;
+        uint32_t epoch = _epoch;
+        size_t blockSize = _blockSize;
+        _pending = std::async(std::launch::async, [=]() { return Permutation(count, seed, epoch, blockSize); });
+    }
+
+    size_t _count;
+    uint64_t _seed;
+    size_t _blockSize;
+    uint32_t _epoch = 0;
+    std::vector<uint32_t> _order;
+    std::future<std::vector<uint32_t>> _pending;
+};
+
+class StaticDataFeed : public IDataFeed
+{
+public:
+
+    // 'shuffle' visits the samples in a new random order every epoch.
+    StaticDataFeed(std::vector<InputData> dataset, bool shuffle = false, uint64_t seed = 0)
+        : _dataset(dataset),
+        _currentOffset(0)
+    {
+        std::cout << "dataset size: " << _dataset.size() << "   " << _dataset[0]._input.size() << std::endl;
+        if (shuffle)
+        {
+            _shuffler.reset(new EpochShuffler(_dataset.size(), seed));
+            _shuffler->next();
+        }
+    }
+
+    bool getNext(InputData& input) override
+    {
+        if (_currentOffset < _dataset.size())
+        {
+            size_t index = _shuffler ? _shuffler->Order()[_currentOffset] : _currentOffset;
+            _currentOffset++;
+            input = _dataset[index];
+            return true;
+        }
+
+        return false;
+    }
+
+    bool reset() override
+    {
+        if (_shuffler)
+        {
+            _shuffler->next();
+        }
+        _currentOffset = 0;
+        return true;
+    }
+    
+private:
+    std::vector<InputData> _dataset;
+    size_t _currentOffset;
+    std::unique_ptr<EpochShuffler> _shuffler;
+};
+
+// Random access to the samples of a dataset, for feeds that split it
+// between several readers. read() must be safe to call concurrently.
+class IRandomAccessDataset
+{
+public:
+    virtual ~IRandomAccessDataset() {}
+    virtual size_t Size() const = 0;
+    virtual void read(size_t index, InputData& input) const = 0;
+};
+
+class InMemoryDataset : public IRandomAccessDataset
+{
+public:
+    InMemoryDataset(std::vector<InputData> samples)
+        : _samples(std::move(samples))
+    {}
+
+    size_t Size() const override { return _samples.size(); }
+    void read(size_t index, InputData& input) const override { input = _samples[index]; }
+
+private:
+    std::vector<InputData> _samples;
+};
+
+enum class ShardPartition
+{
+    Range,      // shard i reads a contiguous slice of the samples
+    Stride,     // shard i reads samples i, i + shards, i + 2 * shards, ...
+};
+
+struct ShardOptions
+{
+    ShardPartition partition = ShardPartition::Range;
+    // a shard that runs out takes half of what is left of the largest shard.
+    bool rebalance = true;
+    // a new sample order every epoch, see EpochShuffler; shards then
+    // partition the shuffled order.
+    bool shuffle = false;
+    uint64_t seed = 0;
+};
+
+// Splits a dataset between 'shards' readers, typically one trainer
+// thread each, every reader getting its own IDataFeed from shard().
+// Each shard has its own cursor on its own cache line, so readers never
+// contend with each other; the only shared writes are rebalancing steals,
+// which happen once a shard is exhausted.
+//
+// Epochs: reset() on a shard feed waits until every shard feed has been
+// reset, then all start the next epoch together. Every reader has to
+// reset its feed, or the others wait forever.
+//
+// Create it with std::make_shared, the feeds keep it alive.
+class ShardedDataset : public std::enable_shared_from_this<ShardedDataset>
+{
+public:
+    ShardedDataset(std::shared_ptr<const IRandomAccessDataset> dataset, int32_t shards, const ShardOptions& options = ShardOptions())
+        : _dataset(dataset),
+        _shardCount(shards),
+        _options(options),
+        _shards(shards)
+    {
+        assert(shards > 0 && dataset->Size() <= std::numeric_limits<uint32_t>::max());
+        if (options.shuffle)
+        {
+            _shuffler.reset(new EpochShuffler(dataset->Size(), options.seed));
+        }
+        startEpoch();
+    }
+
+    int32_t ShardCount() const { return _shardCount; }
+    uint64_t Steals() const { return _steals; }
+
+    // the feed of reader 'index', every shard is meant to be read from one thread.
+    std::shared_ptr<IDataFeed> shard(int32_t index);
+
+    // range of shard positions handed out together, 'first' and 'stride'
+    // map a position p to the sample at first + p * stride of the epoch order.
+    struct Span
+    {
+        uint32_t first;
+        uint32_t stride;
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // next position of shard 'index', false once it is exhausted.
+    bool take(int32_t index, size_t& sample)
+    {
+        Shard& shard = _shards[index];
+        uint64_t cursor = shard.cursor.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            uint32_t begin = static_cast<uint32_t>(cursor);
+            uint32_t end = static_cast<uint32_t>(cursor >> 32);
+            if (begin >= end)
+            {
+                return false;
+            }
+            if (shard.cursor.compare_exchange_weak(cursor, Pack(begin + 1, end), std::memory_order_relaxed))
+            {
+                sample = sampleAt(shard.first, shard.stride, begin);
+                return true;
+            }
+        }
+    }
+
+    // move the upper half of the largest shard other than 'thief' into 'span'.
+    bool steal(int32_t thief, Span& span)
+    {
+        if (!_options.rebalance)
+        {
+            return false;
+        }
+        for (;;)
+        {
+            int32_t victim = -1;
+            uint32_t largest = 1;
+            for (int32_t i = 0; i < _shardCount; ++i)
+            {
+                uint64_t cursor = _shards[i].cursor.load(std::memory_order_relaxed);
+                uint32_t remaining = static_cast<uint32_t>(cursor >> 32) - std::min(static_cast<uint32_t>(cursor), static_cast<uint32_t>(cursor >> 32));
+                if (i != thief && remaining > largest)
+                {
+                    victim = i;
+                    largest = remaining;
+                }
+            }
+            if (victim < 0)
+            {
+                return false;
+            }
+
+            Shard& shard = _shards[victim];
+            uint64_t cursor = shard.cursor.load(std::memory_order_relaxed);
+            uint32_t begin = static_cast<uint32_t>(cursor);
+            uint32_t end = static_cast<uint32_t>(cursor >> 32);
+            if (end <= begin + 1)
+            {
+                continue;
+            }
+            uint32_t middle = begin + (end - begin) / 2;
+            if (shard.cursor.compare_exchange_strong(cursor, Pack(begin, middle), std::memory_order_relaxed))
+            {
+                span = { shard.first, shard.stride, middle, end };
+                _steals++;
+                return true;
+            }
+        }
+    }
+
+    size_t sampleAt(uint32_t first, uint32_t stride, uint32_t position) const
+    {
+        size_t index = first + static_cast<size_t>(position) * stride;
+        return _shuffler ? _shuffler->Order()[index] : index;
+    }
+
+    const IRandomAccessDataset& Dataset() const { return *_dataset; }
+
+    // barrier for reset(), the last shard to arrive starts the next epoch.
+    void waitForEpoch()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t generation = _generation;
+        if (++_arrived == _shardCount)
+        {
+            _arrived = 0;
+            startEpoch();
+            ++_generation;
+            _epochStarted.notify_all();
+            return;
+        }
+        _epochStarted.wait(lock, [&]() { return _generation != generation; });
+    }
+
+private:
+    // aligned so that every cursor has a cache line to itself.
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> cursor;   // next position in the low 32 bits, end position in the high 32 bits
+        uint32_t first;
+        uint32_t stride;
+    };
+
+    static uint64_t Pack(uint32_t begin, uint32_t end)
+    {
+        return static_cast<uint64_t>(end) << 32 | begin;
+    }
+
+    void startEpoch()
+    {
+        if (_shuffler)
+        {
+            _shuffler->next();
+        }
+        size_t count = _dataset->Size();
+        for (int32_t i = 0; i < _shardCount; ++i)
+        {
+            Shard& shard = _shards[i];
+            if (_options.partition == ShardPartition::Range)
+            {
+                size_t begin = count * i / _shardCount;
+                size_t end = count * (i + 1) / _shardCount;
+                shard.first = static_cast<uint32_t>(begin);
+                shard.stride = 1;
+                shard.cursor.store(Pack(0, static_cast<uint32_t>(end - begin)));
+            }
+            else
+            {
+                size_t length = count > static_cast<size_t>(i) ? (count - i + _shardCount - 1) / _shardCount : 0;
+                shard.first = static_cast<uint32_t>(i);
+                shard.stride = static_cast<uint32_t>(_shardCount);
+                shard.cursor.store(Pack(0, static_cast<uint32_t>(length)));
+            }
+        }
+    }
+
+    std::shared_ptr<const IRandomAccessDataset> _dataset;
+    int32_t _shardCount;
+    ShardOptions _options;
+    // new[] ignores alignas before C++17, the allocator honors it.
+    std::vector<Shard, AlignedAllocator<Shard, 64>> _shards;
+    std::unique_ptr<EpochShuffler> _shuffler;
+    std::atomic<uint64_t> _steals{ 0 };
+    std::mutex _mutex;
+    std::condition_variable _epochStarted;
+    int32_t _arrived = 0;
+    uint64_t _generation = 0;
+};
+
+// The feed of one shard of a ShardedDataset. Samples stolen from another
+// shard are kept in a private span, so only the steal itself is shared.
+class ShardedDataFeed : public IDataFeed
+{
+public:
+    ShardedDataFeed(std::shared_ptr<ShardedDataset> owner, int32_t index)
+        : _owner(owner),
+        _index(index)
+    {}
+
+    bool getNext(InputData& input) override
+    {
+        size_t sample = 0;
+        if (_stolen.begin < _stolen.end)
+        {
+            sample = _owner->sampleAt(_stolen.first, _stolen.stride, _stolen.begin++);
+        }
+        else if (!_owner->take(_index, sample))
+        {
+            if (!_owner->steal(_index, _stolen))
+            {
+                return false;
+            }
+            sample = _owner->sampleAt(_stolen.first, _stolen.stride, _stolen.begin++);
+        }
+        _owner->Dataset().read(sample, input);
+        return true;
+    }
+
+    bool reset() override
+    {
+        _stolen = {};
+        _owner->waitForEpoch();
+        return true;
+    }
+
+private:
+    std::shared_ptr<ShardedDataset> _owner;
+    int32_t _index;
+    ShardedDataset::Span _stolen = {};
+};
+
+std::shared_ptr<IDataFeed> ShardedDataset::shard(int32_t index)
+{
+    assert(index >= 0 && index < _shardCount);
+    return std::make_shared<ShardedDataFeed>(shared_from_this(), index);
+}
+
+////////////////////////////////////////
+// CSV data feed
+//
+// Streams a CSV file of dense samples: each row holds the input values
+// followed by the target values. Worker threads take turns reading the
+// next chunk of the file, cut at its last newline, and parse it into a
+// MiniBatch while the others read and parse theirs. Chunks are handed
+// out in file order, so the feed is deterministic.
+//
+// Fields are parsed in place by ParseCsvFloat, without iostreams and
+// without allocating per field or row.
+////////////////////////////////////////
+
+// SWAR digit helpers: eight ASCII digits are checked and converted with a
+// few 64 bit operations instead of eight dependent multiply adds. They
+// read the bytes as a little endian word.
+inline uint64_t LoadEightBytes(const char* text)
+{
+    uint64_t value;
+    std::memcpy(&value, text, sizeof(value));
+    return value;
+}
+
+inline bool IsEightDigits(uint64_t value)
+{
+    return ((value & 0xF0F0F0F0F0F0F0F0ull) |
+        (((value + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) == 0x3333333333333333ull;
+}
+
+inline uint32_t ParseEightDigits(uint64_t value)
+{
+    value = (value & 0x0F0F0F0F0F0F0F0Full) * 2561 >> 8;
+    value = (value & 0x00FF00FF00FF00FFull) * 6553601 >> 16;
+    return static_cast<uint32_t>((value & 0x0000FFFF0000FFFFull) * 42949672960001ull >> 32);
+}
+
+// accumulate the digits at 'text' into 'mantissa', returns the end of the digits.
+inline const char* ParseDigits(const char* text, const char* end, uint64_t& mantissa, int32_t& digits)
+{
+    while (end - text >= 8 && digits + 8 <= 19 && IsEightDigits(LoadEightBytes(text)))
+    {
+        mantissa = mantissa * 100000000 + ParseEightDigits(LoadEightBytes(text));
+        digits += 8;
+        text += 8;
+    }
+    while (text < end && *text >= '0' && *text <= '9')
+    {
+        mantissa = mantissa * 10 + (*text - '0');
+        digits++;
+        text++;
+    }
+    return text;
+}
+
+// parse the decimal number at 'text', returns its end, or 'text' if there
+// is no number. Mantissas of up to 19 digits with a small exponent take
+// the fast path; anything else (inf, nan, longer mantissas) goes to
+// strtof, which needs the text to end in a null character somewhere.
+// The fast path gives the value strtof would: the double it computes is
+// correctly rounded, and rounding that to float only differs from
+// rounding the decimal when the double lands exactly halfway between two
+// floats, which goes to strtof too.
+const char* ParseCsvFloat(const char* text, const char* end, float& value)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char* p = text;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int32_t digits = 0;
+    const char* integerEnd = ParseDigits(p, end, mantissa, digits);
+    int32_t exponent = 0;
+    const char* numberEnd = integerEnd;
+    if (numberEnd < end && *numberEnd == '.')
+    {
+        int32_t integerDigits = digits;
+        numberEnd = ParseDigits(numberEnd + 1, end, mantissa, digits);
+        exponent = integerDigits - digits;
+    }
+    bool fast = digits > 0 && digits <= 19;
+    if (fast && numberEnd < end && (*numberEnd == 'e' || *numberEnd == 'E'))
+    {
+        const char* e = numberEnd + 1;
+        bool negativeExponent = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+'))
+        {
+            e++;
+        }
+        int32_t explicitExponent = 0;
+        const char* exponentEnd = e;
+        while (exponentEnd < end && *exponentEnd >= '0' && *exponentEnd <= '9' && explicitExponent < 10000)
+        {
+            explicitExponent = explicitExponent * 10 + (*exponentEnd++ - '0');
+        }
+        fast = exponentEnd != e;
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+        numberEnd = exponentEnd;
+    }
+
+    if (fast && exponent >= -22 && exponent <= 22 && mantissa <= (1ull << 53))
+    {
+        double result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+        // the result is within the normal float range, so a float has the
+        // top 24 of its 53 significant bits and halfway means the low 29
+        // bits are 1 followed by zeros.
+        uint64_t bits;
+        std::memcpy(&bits, &result, sizeof(bits));
+        if ((bits & ((1ull << 29) - 1)) != (1ull << 28))
+        {
+            value = static_cast<float>(negative ? -result : result);
+            return numberEnd;
+        }
+    }
+
+    // strtof skips white space, which could take it to the next line.
+    if (text == end || *text == ' ' || *text == '\t' || *text == '\r' || *text == '\n')
+    {
+        return text;
+    }
+    char* parsedEnd = nullptr;
+    value = std::strtof(text, &parsedEnd);
+    return parsedEnd > end ? text : parsedEnd;
+}
+
+struct CsvOptions
+{
+    int32_t inputColumns = 0;
+    int32_t targetColumns = 0;
+    char delimiter = ',';
+    bool header = false;                // skip the first line
+    size_t chunkBytes = 1 << 22;        // read and parsed as a unit
+    int32_t threads = 0;                // 0 = one per hardware thread
+};
+
+class CsvDataFeed : public IDataFeed
+{
+public:
+    CsvDataFeed(const std::string& path, const CsvOptions& options)
+        : _path(path),
+        _options(options),
+        _threadCount(options.threads > 0 ? options.threads : static_cast<int32_t>(std::max(1u, std::thread::hardware_concurrency()))),
+        // enough chunks in flight for every worker to be busy while the consumer drains one.
+        _slots(2 * _threadCount + 1)
+    {
+        assert(options.inputColumns > 0 && options.targetColumns >= 0);
+        start();
+    }
+
+    ~CsvDataFeed()
+    {
+        stop();
+    }
+
+    bool good() const { return _file != nullptr; }
+    uint64_t SkippedRows() const { return _skippedRows; }
+
+    bool getNext(InputData& input) override
+    {
+        if (!nextRows())
+        {
+            return false;
+        }
+        const MiniBatch& chunk = _current;
+        int32_t inputs = _options.inputColumns;
+        int32_t targets = _options.targetColumns;
+        input._sparse = false;
+        input._input.assign(chunk.inputs.begin() + static_cast<size_t>(_row) * inputs,
+            chunk.inputs.begin() + static_cast<size_t>(_row + 1) * inputs);
+        input._target.assign(chunk.targets.begin() + static_cast<size_t>(_row) * targets,
+            chunk.targets.begin() + static_cast<size_t>(_row + 1) * targets);
+        _row++;
+        return true;
+    }
+
+    bool getNextBatch(int32_t maxSamples, MiniBatch& batch) override
+    {
+        batch.clear();
+        while (batch.size < maxSamples && nextRows())
+        {
+            int32_t rows = std::min(maxSamples - batch.size, _current.size - _row);
+            size_t inputs = _options.inputColumns;
+            size_t targets = _options.targetColumns;
+            batch.inputs.insert(batch.inputs.end(), _current.inputs.begin() + _row * inputs,
+                _current.inputs.begin() + (_row + rows) * inputs);
+            batch.targets.insert(batch.targets.end(), _current.targets.begin() + _row * targets,
+                _current.targets.begin() + (_row + rows) * targets);
+            batch.size += rows;
+            _row += rows;
+        }
+        return batch.size > 0;
+    }
+
+    bool reset() override
+    {
+        stop();
+        start();
+        return good();
+    }
+
+    // parse the rows of 'text' into 'batch', returns the number of malformed rows skipped.
+    static uint64_t ParseRows(const char* text, const char* end, const CsvOptions& options, MiniBatch& batch)
+    {
+        int32_t columns = options.inputColumns + options.targetColumns;
+        uint64_t skipped = 0;
+        std::vector<float>* arrays[2] = { &batch.inputs, &batch.targets };
+        while (text < end)
+        {
+            const char* lineEnd = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            lineEnd = lineEnd ? lineEnd : end;
+            size_t inputSize = batch.inputs.size();
+            size_t targetSize = batch.targets.size();
+            bool valid = true;
+            const char* p = text;
+            for (int32_t column = 0; column < columns && valid; ++column)
+            {
+                while (p < lineEnd && (*p == ' ' || *p == '\t'))
+                {
+                    p++;
+                }
+                float value = 0;
+                const char* next = ParseCsvFloat(p, lineEnd, value);
+                while (next < lineEnd && (*next == ' ' || *next == '\t' || *next == '\r'))
+                {
+                    next++;
+                }
+                bool last = column + 1 == columns;
+                valid = next != p && (last ? next == lineEnd : next < lineEnd && *next == options.delimiter);
+                arrays[column < options.inputColumns ? 0 : 1]->push_back(value);
+                p = next + 1;
+            }
+
+            bool blank = std::all_of(text, lineEnd, [](char c) { return c == ' ' || c == '\t' || c == '\r'; });
+            if (valid)
+            {
+                batch.size++;
+            }
+            else
+            {
+                batch.inputs.resize(inputSize);
+                batch.targets.resize(targetSize);
+                skipped += blank ? 0 : 1;
+            }
+            text = lineEnd + 1;
+        }
+        return skipped;
+    }
+
+private:
+    // parsed chunk 'sequence' waits in slot sequence % _slots.size().
+    struct Slot
+    {
+        MiniBatch batch;
+        bool ready = false;
+    };
+
+    void start()
+    {
+        _file = std::fopen(_path.c_str(), "rb");
+        if (_file == nullptr)
+        {
+            std::cerr << "cannot open " << _path << std::endl;
+            return;
+        }
+        _carry.clear();
+        _eof = false;
+        _stop = false;
+        _readSequence = 0;
+        _reserved = 0;
+        _nextSequence = 0;
+        _finished = 0;
+        _skippedRows = 0;
+        _current.clear();
+        _row = 0;
+        for (auto& slot : _slots)
+        {
+            slot.ready = false;
+        }
+        if (_options.header)
+        {
+            skipHeader();
+        }
+        for (int32_t i = 0; i < _threadCount; ++i)
+        {
+            _workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _space.notify_all();
+        for (auto& worker : _workers)
+        {
+            worker.join();
+        }
+        _workers.clear();
+        if (_file != nullptr)
+        {
+            std::fclose(_file);
+            _file = nullptr;
+        }
+    }
+
+    void skipHeader()
+    {
+        for (int c = std::fgetc(_file); c != EOF && c != '\n'; c = std::fgetc(_file))
+        {
+        }
+    }
+
+    // the next chunk of whole lines, false at the end of the file. Callers hold _readMutex.
+    bool readChunk(std::vector<char>& text)
+    {
+        text.swap(_carry);
+        _carry.clear();
+        while (!_eof)
+        {
+            size_t size = text.size();
+            text.resize(size + _options.chunkBytes);
+            size_t count = std::fread(text.data() + size, 1, _options.chunkBytes, _file);
+            text.resize(size + count);
+            _eof = count < _options.chunkBytes;
+            auto lastNewline = std::find(text.rbegin(), text.rend(), '\n');
+            if (lastNewline != text.rend())
+            {
+                // keep the partial last line for the next chunk.
+                auto lineEnd = lastNewline.base();
+                _carry.assign(lineEnd, text.end());
+                text.erase(lineEnd, text.end());
+                break;
+            }
+        }
+        return !text.empty();
+    }
+
+    void run()
+    {
+        std::vector<char> text;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _space.wait(lock, [this]() { return _stop || _reserved - _nextSequence < _slots.size(); });
+                if (_stop)
+                {
+                    break;
+                }
+                _reserved++;
+            }
+
+            uint64_t sequence = 0;
+            {
+                std::lock_guard<std::mutex> lock(_readMutex);
+                if (!readChunk(text))
+                {
+                    std::lock_guard<std::mutex> stateLock(_mutex);
+                    _reserved--;
+                    break;
+                }
+                std::lock_guard<std::mutex> stateLock(_mutex);
+                sequence = _readSequence++;
+            }
+            // strtof may look past the chunk, stop it at a null.
+            text.push_back('\0');
+
+            Slot& slot = _slots[sequence % _slots.size()];
+            slot.batch.clear();
+            uint64_t skipped = ParseRows(text.data(), text.data() + text.size() - 1, _options, slot.batch);
+            _skippedRows += skipped;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            slot.ready = true;
+            _readyCondition.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished++;
+        _readyCondition.notify_all();
+    }
+
+    // make sure _current has rows left past _row, false at the end of the data.
+    bool nextRows()
+    {
+        while (_row >= _current.size)
+        {
+            if (_file == nullptr)
+            {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            Slot& slot = _slots[_nextSequence % _slots.size()];
+            _readyCondition.wait(lock, [&]() { return slot.ready || (_finished == _threadCount && _nextSequence == _readSequence); });
+            if (!slot.ready)
+            {
+                return false;
+            }
+            std::swap(_current, slot.batch);
+            slot.ready = false;
+            _nextSequence++;
+            _row = 0;
+            lock.unlock();
+            _space.notify_all();
+        }
+        return true;
+    }
+
+    std::string _path;
+    CsvOptions _options;
+    int32_t _threadCount;
+    std::FILE* _file = nullptr;
+    std::vector<char> _carry;           // partial line after the last chunk read
+    bool _eof = false;
+    std::mutex _readMutex;
+    std::mutex _mutex;
+    std::condition_variable _space;
+    std::condition_variable _readyCondition;
+    bool _stop = false;
+    uint64_t _readSequence = 0;         // chunks read
+    uint64_t _reserved = 0;             // chunks read or being read, each has a slot
+    uint64_t _nextSequence = 0;         // chunks consumed
+    int32_t _finished = 0;              // workers that ran out of file
+    std::vector<Slot> _slots;
+    std::vector<std::thread> _workers;
+    std::atomic<uint64_t> _skippedRows{ 0 };
+    MiniBatch _current;
+    int32_t _row = 0;
+};
+
+////////////////////////////////////////
+// Compressed datasets
+//
+// Binary dataset file of dense samples, stored in blocks of up to
+// blockSamples samples that are compressed independently:
+//   CompressedDatasetHeader
+//   blocks
+//   CompressedBlockEntry[blockCount]     at header.indexOffset
+//
+// A block holds the inputs of its samples (row major) followed by their
+// targets. The floats are byte shuffled first (all first bytes, then all
+// second bytes, ...): neighbouring feature values share exponents and
+// high mantissa bytes, which the shuffle turns into long runs, and LzCompress
+// then removes those. Blocks are decoded by prefetch threads ahead of
+// the consumer, so decoding overlaps training and the page cache only
+// holds the compressed bytes.
+////////////////////////////////////////
+
+const char kCompressedDatasetMagic[8] = { 'T', 'A', 'H', 'O', 'E', 'D', 'S', '\0' };
+const uint32_t kCompressedDatasetVersion = 1;
+
+struct CompressedDatasetHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t inputDim;
+    int32_t targetDim;
+    uint32_t blockSamples;
+    uint64_t sampleCount;
+    uint64_t blockCount;
+    uint64_t indexOffset;
+    uint8_t reserved[16];
+};
+static_assert(sizeof(CompressedDatasetHeader) == 64, "compressed dataset header layout changed");
+
+enum class BlockCodec : uint32_t
+{
+    Shuffled = 1,           // byte shuffled only, the block did not compress
+    ShuffledLz = 2,         // byte shuffled, then LzCompress
+};
+
+struct CompressedBlockEntry
+{
+    uint64_t offset;
+    uint32_t size;          // stored bytes
+    uint32_t samples;
+    uint32_t codec;         // BlockCodec
+    uint32_t reserved;
+    uint64_t checksum;      // Checksum64 of the stored bytes
+};
+static_assert(sizeof(CompressedBlockEntry) == 32, "compressed block entry layout changed");
+
+// out[b * count + i] = byte b of float i.
+void ByteShuffle(const float* values, size_t count, uint8_t* out)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t b = 0; b < sizeof(float); ++b)
+        {
+            out[b * count + i] = bytes[i * sizeof(float) + b];
+        }
+    }
+}
+
+// inverse of ByteShuffle, on the decode path of every block.
+void ByteUnshuffle(const uint8_t* in, size_t count, float* values)
+{
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(values);
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    // interleave 16 values from each of the four byte planes.
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i plane0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i plane1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + count + i));
+        __m128i plane2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * count + i));
+        __m128i plane3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * count + i));
+        __m128i low01 = _mm_unpacklo_epi8(plane0, plane1);
+        __m128i high01 = _mm_unpackhi_epi8(plane0, plane1);
+        __m128i low23 = _mm_unpacklo_epi8(plane2, plane3);
+        __m128i high23 = _mm_unpackhi_epi8(plane2, plane3);
+        __m128i* out = reinterpret_cast<__m128i*>(bytes + i * sizeof(float));
+        _mm_storeu_si128(out, _mm_unpacklo_epi16(low01, low23));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low01, low23));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high01, high23));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high01, high23));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        for (size_t b = 0; b < sizeof(float); ++b)
+        {
+            bytes[i * sizeof(float) + b] = in[b * count + i];
+        }
+    }
+}
+
+// LZ77 in the style of LZ4. A sequence is a token (literal count in the
+// high nibble, match length - 4 in the low one, 15 meaning more length
+// bytes follow, each adding up to 255), the literals, then a 16 bit
+// little endian match offset and the extra match length bytes. The last
+// sequence has only literals, which is how the decoder knows it ends.
+const size_t kLzMinMatch = 4;
+// LzDecompress may write this many bytes past the end of the output.
+const size_t kLzSlack = 8;
+
+void LzWriteLength(std::vector<uint8_t>& out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        out.push_back(255);
+    }
+    out.push_back(static_cast<uint8_t>(length));
+}
+
+// compress 'size' bytes into 'out', returns false if that would not make them smaller.
+bool LzCompress(const uint8_t* in, size_t size, std::vector<uint8_t>& out)
+{
+    const int32_t hashBits = 14;
+    std::vector<uint32_t> table(static_cast<size_t>(1) << hashBits, 0);
+    auto read32 = [&](size_t position) { uint32_t value; std::memcpy(&value, in + position, 4); return value; };
+    auto hash = [&](size_t position) { return (read32(position) * 2654435761u) >> (32 - hashBits); };
+
+    out.clear();
+    out.reserve(size);
+    size_t anchor = 0;
+    size_t position = 0;
+    // leave room at the end so matches never run past the input.
+    size_t matchLimit = size > 12 ? size - 12 : 0;
+    auto emit = [&](size_t literals, size_t matchLength, size_t offset)
+    {
+        size_t literalNibble = std::min<size_t>(literals, 15);
+        size_t matchNibble = matchLength ? std::min<size_t>(matchLength - kLzMinMatch, 15) : 0;
+        out.push_back(static_cast<uint8_t>(literalNibble << 4 | matchNibble));
+        if (literalNibble == 15)
+        {
+            LzWriteLength(out, literals - 15);
+        }
+        out.insert(out.end(), in + anchor, in + anchor + literals);
+        if (matchLength)
+        {
+            out.push_back(static_cast<uint8_t>(offset));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+            if (matchNibble == 15)
+            {
+                LzWriteLength(out, matchLength - kLzMinMatch - 15);
+            }
+        }
+    };
+
+    while (position < matchLimit)
+    {
+        uint32_t& slot = table[hash(position)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(position);
+        if (candidate >= position || position - candidate > 0xFFFF || read32(candidate) != read32(position))
+        {
+            position++;
+            continue;
+        }
+        size_t length = kLzMinMatch;
+        while (position + length < matchLimit + 8 && in[candidate + length] == in[position + length])
+        {
+            length++;
+        }
+        emit(position - anchor, length, position - candidate);
+        position += length;
+        anchor = position;
+        if (out.size() >= size)
+        {
+            return false;
+        }
+    }
+    emit(size - anchor, 0, 0);
+    return out.size() < size;
+}
+
+// decompress into exactly outSize bytes, 'out' having kLzSlack bytes of
+// room past them. Returns false on malformed input instead of reading or
+// writing out of bounds.
+bool LzDecompress(const uint8_t* in, size_t size, uint8_t* out, size_t outSize)
+{
+    const uint8_t* ip = in;
+    const uint8_t* ipEnd = in + size;
+    uint8_t* op = out;
+    uint8_t* opEnd = out + outSize;
+    auto readLength = [&](size_t& length) -> bool
+    {
+        uint8_t byte = 255;
+        while (byte == 255)
+        {
+            if (ip >= ipEnd)
+            {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        }
+        return true;
+    };
+
+    for (;;)
+    {
+        if (ip >= ipEnd)
+        {
+            return false;
+        }
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(literals))
+        {
+            return false;
+        }
+        if (literals > static_cast<size_t>(ipEnd - ip) || literals > static_cast<size_t>(opEnd - op))
+        {
+            return false;
+        }
+        std::memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (op == opEnd)
+        {
+            return ip == ipEnd;
+        }
+
+        if (ipEnd - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !readLength(length))
+        {
+            return false;
+        }
+        length += kLzMinMatch;
+        if (offset == 0 || offset > static_cast<size_t>(op - out) || length > static_cast<size_t>(opEnd - op))
+        {
+            return false;
+        }
+        const uint8_t* match = op - offset;
+        if (offset >= 8)
+        {
+            // 8 bytes at a time, overshooting into the slack.
+            for (size_t k = 0; k < length; k += 8)
+            {
+                std::memcpy(op + k, match + k, 8);
+            }
+            op += length;
+        }
+        else
+        {
+            for (size_t k = 0; k < length; ++k)
+            {
+                op[k] = match[k];
+            }
+            op += length;
+        }
+    }
+}
+
+// Writes a compressed dataset, one block every blockSamples samples.
+class CompressedDatasetWriter
+{
+public:
+    CompressedDatasetWriter(const std::string& path, int32_t inputDim, int32_t targetDim, uint32_t blockSamples = 4096)
+        : _inputDim(inputDim),
+        _targetDim(targetDim),
+        _blockSamples(blockSamples)
+    {
+        assert(inputDim > 0 && targetDim >= 0 && blockSamples > 0);
+        _file = std::fopen(path.c_str(), "wb");
+        CompressedDatasetHeader header = {};
+        if (_file == nullptr || std::fwrite(&header, sizeof(header), 1, _file) != 1)
+        {
+            std::cerr << "cannot write " << path << std::endl;
+            _failed = true;
+        }
+        _offset = sizeof(header);
+    }
+
+    ~CompressedDatasetWriter()
+    {
+        close();
+    }
+
+    bool good() const { return !_failed; }
+    uint64_t RawBytes() const { return _rawBytes; }
+    uint64_t StoredBytes() const { return _offset; }
+
+    void add(const float* input, const float* target)
+    {
+        _inputs.insert(_inputs.end(), input, input + _inputDim);
+        _targets.insert(_targets.end(), target, target + _targetDim);
+        if (++_samples == _blockSamples)
+        {
+            writeBlock();
+        }
+    }
+
+    // write the last block, the index and the header. Returns false if anything failed.
+    bool close()
+    {
+        if (_file == nullptr)
+        {
+            return good();
+        }
+        if (_samples > 0)
+        {
+            writeBlock();
+        }
+        CompressedDatasetHeader header = {};
+        std::memcpy(header.magic, kCompressedDatasetMagic, sizeof(header.magic));
+        header.version = kCompressedDatasetVersion;
+        header.inputDim = _inputDim;
+        header.targetDim = _targetDim;
+        header.blockSamples = _blockSamples;
+        header.sampleCount = _sampleCount;
+        header.blockCount = _index.size();
+        header.indexOffset = _offset;
+        bool written = !_failed &&
+            (_index.empty() || std::fwrite(_index.data(), sizeof(CompressedBlockEntry), _index.size(), _file) == _index.size()) &&
+            std::fseek(_file, 0, SEEK_SET) == 0 &&
+            std::fwrite(&header, sizeof(header), 1, _file) == 1;
+        _failed = std::fclose(_file) != 0 || !written;
+        _file = nullptr;
+        return good();
+    }
+
+private:
+    void writeBlock()
+    {
+        _floats.assign(_inputs.begin(), _inputs.end());
+        _floats.insert(_floats.end(), _targets.begin(), _targets.end());
+        size_t bytes = _floats.size() * sizeof(float);
+        _shuffled.resize(bytes);
+        ByteShuffle(_floats.data(), _floats.size(), _shuffled.data());
+
+        CompressedBlockEntry entry = {};
+        entry.offset = _offset;
+        entry.samples = _samples;
+        const std::vector<uint8_t>* stored = &_shuffled;
+        entry.codec = static_cast<uint32_t>(BlockCodec::Shuffled);
+        if (LzCompress(_shuffled.data(), bytes, _compressed))
+        {
+            stored = &_compressed;
+            entry.codec = static_cast<uint32_t>(BlockCodec::ShuffledLz);
+        }
+        entry.size = static_cast<uint32_t>(stored->size());
+        entry.checksum = Checksum64(stored->data(), stored->size());
+        if (!_failed && std::fwrite(stored->data(), 1, stored->size(), _file) != stored->size())
+        {
+            _failed = true;
+        }
+        _index.push_back(entry);
+        _offset += entry.size;
+        _rawBytes += bytes;
+        _sampleCount += _samples;
+        _samples = 0;
+        _inputs.clear();
+        _targets.clear();
+    }
+
+    int32_t _inputDim;
+    int32_t _targetDim;
+    uint32_t _blockSamples;
+    std::FILE* _file = nullptr;
+    bool _failed = false;
+    uint64_t _offset = 0;
+    uint64_t _rawBytes = 0;
+    uint64_t _sampleCount = 0;
+    uint32_t _samples = 0;          // in the current block
+    std::vector<float> _inputs;
+    std::vector<float> _targets;
+    std::vector<float> _floats;
+    std::vector<uint8_t> _shuffled;
+    std::vector<uint8_t> _compressed;
+    std::vector<CompressedBlockEntry> _index;
+};
+
+struct CompressedFeedOptions
+{
+    int32_t threads = 0;            // decoding threads, 0 = one per hardware thread
+    // block local shuffle every epoch, see EpochShuffler.
+    bool shuffle = false;
+    uint64_t seed = 0;
+};
+
+// Reads a compressed dataset, the file is mapped and blocks are verified
+// and decoded by prefetch threads, a few blocks ahead of the consumer.
+class CompressedDataFeed : public IDataFeed
+{
+public:
+    CompressedDataFeed(const std::string& path, const CompressedFeedOptions& options = CompressedFeedOptions())
+        : _options(options),
+        _threadCount(options.threads > 0 ? options.threads : static_cast<int32_t>(std::max(1u, std::thread::hardware_concurrency()))),
+        _slots(2 * _threadCount + 1)
+    {
+        if (!open(path))
+        {
+            std::cerr << "cannot read compressed dataset " << path << std::endl;
+            _file.close();
+            return;
+        }
+        if (options.shuffle)
+        {
+            _shuffler.reset(new EpochShuffler(_header.sampleCount, options.seed, _header.blockSamples));
+        }
+        start();
+    }
+
+    ~CompressedDataFeed()
+    {
+        stop();
+    }
+
+    bool good() const { return _file.size() > 0; }
+    int32_t InputDim() const { return _header.inputDim; }
+    int32_t TargetDim() const { return _header.targetDim; }
+    uint64_t SampleCount() const { return _header.sampleCount; }
+
+    bool getNext(InputData& input) override
+    {
+        if (!nextRows())
+        {
+            return false;
+        }
+        size_t row = sampleRow(_row++);
+        const float* values = _current->values.data();
+        size_t samples = _current->samples;
+        input._sparse = false;
+        input._input.assign(values + row * _header.inputDim, values + (row + 1) * _header.inputDim);
+        const float* targets = values + samples * _header.inputDim;
+        input._target.assign(targets + row * _header.targetDim, targets + (row + 1) * _header.targetDim);
+        return true;
+    }
+
+    bool getNextBatch(int32_t maxSamples, MiniBatch& batch) override
+    {
+        batch.clear();
+        while (batch.size < maxSamples && nextRows())
+        {
+            const float* values = _current->values.data();
+            size_t samples = _current->samples;
+            const float* targets = values + samples * _header.inputDim;
+            size_t inputDim = _header.inputDim;
+            size_t targetDim = _header.targetDim;
+            if (_shuffler)
+            {
+                size_t row = sampleRow(_row++);
+                batch.add(values + row * inputDim, inputDim, targets + row * targetDim, targetDim);
+                continue;
+            }
+            size_t rows = std::min<size_t>(maxSamples - batch.size, samples - _row);
+            batch.inputs.insert(batch.inputs.end(), values + _row * inputDim, values + (_row + rows) * inputDim);
+            batch.targets.insert(batch.targets.end(), targets + _row * targetDim, targets + (_row + rows) * targetDim);
+            batch.size += static_cast<int32_t>(rows);
+            _row += rows;
+        }
+        return batch.size > 0;
+    }
+
+    bool reset() override
+    {
+        if (!good())
+        {
+            return false;
+        }
+        stop();
+        start();
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        std::vector<float> values;      // inputs, then targets
+        size_t samples = 0;
+        size_t orderStart = 0;          // position of the block's first sample in the epoch order
+        bool ready = false;
+        bool valid = false;
+    };
+
+    bool open(const std::string& path)
+    {
+        if (!_file.open(path) || _file.size() < sizeof(CompressedDatasetHeader))
+        {
+            return false;
+        }
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+        if (std::memcmp(_header.magic, kCompressedDatasetMagic, sizeof(_header.magic)) != 0 ||
+            _header.version != kCompressedDatasetVersion || _header.inputDim <= 0 || _header.targetDim < 0 ||
+            _header.indexOffset > _file.size() ||
+            _header.blockCount > (_file.size() - _header.indexOffset) / sizeof(CompressedBlockEntry))
+        {
+            return false;
+        }
+        _index.resize(_header.blockCount);
+        std::memcpy(_index.data(), _file.data() + _header.indexOffset, _index.size() * sizeof(CompressedBlockEntry));
+        // every block but the last is full, start() and the shuffle order
+        // find a sample's block by dividing by blockSamples.
+        uint64_t samples = 0;
+        for (size_t block = 0; block < _index.size(); ++block)
+        {
+            const CompressedBlockEntry& entry = _index[block];
+            if (entry.offset > _header.indexOffset || entry.size > _header.indexOffset - entry.offset ||
+                entry.samples == 0 || entry.samples > _header.blockSamples ||
+                (block + 1 < _index.size() && entry.samples != _header.blockSamples))
+            {
+                return false;
+            }
+            samples += entry.samples;
+        }
+        return samples == _header.sampleCount;
+    }
+
+    void start()
+    {
+        // blocks in the order of this epoch, with the position of their first sample in it.
+        _blockOrder.clear();
+        _orderStart.clear();
+        if (_shuffler)
+        {
+            const std::vector<uint32_t>& order = _shuffler->next();
+            for (size_t position = 0; position < order.size(); position += _index[order[position] / _header.blockSamples].samples)
+            {
+                _blockOrder.push_back(order[position] / _header.blockSamples);
+                _orderStart.push_back(position);
+            }
+        }
+        else
+        {
+            for (uint32_t block = 0; block < _index.size(); ++block)
+            {
+                _blockOrder.push_back(block);
+                _orderStart.push_back(static_cast<size_t>(block) * _header.blockSamples);
+            }
+        }
+        _stop = false;
+        _reserved = 0;
+        _nextSequence = 0;
+        _current = nullptr;
+        _row = 0;
+        for (auto& slot : _slots)
+        {
+            slot.ready = false;
+        }
+        for (int32_t i = 0; i < _threadCount; ++i)
+        {
+            _workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _space.notify_all();
+        for (auto& worker : _workers)
+        {
+            worker.join();
+        }
+        _workers.clear();
+    }
+
+    bool decode(uint32_t block, Slot& slot, std::vector<uint8_t>& scratch)
+    {
+        const CompressedBlockEntry& entry = _index[block];
+        const uint8_t* stored = _file.data() + entry.offset;
+        if (Checksum64(stored, entry.size) != entry.checksum)
+        {
+            return false;
+        }
+        size_t floats = static_cast<size_t>(entry.samples) * (_header.inputDim + _header.targetDim);
+        size_t bytes = floats * sizeof(float);
+        slot.values.resize(floats);
+        slot.samples = entry.samples;
+        switch (static_cast<BlockCodec>(entry.codec))
+        {
+        case BlockCodec::Shuffled:
+            if (entry.size != bytes)
+            {
+                return false;
+            }
+            ByteUnshuffle(stored, floats, slot.values.data());
+            return true;
+        case BlockCodec::ShuffledLz:
+            scratch.resize(bytes + kLzSlack);
+            if (!LzDecompress(stored, entry.size, scratch.data(), bytes))
+            {
+                return false;
+            }
+            ByteUnshuffle(scratch.data(), floats, slot.values.data());
+            return true;
+        }
+        return false;
+    }
+
+    void run()
+    {
+        std::vector<uint8_t> scratch;
+        for (;;)
+        {
+            uint64_t sequence = 0;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _space.wait(lock, [this]() { return _stop || _reserved - _nextSequence < _slots.size(); });
+                if (_stop || _reserved >= _blockOrder.size())
+                {
+                    break;
+                }
+                sequence = _reserved++;
+            }
+
+            Slot& slot = _slots[sequence % _slots.size()];
+            slot.valid = decode(_blockOrder[sequence], slot, scratch);
+            slot.orderStart = _orderStart[sequence];
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            slot.ready = true;
+            _readyCondition.notify_all();
+        }
+    }
+
+    // make sure _current has rows left past _row, false at the end of the data.
+    bool nextRows()
+    {
+        while (_current == nullptr || _row >= _current->samples)
+        {
+            if (!good())
+            {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_current != nullptr)
+            {
+                // hand the consumed slot back to the decoders.
+                _current->ready = false;
+                _current = nullptr;
+                _nextSequence++;
+                _space.notify_all();
+            }
+            if (_nextSequence >= _blockOrder.size())
+            {
+                return false;
+            }
+            Slot& slot = _slots[_nextSequence % _slots.size()];
+            _readyCondition.wait(lock, [&]() { return slot.ready; });
+            if (!slot.valid)
+            {
+                std::cerr << "compressed dataset block " << _blockOrder[_nextSequence] << " is corrupt" << std::endl;
+                return false;
+            }
+            _current = &slot;
+            _row = 0;
+        }
+        return true;
+    }
+
+    // row within the current block of its k-th sample in epoch order.
+    size_t sampleRow(size_t k) const
+    {
+        if (!_shuffler)
+        {
+            return k;
+        }
+        return _shuffler->Order()[_current->orderStart + k] % _header.blockSamples;
+    }
+
+    CompressedFeedOptions _options;
+    int32_t _threadCount;
+    MappedFile _file;
+    CompressedDatasetHeader _header = {};
+    std::vector<CompressedBlockEntry> _index;
+    std::unique_ptr<EpochShuffler> _shuffler;
+    std::vector<uint32_t> _blockOrder;
+    std::vector<size_t> _orderStart;
+    std::mutex _mutex;
+    std::condition_variable _space;
+    std::condition_variable _readyCondition;
+    bool _stop = false;
+    uint64_t _reserved = 0;             // blocks handed to decoders
+    uint64_t _nextSequence = 0;         // blocks consumed
+    std::vector<Slot> _slots;
+    std::vector<std::thread> _workers;
+    Slot* _current = nullptr;
+    size_t _row = 0;
+};
+
+////////////////////////////////////////
+// IDX datasets (MNIST)
+//
+// Reads an IDX image file and its label file, as distributed for MNIST
+// and Fashion-MNIST. Both files are mapped, and samples are produced on
+// the fly: pixels become floats scaled by IdxOptions (scale, offset) and
+// labels one-hot targets, so converted samples only live as long as the
+// batch they are in.
+////////////////////////////////////////
+
+// out[k] = in[k] * scale + offset.
+void ConvertBytes(const uint8_t* in, float* out, size_t count, float scale, float offset)
+{
+    size_t k = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128 scales = _mm_set1_ps(scale);
+    __m128 offsets = _mm_set1_ps(offset);
+    __m128i zero = _mm_setzero_si128();
+    for (; k + 16 <= count; k += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + k));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i words[4] = {
+            _mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+            _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero) };
+        for (int32_t w = 0; w < 4; ++w)
+        {
+            _mm_storeu_ps(out + k + 4 * w, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(words[w]), scales), offsets));
+        }
+    }
+#endif
+    for (; k < count; ++k)
+    {
+        out[k] = in[k] * scale + offset;
+    }
+}
+
+struct IdxOptions
+{
+    int32_t classes = 10;
+    float scale = 1.0f / 255.0f;    // pixel values become pixel * scale + offset
+    float offset = 0.0f;
+};
+
+// The samples of an IDX image and label file pair.
+class IdxDataset : public IRandomAccessDataset
+{
+public:
+    IdxDataset(const std::string& imagesPath, const std::string& labelsPath, const IdxOptions& options = IdxOptions())
+        : _options(options)
+    {
+        if (!open(imagesPath, labelsPath))
+        {
+            std::cerr << "cannot read IDX files " << imagesPath << " and " << labelsPath << std::endl;
+            _images.close();
+            _labels.close();
+            _count = 0;
+        }
+    }
+
+    bool good() const { return _count > 0; }
+    size_t Size() const override { return _count; }
+    int32_t InputDim() const { return static_cast<int32_t>(_pixels); }
+    int32_t Classes() const { return _options.classes; }
+    int32_t label(size_t index) const { return _labelData[index]; }
+
+    void read(size_t index, InputData& input) const override
+    {
+        input._sparse = false;
+        input._input.resize(_pixels);
+        ConvertBytes(_imageData + index * _pixels, input._input.data(), _pixels, _options.scale, _options.offset);
+        input._target.assign(_options.classes, 0.0f);
+        input._target[_labelData[index]] = 1.0f;
+    }
+
+    // append the samples 'indices' to 'batch'.
+    void read(const uint32_t* indices, size_t count, MiniBatch& batch) const
+    {
+        size_t inputs = batch.inputs.size();
+        size_t targets = batch.targets.size();
+        batch.inputs.resize(inputs + count * _pixels);
+        batch.targets.resize(targets + count * _options.classes, 0.0f);
+        for (size_t k = 0; k < count; ++k)
+        {
+            size_t index = indices[k];
+            ConvertBytes(_imageData + index * _pixels, batch.inputs.data() + inputs + k * _pixels, _pixels, _options.scale, _options.offset);
+            batch.targets[targets + k * _options.classes + _labelData[index]] = 1.0f;
+        }
+        batch.size += static_cast<int32_t>(count);
+    }
+
+private:
+    static uint32_t ReadBigEndian(const uint8_t* bytes)
+    {
+        return static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16 |
+            static_cast<uint32_t>(bytes[2]) << 8 | bytes[3];
+    }
+
+    // check the header of an unsigned byte IDX file with 'dims' dimensions
+    // and return them, the data starts right after.
+    static bool ParseHeader(MappedFile& file, uint32_t dims, std::vector<uint32_t>& sizes)
+    {
+        const uint8_t* bytes = file.data();
+        if (file.size() < 4 + 4 * dims || bytes[0] != 0 || bytes[1] != 0 || bytes[2] != 0x08 || bytes[3] != dims)
+        {
+            return false;
+        }
+        // the product of the sizes is checked against the data before each
+        // multiply, three 32 bit sizes could overflow 64 bits.
+        uint64_t available = file.size() - (4 + 4 * dims);
+        uint64_t total = 1;
+        sizes.resize(dims);
+        for (uint32_t d = 0; d < dims; ++d)
+        {
+            sizes[d] = ReadBigEndian(bytes + 4 + 4 * d);
+            if (sizes[d] == 0 || total > available / sizes[d])
+            {
+                return false;
+            }
+            total *= sizes[d];
+        }
+        return true;
+    }
+
+    bool open(const std::string& imagesPath, const std::string& labelsPath)
+    {
+        std::vector<uint32_t> imageSizes;
+        std::vector<uint32_t> labelSizes;
+        if (!_images.open(imagesPath) || !_labels.open(labelsPath) ||
+            !ParseHeader(_images, 3, imageSizes) || !ParseHeader(_labels, 1, labelSizes) ||
+            imageSizes[0] != labelSizes[0] || imageSizes[0] == 0)
+        {
+            return false;
+        }
+        _count = imageSizes[0];
+        _pixels = static_cast<size_t>(imageSizes[1]) * imageSizes[2];
+        _imageData = _images.data() + 16;
+        _labelData = _labels.data() + 8;
+        return std::all_of(_labelData, _labelData + _count, [&](uint8_t label) { return label < _options.classes; });
+    }
+
+    IdxOptions _options;
+    MappedFile _images;
+    MappedFile _labels;
+    size_t _count = 0;
+    size_t _pixels = 0;
+    const uint8_t* _imageData = nullptr;
+    const uint8_t* _labelData = nullptr;
+};
+
+// Feed over an IdxDataset, optionally in a new random order every epoch.
+class IdxDataFeed : public IDataFeed
+{
+public:
+    IdxDataFeed(std::shared_ptr<const IdxDataset> dataset, bool shuffle = false, uint64_t seed = 0)
+        : _dataset(dataset)
+    {
+        if (shuffle && dataset->good())
+        {
+            _shuffler.reset(new EpochShuffler(dataset->Size(), seed));
+            _shuffler->next();
+        }
+        _order.resize(dataset->Size());
+        for (uint32_t k = 0; k < _order.size(); ++k)
+        {
+            _order[k] = k;
+        }
+    }
+
+    bool getNext(InputData& input) override
+    {
+        if (_position >= _dataset->Size())
+        {
+            return false;
+        }
+        _dataset->read(order()[_position++], input);
+        return true;
+    }
+
+    bool getNextBatch(int32_t maxSamples, MiniBatch& batch) override
+    {
+        batch.clear();
+        size_t count = std::min<size_t>(maxSamples, _dataset->Size() - _position);
+        _dataset->read(order().data() + _position, count, batch);
+        _position += count;
+        return count > 0;
+    }
+
+    bool reset() override
+    {
+        if (_shuffler)
+        {
+            _shuffler->next();
+        }
+        _position = 0;
+        return true;
+    }
+
+private:
+    const std::vector<uint32_t>& order() const { return _shuffler ? _shuffler->Order() : _order; }
+
+    std::shared_ptr<const IdxDataset> _dataset;
+    std::unique_ptr<EpochShuffler> _shuffler;
+    std::vector<uint32_t> _order;       // identity, when not shuffling
+    size_t _position = 0;
+};
+
+////////////////////////////////////////
+// Augmentation
+//
+// AugmentedDataFeed sits between a feed and the Trainer. Worker threads
+// pull minibatches from the inner feed and transform them ahead of the
+// consumer, so augmentation never runs on the training thread. The
+// stages of an AugmentationPipeline (normalization, noise, masking) are
+// fused into one vectorized pass over each batch.
+////////////////////////////////////////
+
+// feature mean and standard deviation over one pass of 'feed', which is reset afterwards.
+void ComputeFeatureStatistics(IDataFeed& feed, int32_t inputDim, std::vector<float>& mean, std::vector<float>& deviation)
+{
+    std::vector<double> sum(inputDim, 0.0);
+    std::vector<double> squares(inputDim, 0.0);
+    uint64_t count = 0;
+    MiniBatch batch;
+    while (feed.getNextBatch(256, batch))
+    {
+        for (int32_t k = 0; k < batch.size; ++k)
+        {
+            const float* row = batch.inputs.data() + static_cast<size_t>(k) * inputDim;
+            for (int32_t j = 0; j < inputDim; ++j)
+            {
+                sum[j] += row[j];
+                squares[j] += static_cast<double>(row[j]) * row[j];
+            }
+        }
+        count += batch.size;
+    }
+    feed.reset();
+
+    mean.assign(inputDim, 0.0f);
+    deviation.assign(inputDim, 1.0f);
+    for (int32_t j = 0; count > 0 && j < inputDim; ++j)
+    {
+        double average = sum[j] / count;
+        mean[j] = static_cast<float>(average);
+        deviation[j] = static_cast<float>(std::sqrt(std::max(squares[j] / count - average * average, 0.0)));
+    }
+}
+
+// Transforms of the inputs of a batch, applied in this order as one pass:
+//   normalize: x = (x - mean) / deviation, per feature
+//   noise:     x += gaussian noise of the given standard deviation
+//   mask:      x = 0 with the given probability, per value
+// Targets are left alone.
+class AugmentationPipeline
+{
+public:
+    // features with a deviation below 'epsilon' are only centered.
+    AugmentationPipeline& normalize(const std::vector<float>& mean, const std::vector<float>& deviation, float epsilon = 1e-6f)
+    {
+        assert(mean.size() == deviation.size());
+        _mean = mean;
+        _inverseDeviation.resize(deviation.size());
+        for (size_t j = 0; j < deviation.size(); ++j)
+        {
+            _inverseDeviation[j] = deviation[j] > epsilon ? 1.0f / deviation[j] : 1.0f;
+        }
+        return *this;
+    }
+
+    AugmentationPipeline& noise(float deviation)
+    {
+        _noise = deviation;
+        return *this;
+    }
+
+    AugmentationPipeline& mask(float probability)
+    {
+        assert(probability >= 0.0f && probability < 1.0f);
+        _maskProbability = probability;
+        return *this;
+    }
+
+    // transform the inputs of 'batch', rows of inputDim values. The random
+    // stages draw from 'seed' only, so a batch gets the same augmentation
+    // whichever thread runs it. Noise and mask values are drawn a few at a
+    // time inside the row loop, so nothing is allocated per batch.
+    void apply(MiniBatch& batch, int32_t inputDim, uint64_t seed) const
+    {
+        const bool normalize = !_mean.empty();
+        const bool noise = _noise != 0.0f;
+        const bool mask = _maskProbability != 0.0f;
+        if (!normalize && !noise && !mask)
+        {
+            return;
+        }
+        assert(!normalize || _mean.size() == static_cast<size_t>(inputDim));
+
+        // xorshift64* generators seeded per batch with splitmix64. Value j of
+        // a row draws from generator j % kStreams, so neighbouring values do
+        // not wait on each other's draws, and the result does not depend on SimdWidth.
+        const int32_t kStreams = 8;
+        static_assert(kStreams % SimdWidth == 0, "a vector has to take its values from one draw");
+        uint64_t states[kStreams];
+        for (int32_t i = 0; i < kStreams; ++i)
+        {
+            uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ull;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            states[i] = (z ^ (z >> 31)) | 1;
+        }
+        // sum of four 16 bit uniforms from one draw: mean 2, variance 1/3,
+        // close enough to a gaussian for noise.
+        const float scaleToDeviation = _noise * 1.7320508f / 65536.0f;
+        // noise and keep factors of the next kStreams values of a row, one from each generator.
+        alignas(64) float noiseValues[kStreams];
+        alignas(64) float keep[kStreams];
+        auto draw = [&]()
+        {
+            for (int32_t i = 0; i < kStreams; ++i)
+            {
+                uint64_t bits = noise ? NextRandom(states[i]) : 0;
+                uint32_t sum = static_cast<uint32_t>(bits & 0xFFFF) + static_cast<uint32_t>((bits >> 16) & 0xFFFF)
+                    + static_cast<uint32_t>((bits >> 32) & 0xFFFF) + static_cast<uint32_t>(bits >> 48);
+                noiseValues[i] = noise ? (static_cast<float>(static_cast<int32_t>(sum)) - 131070.0f) * scaleToDeviation : 0.0f;
+            }
+            for (int32_t i = 0; i < kStreams; ++i)
+            {
+                float uniform = mask ? static_cast<float>(static_cast<int32_t>(NextRandom(states[i]) >> 40)) * (1.0f / 16777216.0f) : 1.0f;
+                keep[i] = uniform < _maskProbability ? 0.0f : 1.0f;
+            }
+        };
+
+        const float* mean = _mean.data();
+        const float* scale = _inverseDeviation.data();
+        for (int32_t k = 0; k < batch.size; ++k)
+        {
+            float* row = batch.inputs.data() + static_cast<size_t>(k) * inputDim;
+            int32_t j = 0;
+            for (; j + SimdWidth <= inputDim; j += SimdWidth)
+            {
+                SimdFloat x = SimdLoad(row + j);
+                if (normalize)
+                {
+                    x = SimdMul(SimdSub(x, SimdLoad(mean + j)), SimdLoad(scale + j));
+                }
+                if (noise || mask)
+                {
+                    int32_t lane = j % kStreams;
+                    if (lane == 0)
+                    {
+                        draw();
+                    }
+                    x = SimdMul(SimdAdd(x, SimdLoad(noiseValues + lane)), SimdLoad(keep + lane));
+                }
+                SimdStore(row + j, x);
+            }
+            for (; j < inputDim; ++j)
+            {
+                float x = normalize ? (row[j] - mean[j]) * scale[j] : row[j];
+                if (noise || mask)
+                {
+                    int32_t lane = j % kStreams;
+                    if (lane == 0)
+                    {
+                        draw();
+                    }
+                    x = (x + noiseValues[lane]) * keep[lane];
+                }
+                row[j] = x;
+            }
+        }
+    }
+
+private:
+    // xorshift64* step.
+    static uint64_t NextRandom(uint64_t& state)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    std::vector<float> _mean;
+    std::vector<float> _inverseDeviation;
+    float _noise = 0.0f;
+    float _maskProbability = 0.0f;
+};
+
+// Prefetches batches of 'batchSize' dense samples from 'inner' on worker
+// threads and augments them there. Batches come out in the order of the
+// inner feed; pulling from it is serialized, augmenting is not.
+class AugmentedDataFeed : public IDataFeed
+{
+public:
+    AugmentedDataFeed(
+        std::shared_ptr<IDataFeed> inner,
+        std::shared_ptr<const AugmentationPipeline> pipeline,
+        int32_t inputDim,
+        int32_t batchSize = 64,
+        int32_t threads = 1,
+        uint64_t seed = 0)
+        : _inner(inner),
+        _pipeline(pipeline),
+        _inputDim(inputDim),
+        _batchSize(batchSize),
+        _threadCount(threads),
+        _seed(seed),
+        _slots(2 * threads + 1)
+    {
+        assert(batchSize > 0 && threads > 0);
+        start();
+    }
+
+    ~AugmentedDataFeed()
+    {
+        stop();
+    }
+
+    bool getNext(InputData& input) override
+    {
+        if (!nextRows())
+        {
+            return false;
+        }
+        size_t targetDim = _current.targets.size() / _current.size;
+        input._sparse = false;
+        input._input.assign(_current.inputs.begin() + _row * _inputDim, _current.inputs.begin() + (_row + 1) * _inputDim);
+        input._target.assign(_current.targets.begin() + _row * targetDim, _current.targets.begin() + (_row + 1) * targetDim);
+        _row++;
+        return true;
+    }
+
+    bool getNextBatch(int32_t maxSamples, MiniBatch& batch) override
+    {
+        batch.clear();
+        while (batch.size < maxSamples && nextRows())
+        {
+            if (_row == 0 && _current.size <= maxSamples - batch.size && batch.size == 0)
+            {
+                // a whole prefetched batch, hand it over without copying.
+                std::swap(batch, _current);
+                _current.clear();
+                _row = 0;
+                continue;
+            }
+            size_t rows = std::min<size_t>(maxSamples - batch.size, _current.size - _row);
+            size_t targetDim = _current.targets.size() / _current.size;
+            batch.inputs.insert(batch.inputs.end(), _current.inputs.begin() + _row * _inputDim,
+                _current.inputs.begin() + (_row + rows) * _inputDim);
+            batch.targets.insert(batch.targets.end(), _current.targets.begin() + _row * targetDim,
+                _current.targets.begin() + (_row + rows) * targetDim);
+            batch.size += static_cast<int32_t>(rows);
+            _row += rows;
+        }
+        return batch.size > 0;
+    }
+
+    // rewinds the inner feed, later epochs get different augmentations.
+    bool reset() override
+    {
+        stop();
+        if (!_inner->reset())
+        {
+            return false;
+        }
+        _epoch++;
+        start();
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        MiniBatch batch;
+        bool ready = false;
+    };
+
+    void start()
+    {
+        _stop = false;
+        _exhausted = false;
+        _readSequence = 0;
+        _reserved = 0;
+        _nextSequence = 0;
+        _finished = 0;
+        _current.clear();
+        _row = 0;
+        for (auto& slot : _slots)
+        {
+            slot.ready = false;
+        }
+        for (int32_t i = 0; i < _threadCount; ++i)
+        {
+            _workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _space.notify_all();
+        for (auto& worker : _workers)
+        {
+            worker.join();
+        }
+        _workers.clear();
+    }
+
+    void run()
+    {
+        MiniBatch batch;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _space.wait(lock, [this]() { return _stop || _reserved - _nextSequence < _slots.size(); });
+                if (_stop)
+                {
+                    break;
+                }
+                _reserved++;
+            }
+
+            uint64_t sequence = 0;
+            {
+                std::lock_guard<std::mutex> lock(_innerMutex);
+                if (_exhausted || !_inner->getNextBatch(_batchSize, batch))
+                {
+                    _exhausted = true;
+                    std::lock_guard<std::mutex> stateLock(_mutex);
+                    _reserved--;
+                    break;
+                }
+                std::lock_guard<std::mutex> stateLock(_mutex);
+                sequence = _readSequence++;
+            }
+
+            _pipeline->apply(batch, _inputDim, _seed ^ (static_cast<uint64_t>(_epoch) << 40) ^ sequence);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            Slot& slot = _slots[sequence % _slots.size()];
+            std::swap(slot.batch, batch);
+            slot.ready = true;
+            _readyCondition.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished++;
+        _readyCondition.notify_all();
+    }
+
+    // make sure _current has rows left past _row, false at the end of the data.
+    bool nextRows()
+    {
+        while (_row >= static_cast<size_t>(_current.size))
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            Slot& slot = _slots[_nextSequence % _slots.size()];
+            _readyCondition.wait(lock, [&]() { return slot.ready || (_finished == _threadCount && _nextSequence == _readSequence); });
+            if (!slot.ready)
+            {
+                return false;
+            }
+            std::swap(_current, slot.batch);
+            slot.ready = false;
+            _nextSequence++;
+            _row = 0;
+            lock.unlock();
+            _space.notify_all();
+        }
+        return true;
+    }
+
+    std::shared_ptr<IDataFeed> _inner;
+    std::shared_ptr<const AugmentationPipeline> _pipeline;
+    int32_t _inputDim;
+    int32_t _batchSize;
+    int32_t _threadCount;
+    uint64_t _seed;
+    uint32_t _epoch = 0;
+    std::mutex _innerMutex;
+    bool _exhausted = false;
+    std::mutex _mutex;
+    std::condition_variable _space;
+    std::condition_variable _readyCondition;
+    bool _stop = false;
+    uint64_t _readSequence = 0;         // batches pulled from the inner feed
+    uint64_t _reserved = 0;             // batches pulled or being pulled, each has a slot
+    uint64_t _nextSequence = 0;         // batches consumed
+    int32_t _finished = 0;              // workers that ran out of batches
+    std::vector<Slot> _slots;
+    std::vector<std::thread> _workers;
+    MiniBatch _current;
+    size_t _row = 0;
+};
+
+// Feeds several consumers, for instance the Trainers of a sweep, with the
+// same batches from one source feed, so each batch is read and decoded
+// once. A producer thread reads batches of 'batchSize' samples ahead into
+// a ring of 'depth' slots. Consumers share each batch read-only instead
+// of copying it; a slot is refilled once every consumer has taken it.
+//
+// consumer(i) counts consumer i in, and the producer waits for the
+// consumers that were handed out and are still alive, never for indices
+// nobody took. A new consumer starts at the oldest batch another live
+// consumer has yet to read, so consumers taken before any of them reads
+// all see every batch; take them all up front. An epoch ends for everyone
+// together: the source is reset once all live consumers have called
+// reset(). A consumer that is done has to be destroyed.
+class BroadcastDataFeed : public std::enable_shared_from_this<BroadcastDataFeed>
+{
+public:
+    BroadcastDataFeed(std::shared_ptr<IDataFeed> source, int32_t consumers, int32_t batchSize = 64, int32_t depth = 8)
+        : _source(source),
+        _consumerCount(consumers),
+        _batchSize(batchSize),
+        _slots(depth),
+        _consumed(consumers, 0),
+        _taken(consumers, false),
+        _detached(consumers, false)
+    {
+        assert(consumers > 0 && batchSize > 0 && depth > 0);
+        _thread = std::thread([this]() { run(); });
+    }
+
+    ~BroadcastDataFeed()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _changed.notify_all();
+        _thread.join();
+    }
+
+    // the feed of consumer 'index', each index is taken at most once.
+    std::shared_ptr<IDataFeed> consumer(int32_t index);
+
+    int32_t Consumers() const { return _consumerCount; }
+
+private:
+    friend class BroadcastConsumerFeed;
+
+    struct Slot
+    {
+        std::shared_ptr<const MiniBatch> batch;
+        int32_t readers = 0;        // consumers yet to take the batch
+    };
+
+    void run()
+    {
+        auto batch = std::make_shared<MiniBatch>();
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_stop)
+        {
+            lock.unlock();
+            bool read = _source->getNextBatch(_batchSize, *batch);
+            lock.lock();
+            if (!read)
+            {
+                // end of the epoch: wait for every consumer to ask for the next one.
+                _epochEnd = _produced;
+                _changed.notify_all();
+                _changed.wait(lock, [this]() { return _stop || (_activeCount > 0 && _resets == _activeCount); });
+                if (_stop)
+                {
+                    break;
+                }
+                lock.unlock();
+                bool replayed = _source->reset();
+                lock.lock();
+                _resets = 0;
+                _replayed = replayed;
+                _epoch++;
+                _changed.notify_all();
+                if (!replayed)
+                {
+                    break;
+                }
+                _epochEnd = std::numeric_limits<uint64_t>::max();
+                continue;
+            }
+
+            Slot& slot = _slots[_produced % _slots.size()];
+            _changed.wait(lock, [&]() { return _stop || (_activeCount > 0 && slot.readers == 0); });
+            if (_stop)
+            {
+                break;
+            }
+            std::shared_ptr<const MiniBatch> evicted = std::move(slot.batch);
+            slot.batch = std::move(batch);
+            slot.readers = _activeCount;
+            _produced++;
+            _changed.notify_all();
+
+            // read into the batch the slot held unless a consumer still uses it.
+            batch = evicted && evicted.use_count() == 1 ? std::const_pointer_cast<MiniBatch>(evicted) : std::make_shared<MiniBatch>();
+        }
+    }
+
+    // count consumer 'index' in, see the class comment for where it starts.
+    void take(int32_t index)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        assert(!_taken[index]);
+        _taken[index] = true;
+        uint64_t first = _produced;
+        for (int32_t k = 0; k < _consumerCount; ++k)
+        {
+            if (_taken[k] && !_detached[k] && k != index)
+            {
+                first = std::min(first, _consumed[k]);
+            }
+        }
+        // the slots from 'first' on still hold their batches, since another consumer has yet to take them.
+        for (_consumed[index] = first; first < _produced; ++first)
+        {
+            _slots[first % _slots.size()].readers++;
+        }
+        _activeCount++;
+        _changed.notify_all();
+    }
+
+    // the next batch of 'consumer', shared with the other consumers; false at the end of the epoch.
+    bool next(int32_t consumer, std::shared_ptr<const MiniBatch>& batch)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t sequence = _consumed[consumer];
+        _changed.wait(lock, [&]() { return _produced > sequence || _epochEnd == sequence; });
+        if (_produced == sequence)
+        {
+            return false;
+        }
+        Slot& slot = _slots[sequence % _slots.size()];
+        batch = slot.batch;
+        _consumed[consumer]++;
+        if (--slot.readers == 0)
+        {
+            _changed.notify_all();
+        }
+        return true;
+    }
+
+    // blocks until all consumers reached the end of the epoch and the source was reset.
+    bool reset(int32_t consumer)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        // skip whatever this consumer did not read of the current epoch,
+        // releasing slots as they arrive so the producer keeps going.
+        while (true)
+        {
+            release(consumer);
+            if (!_replayed)
+            {
+                return false;
+            }
+            if (_epochEnd == _consumed[consumer])
+            {
+                break;
+            }
+            _changed.wait(lock);
+        }
+        uint32_t epoch = _epoch;
+        _resets++;
+        _changed.notify_all();
+        _changed.wait(lock, [&]() { return _epoch != epoch || _stop; });
+        return _replayed && !_stop;
+    }
+
+    // a consumer feed went away, stop waiting for it.
+    void detach(int32_t consumer)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        release(consumer);
+        _detached[consumer] = true;
+        _activeCount--;
+        _changed.notify_all();
+    }
+
+    // mark every batch produced so far as read by 'consumer', called with _mutex held.
+    void release(int32_t consumer)
+    {
+        for (; _consumed[consumer] < _produced; ++_consumed[consumer])
+        {
+            if (--_slots[_consumed[consumer] % _slots.size()].readers == 0)
+            {
+                _changed.notify_all();
+            }
+        }
+    }
+
+    std::shared_ptr<IDataFeed> _source;
+    int32_t _consumerCount;
+    int32_t _batchSize;
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::vector<Slot> _slots;
+    std::vector<uint64_t> _consumed;        // batches each consumer has read, over all epochs
+    std::vector<bool> _taken;               // consumer(i) was called
+    std::vector<bool> _detached;            // and its feed destroyed since
+    int32_t _activeCount = 0;               // consumers taken and not destroyed yet
+    uint64_t _produced = 0;
+    uint64_t _epochEnd = std::numeric_limits<uint64_t>::max();     // _produced at the end of the epoch
+    int32_t _resets = 0;                // consumers waiting for the next epoch
+    uint32_t _epoch = 0;
+    bool _replayed = true;              // false once the source could not be reset
+    bool _stop = false;
+    std::thread _thread;
+};
+
+// The view of one consumer of a BroadcastDataFeed. getNext hands out the
+// samples of the current batch one at a time.
+class BroadcastConsumerFeed : public IDataFeed
+{
+public:
+    BroadcastConsumerFeed(std::shared_ptr<BroadcastDataFeed> broadcast, int32_t index)
+        : _broadcast(broadcast),
+        _index(index)
+    {
+        _broadcast->take(_index);
+    }
+
+    ~BroadcastConsumerFeed()
+    {
+        _broadcast->detach(_index);
+    }
+
+    bool getNext(InputData& input) override
+    {
+        if (!_current || _row >= _current->size)
+        {
+            _row = 0;
+            if (!_broadcast->next(_index, _current))
+            {
+                _current.reset();
+                return false;
+            }
+        }
+        const MiniBatch& current = *_current;
+        size_t inputDim = current.inputs.size() / current.size;
+        size_t targetDim = current.targets.size() / current.size;
+        input._sparse = false;
+        input._input.assign(current.inputs.begin() + _row * inputDim, current.inputs.begin() + (_row + 1) * inputDim);
+        input._target.assign(current.targets.begin() + _row * targetDim, current.targets.begin() + (_row + 1) * targetDim);
+        _row++;
+        return true;
+    }
+
+    // a copy of one broadcast batch per call when 'maxSamples' fits it.
+    bool getNextBatch(int32_t maxSamples, MiniBatch& batch) override
+    {
+        if (!wholeBatch(maxSamples))
+        {
+            return IDataFeed::getNextBatch(maxSamples, batch);
+        }
+        if (!nextWholeBatch())
+        {
+            return false;
+        }
+        batch = *_current;
+        return true;
+    }
+
+    // the shared batch itself, no copy, when 'maxSamples' fits it.
+    bool getNextBatchView(int32_t maxSamples, MiniBatch& scratch, const MiniBatch*& batch) override
+    {
+        if (!wholeBatch(maxSamples))
+        {
+            batch = &scratch;
+            return IDataFeed::getNextBatch(maxSamples, scratch);
+        }
+        if (!nextWholeBatch())
+        {
+            return false;
+        }
+        batch = _current.get();
+        return true;
+    }
+
+    bool reset() override
+    {
+        _current.reset();
+        _row = 0;
+        return _broadcast->reset(_index);
+    }
+
+private:
+    // whole broadcast batches are handed out when no samples of the current one are left.
+    bool wholeBatch(int32_t maxSamples) const
+    {
+        return (!_current || _row >= _current->size) && maxSamples >= _broadcast->_batchSize;
+    }
+
+    // take the next batch as a whole, its samples count as handed out.
+    bool nextWholeBatch()
+    {
+        if (!_broadcast->next(_index, _current))
+        {
+            _current.reset();
+            _row = 0;
+            return false;
+        }
+        _row = _current->size;
+        return true;
+    }
+
+    std::shared_ptr<BroadcastDataFeed> _broadcast;
+    int32_t _index;
+    std::shared_ptr<const MiniBatch> _current;
+    int32_t _row = 0;
+};
+
+inline std::shared_ptr<IDataFeed> BroadcastDataFeed::consumer(int32_t index)
+{
+    assert(index >= 0 && index < _consumerCount);
+    return std::make_shared<BroadcastConsumerFeed>(shared_from_this(), index);
+}
+
+////////////////////////////////////////
+// Checkpoints
+//
+// File layout (little endian):
+//   CheckpointHeader
+//   CheckpointSectionEntry[sectionCount]
+//   sections, each starting on a kCheckpointAlignment boundary
+//
+// The topology section holds one CheckpointLayerRecord per layer. Every
+// parameter array of a layer is its own section, and so is every optimizer
+// state array (see Optimizer::stateArrays), next to a
+// CheckpointOptimizerRecord section. Since sections are page aligned, loading maps the file and
+// points the layers straight at their sections instead of copying.
+////////////////////////////////////////
+
+const char kCheckpointMagic[8] = { 'T', 'A', 'H', 'O', 'E', 'N', 'N', '\0' };
+const uint32_t kCheckpointVersion = 1;
+const uint64_t kCheckpointAlignment = 4096;
+
+enum class CheckpointSectionKind : uint32_t
+{
+    Topology = 1,
+    Parameter = 2,
+    OptimizerState = 3,
+};
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+    uint64_t tableChecksum;
+    uint8_t reserved[32];
+};
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header layout changed");
+
+struct CheckpointSectionEntry
+{
+    uint32_t kind;
+    uint32_t layer;     // index of the owning layer in the LayerSet
+    uint32_t slot;      // parameter / optimizer state index within the layer
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;      // in bytes
+    uint64_t checksum;
+};
+static_assert(sizeof(CheckpointSectionEntry) == 40, "checkpoint section entry layout changed");
+
+struct CheckpointLayerRecord
+{
+    uint32_t kind;
+    int32_t inputDim;
+    int32_t outputDim;
+    uint32_t activation;    // 0 = default activation of the layer kind
+    uint32_t parameterCount;
+    uint32_t option;        // BaseLayer::Option()
+    uint32_t reserved[2];
+};
+static_assert(sizeof(CheckpointLayerRecord) == 32, "checkpoint layer record layout changed");
+
+// layer index of the OptimizerState section holding the CheckpointOptimizerRecord.
+const uint32_t kCheckpointOptimizerRecordLayer = 0xFFFFFFFF;
+
+struct CheckpointOptimizerRecord
+{
+    uint32_t kind;          // OptimizerKind
+    uint32_t stateCount;    // state arrays per parameter array
+    uint64_t step;
+};
+static_assert(sizeof(CheckpointOptimizerRecord) == 16, "checkpoint optimizer record layout changed");
+
+// A section to be written, the data is referenced and not copied.
+struct CheckpointSectionSource
+{
+    CheckpointSectionKind kind;
+    uint32_t layer;
+    uint32_t slot;
+    const void* data;
+    uint64_t size;
+};
+
+uint64_t CheckpointAlign(uint64_t offset)
+{
+    return (offset + kCheckpointAlignment - 1) & ~(kCheckpointAlignment - 1);
+}
+
+// describe the topology and parameters of 'layers' as checkpoint sections,
+// and the state of 'optimizer' unless it is null. 'topology' and
+// 'optimizerRecord' receive the records and must outlive the returned sections.
+std::vector<CheckpointSectionSource> CollectCheckpointSections(
+    LayerSet& layers,
+    std::vector<CheckpointLayerRecord>& topology,
+    const Optimizer* optimizer = nullptr,
+    CheckpointOptimizerRecord* optimizerRecord = nullptr)
+{
+    std::vector<CheckpointSectionSource> sections;
+    topology.clear();
+    for (auto layer : layers)
+    {
+        CheckpointLayerRecord record = {};
+        record.kind = static_cast<uint32_t>(layer->Kind());
+        record.inputDim = layer->InputDim();
+        record.outputDim = layer->OutputDim();
+        record.activation = static_cast<uint32_t>(layer->OutputActivation());
+        record.option = layer->Option();
+        record.parameterCount = static_cast<uint32_t>(layer->parameters().size());
+        topology.push_back(record);
+    }
+
+    sections.push_back({ CheckpointSectionKind::Topology, 0, 0,
+        topology.data(), topology.size() * sizeof(CheckpointLayerRecord) });
+
+    for (uint32_t layerIndex = 0; layerIndex < layers.size(); ++layerIndex)
+    {
+        auto params = layers[layerIndex]->parameters();
+        for (uint32_t slot = 0; slot < params.size(); ++slot)
+        {
+            assert(params[slot].buffer->size() == params[slot].count);
+            params[slot].buffer->ensureVerified();
+            sections.push_back({ CheckpointSectionKind::Parameter, layerIndex, slot,
+                params[slot].buffer->data(), params[slot].count * sizeof(float) });
+        }
+    }
+
+    if (optimizer != nullptr)
+    {
+        assert(optimizerRecord != nullptr);
+        optimizerRecord->kind = static_cast<uint32_t>(optimizer->Options().kind);
+        optimizerRecord->stateCount = static_cast<uint32_t>(OptimizerStateCount(optimizer->Options().kind));
+        optimizerRecord->step = optimizer->Step();
+        sections.push_back({ CheckpointSectionKind::OptimizerState, kCheckpointOptimizerRecordLayer, 0,
+            optimizerRecord, sizeof(CheckpointOptimizerRecord) });
+        for (auto& state : optimizer->stateArrays())
+        {
+            sections.push_back({ CheckpointSectionKind::OptimizerState, state.layer, state.slot,
+                state.data, state.count * sizeof(float) });
+        }
+    }
+
+    return sections;
+}
+
+// compute the section table for 'sections', returns the total file size.
+// The checksums are left zero, see FinalizeCheckpointImage.
+uint64_t LayoutCheckpoint(
+    const std::vector<CheckpointSectionSource>& sections,
+    CheckpointHeader& header,
+    std::vector<CheckpointSectionEntry>& table)
+{
+    table.resize(sections.size());
+    uint64_t offset = CheckpointAlign(sizeof(CheckpointHeader) + table.size() * sizeof(CheckpointSectionEntry));
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        CheckpointSectionEntry& entry = table[i];
+        entry = {};
+        entry.kind = static_cast<uint32_t>(sections[i].kind);
+        entry.layer = sections[i].layer;
+        entry.slot = sections[i].slot;
+        entry.offset = offset;
+        entry.size = sections[i].size;
+        entry.checksum = 0;
+        offset = CheckpointAlign(offset + entry.size);
+    }
+
+    header = {};
+    memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+    header.version = kCheckpointVersion;
+    header.sectionCount = static_cast<uint32_t>(table.size());
+    header.fileSize = offset;
+    header.tableChecksum = 0;
+    return offset;
+}
+
+typedef std::vector<uint8_t, AlignedAllocator<uint8_t, kCheckpointAlignment>> CheckpointImage;
+
+// copy the sections into a complete in-memory file image. This is only a
+// memcpy per section; checksums are filled in later by FinalizeCheckpointImage.
+void BuildCheckpointImage(const std::vector<CheckpointSectionSource>& sections, CheckpointImage& image)
+{
+    CheckpointHeader header;
+    std::vector<CheckpointSectionEntry> table;
+    uint64_t fileSize = LayoutCheckpoint(sections, header, table);
+
+    // the image is reused between snapshots, so only the padding gets cleared.
+    image.resize(fileSize);
+    uint64_t position = 0;
+    auto copy = [&](uint64_t offset, const void* data, uint64_t size)
+    {
+        memset(image.data() + position, 0, offset - position);
+        memcpy(image.data() + offset, data, size);
+        position = offset + size;
+    };
+
+    copy(0, &header, sizeof(header));
+    copy(sizeof(header), table.data(), table.size() * sizeof(CheckpointSectionEntry));
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        copy(table[i].offset, sections[i].data, sections[i].size);
+    }
+    memset(image.data() + position, 0, fileSize - position);
+}
+
+// compute the section and table checksums of an image from BuildCheckpointImage.
+void FinalizeCheckpointImage(CheckpointImage& image)
+{
+    CheckpointHeader header;
+    memcpy(&header, image.data(), sizeof(header));
+    CheckpointSectionEntry* table = reinterpret_cast<CheckpointSectionEntry*>(image.data() + sizeof(header));
+    for (uint32_t i = 0; i < header.sectionCount; ++i)
+    {
+        table[i].checksum = Checksum64(image.data() + table[i].offset, table[i].size);
+    }
+    header.tableChecksum = Checksum64(table, header.sectionCount * sizeof(CheckpointSectionEntry));
+    memcpy(image.data(), &header, sizeof(header));
+}
+
+// Writes a checkpoint file front to back, next to its final location,
+// and renames it into place on commit(), so a crash never leaves a torn
+// checkpoint. Bytes go through a page aligned chunk buffer, so any source
+// can be streamed with O_DIRECT, which needs aligned buffers and sizes;
+// page aligned sources skip the buffer for whole chunks. The file has to
+// end on a page boundary, as every checkpoint does.
+class CheckpointFileWriter
+{
+public:
+    static const size_t kChunkSize = 8 << 20;
+
+    ~CheckpointFileWriter()
+    {
+        if (!_tempPath.empty())
+        {
+            // never committed.
+            close();
+            std::remove(_tempPath.c_str());
+        }
+    }
+
+    bool open(const std::string& path, bool directIO)
+    {
+        _path = path;
+        _tempPath = path + ".tmp";
+        _good = true;
+        _position = 0;
+        _buffered = 0;
+        _buffer.resize(kChunkSize);
+#if !defined(_WIN32)
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+        if (directIO)
+        {
+            // not every file system supports O_DIRECT, fall back to buffered writes.
+            _fd = ::open(_tempPath.c_str(), flags | O_DIRECT, 0644);
+        }
+#endif
+        if (_fd < 0)
+        {
+            _fd = ::open(_tempPath.c_str(), flags, 0644);
+        }
+        _good = _fd >= 0;
+#else
+        (void)directIO;
+        _file.open(_tempPath, std::ios::binary | std::ios::trunc);
+        _good = static_cast<bool>(_file);
+#endif
+        if (!_good)
+        {
+            std::cerr << "unable to create checkpoint " << _tempPath << std::endl;
+            _tempPath.clear();
+        }
+        return _good;
+    }
+
+    uint64_t Position() const { return _position; }
+
+    void append(const void* data, uint64_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while (_good && size > 0)
+        {
+            if (_buffered == 0 && size >= kChunkSize && reinterpret_cast<uintptr_t>(bytes) % kCheckpointAlignment == 0)
+            {
+                size_t direct = static_cast<size_t>(std::min<uint64_t>(size, 64 * kChunkSize)) / kChunkSize * kChunkSize;
+                writeOut(bytes, direct);
+                bytes += direct;
+                size -= direct;
+                _position += direct;
+                continue;
+            }
+            size_t count = static_cast<size_t>(std::min<uint64_t>(size, kChunkSize - _buffered));
+            memcpy(_buffer.data() + _buffered, bytes, count);
+            _buffered += count;
+            bytes += count;
+            size -= count;
+            _position += count;
+            if (_buffered == kChunkSize)
+            {
+                flush();
+            }
+        }
+    }
+
+    void appendZeros(uint64_t size)
+    {
+        while (_good && size > 0)
+        {
+            size_t count = static_cast<size_t>(std::min<uint64_t>(size, kChunkSize - _buffered));
+            memset(_buffer.data() + _buffered, 0, count);
+            _buffered += count;
+            size -= count;
+            _position += count;
+            if (_buffered == kChunkSize)
+            {
+                flush();
+            }
+        }
+    }
+
+    // writes what is buffered, syncs and renames the file into place.
+    bool commit()
+    {
+        assert(_position % kCheckpointAlignment == 0);
+        flush();
+#if !defined(_WIN32)
+        _good = _good && fsync(_fd) == 0;
+#endif
+        _good = close() && _good;
+        _good = _good && std::rename(_tempPath.c_str(), _path.c_str()) == 0;
+        if (!_good)
+        {
+            std::cerr << "unable to write checkpoint " << _path << std::endl;
+            std::remove(_tempPath.c_str());
+        }
+        _tempPath.clear();
+        return _good;
+    }
+
+private:
+    void flush()
+    {
+        writeOut(_buffer.data(), _buffered);
+        _buffered = 0;
+    }
+
+    void writeOut(const uint8_t* data, size_t size)
+    {
+#if !defined(_WIN32)
+        size_t offset = 0;
+        while (_good && offset < size)
+        {
+            ssize_t count = ::write(_fd, data + offset, size - offset);
+            _good = count > 0;
+            offset += _good ? count : 0;
+        }
+#else
+        _good = _good && _file.write(reinterpret_cast<const char*>(data), size);
+#endif
+    }
+
+    bool close()
+    {
+#if !defined(_WIN32)
+        bool closed = _fd < 0 || ::close(_fd) == 0;
+        _fd = -1;
+        return closed;
+#else
+        _file.close();
+        return static_cast<bool>(_file);
+#endif
+    }
+
+    std::string _path;
+    std::string _tempPath;      // empty unless a file is open and not committed
+    std::vector<uint8_t, AlignedAllocator<uint8_t, kCheckpointAlignment>> _buffer;
+    size_t _buffered = 0;
+    uint64_t _position = 0;
+    bool _good = false;
+#if !defined(_WIN32)
+    int _fd = -1;
+#else
+    std::ofstream _file;
+#endif
+};
+
+// write a finalized image to 'path', optionally bypassing the page cache
+// with O_DIRECT (the image is page aligned and padded to a page multiple).
+bool WriteCheckpointImage(const std::string& path, const CheckpointImage& image, bool directIO)
+{
+    CheckpointFileWriter file;
+    if (!file.open(path, directIO))
+    {
+        return false;
+    }
+    file.append(image.data(), image.size());
+    return file.commit();
+}
+
+// Writes the same file AsyncCheckpointWriter does, on the calling thread.
+// The sections are streamed from the weights through a chunk buffer
+// instead of being copied into an image first, so saving a large model
+// needs no memory beyond the chunk. The weights are read twice, for the
+// checksums and then for the write.
+bool SaveCheckpoint(LayerSet& layers, const std::string& path, const Optimizer* optimizer = nullptr)
+{
+    std::vector<CheckpointLayerRecord> topology;
+    CheckpointOptimizerRecord optimizerRecord = {};
+    auto sections = CollectCheckpointSections(layers, topology, optimizer, &optimizerRecord);
+    CheckpointHeader header;
+    std::vector<CheckpointSectionEntry> table;
+    uint64_t fileSize = LayoutCheckpoint(sections, header, table);
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        table[i].checksum = Checksum64(sections[i].data, sections[i].size);
+    }
+    header.tableChecksum = Checksum64(table.data(), table.size() * sizeof(CheckpointSectionEntry));
+
+    CheckpointFileWriter file;
+    if (!file.open(path, false))
+    {
+        return false;
+    }
+    file.append(&header, sizeof(header));
+    file.append(table.data(), table.size() * sizeof(CheckpointSectionEntry));
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        file.appendZeros(table[i].offset - file.Position());
+        file.append(sections[i].data, sections[i].size);
+    }
+    file.appendZeros(fileSize - file.Position());
+    return file.commit();
+}
+
+// Memory mapped checkpoint. Opening only validates the header and the
+// section table; the checksum of a section is verified the first time
+// the section is used.
+class CheckpointReader
+{
+public:
+    bool open(const std::string& path)
+    {
+        if (!_file.open(path))
+        {
+            std::cerr << "unable to open checkpoint " << path << std::endl;
+            return false;
+        }
+
+        if (_file.size() < sizeof(CheckpointHeader))
+        {
+            std::cerr << "checkpoint " << path << " is truncated" << std::endl;
+            return false;
+        }
+
+        CheckpointHeader header;
+        memcpy(&header, _file.data(), sizeof(header));
+        if (memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 || header.version != kCheckpointVersion)
+        {
+            std::cerr << "checkpoint " << path << " has an unsupported format or version" << std::endl;
+            return false;
+        }
+
+        uint64_t tableSize = static_cast<uint64_t>(header.sectionCount) * sizeof(CheckpointSectionEntry);
+        if (header.fileSize != _file.size() || sizeof(header) + tableSize > _file.size())
+        {
+            std::cerr << "checkpoint " << path << " is truncated" << std::endl;
+            return false;
+        }
+
+        _entries.resize(header.sectionCount);
+        memcpy(_entries.data(), _file.data() + sizeof(header), tableSize);
+        if (Checksum64(_entries.data(), tableSize) != header.tableChecksum)
+        {
+            std::cerr << "checkpoint " << path << " has a corrupt section table" << std::endl;
+            return false;
+        }
+
+        for (auto& entry : _entries)
+        {
+            // written so that offset + size cannot wrap around.
+            if (entry.offset % kCheckpointAlignment != 0 || entry.offset > _file.size() || entry.size > _file.size() - entry.offset)
+            {
+                std::cerr << "checkpoint " << path << " has an invalid section" << std::endl;
+                return false;
+            }
+        }
+
+        _verifyOnce.reset(new std::once_flag[_entries.size()]);
+        _verified.assign(_entries.size(), 0);
+        return true;
+    }
+
+    uint32_t sectionCount() const { return static_cast<uint32_t>(_entries.size()); }
+    const CheckpointSectionEntry& entry(uint32_t section) const { return _entries[section]; }
+
+    // index of the requested section, or -1 if the checkpoint does not contain it.
+    int32_t findSection(CheckpointSectionKind kind, uint32_t layer, uint32_t slot) const
+    {
+        for (uint32_t i = 0; i < _entries.size(); ++i)
+        {
+            if (_entries[i].kind == static_cast<uint32_t>(kind) && _entries[i].layer == layer && _entries[i].slot == slot)
+            {
+                return static_cast<int32_t>(i);
+            }
+        }
+        return -1;
+    }
+
+    // start of the section in the mapping, not verified.
+    uint8_t* sectionData(uint32_t section)
+    {
+        return _file.data() + _entries[section].offset;
+    }
+
+    // verifies the section checksum on first call, later calls return the cached result.
+    bool verifySection(uint32_t section)
+    {
+        std::call_once(_verifyOnce[section], [this, section]()
+        {
+            const CheckpointSectionEntry& entry = _entries[section];
+            _verified[section] = Checksum64(sectionData(section), entry.size) == entry.checksum;
+        });
+        return _verified[section] != 0;
+    }
+
+    bool verifyAll()
+    {
+        bool valid = true;
+        for (uint32_t i = 0; i < _entries.size(); ++i)
+        {
+            valid = verifySection(i) && valid;
+        }
+        return valid;
+    }
+
+private:
+    MappedFile _file;
+    std::vector<CheckpointSectionEntry> _entries;
+    std::unique_ptr<std::once_flag[]> _verifyOnce;
+    std::vector<uint8_t> _verified;
+};
+
+void WeightBuffer::ensureVerified() const
+{
+    if (_source && !_source->verifySection(_section))
+    {
+        // serving or training from corrupt weights is never what the caller wants.
+        std::cerr << "checkpoint section " << _section << " failed checksum verification" << std::endl;
+        std::abort();
+    }
+}
+
+// Checks a topology record read from disk before a layer is built from
+// it. Returns nullptr if the record is usable, otherwise what is wrong.
+const char* CheckLayerRecord(const CheckpointLayerRecord& record)
+{
+    if (record.kind < static_cast<uint32_t>(LayerKind::Input) || record.kind > static_cast<uint32_t>(LayerKind::LowRank))
+    {
+        return "unknown layer kind";
+    }
+    if (record.inputDim <= 0 || record.outputDim <= 0)
+    {
+        return "layer dimension is not positive";
+    }
+    if (record.activation > static_cast<uint32_t>(ActivationKind::Gelu))
+    {
+        return "unknown activation";
+    }
+    switch (static_cast<LayerKind>(record.kind))
+    {
+    case LayerKind::Input:
+        return record.inputDim == record.outputDim ? nullptr : "input layer changes the dimension";
+    case LayerKind::SampledSoftmaxOutput:
+        return record.option > 0 && record.option <= static_cast<uint32_t>(std::numeric_limits<int32_t>::max())
+            ? nullptr : "invalid sample count";
+    case LayerKind::LowRank:
+        return record.option > 0 && record.option <= static_cast<uint32_t>(std::min(record.inputDim, record.outputDim))
+            ? nullptr : "invalid rank";
+    case LayerKind::Embedding:
+        if (record.outputDim % record.inputDim != 0)
+        {
+            return "embedding width is not a multiple of the field count";
+        }
+        return record.option > 0 && record.option <= (1u << 24) ? nullptr : "invalid vocabulary size";
+    default:
+        return nullptr;
+    }
+}
+
+// the layer described by a record, nullptr if CheckLayerRecord rejects it.
+std::shared_ptr<BaseLayer> CreateLayer(const CheckpointLayerRecord& record)
+{
+    if (CheckLayerRecord(record) != nullptr)
+    {
+        return nullptr;
+    }
+    // checkpoints written before activations were recorded only had sigmoid layers.
+    ActivationKind activation = record.activation == 0 ? ActivationKind::Sigmoid : static_cast<ActivationKind>(record.activation);
+    switch (static_cast<LayerKind>(record.kind))
+    {
+    case LayerKind::Input:
+        return std::make_shared<InputLayer>(record.inputDim, record.option != 0);
+    case LayerKind::FullyConnectedHidden:
+        return DispatchActivation(activation, [&](auto policy) -> std::shared_ptr<BaseLayer>
+        {
+            return std::make_shared<FullyConnectedLayer<decltype(policy)>>(record.inputDim, record.outputDim);
+        });
+    case LayerKind::FullyConnectedOutput:
+        return DispatchActivation(activation, [&](auto policy) -> std::shared_ptr<BaseLayer>
+        {
+            return std::make_shared<SquaredErrorOutputLayer<decltype(policy)>>(record.inputDim, record.outputDim);
+        });
+    case LayerKind::SoftmaxCrossEntropyOutput:
+        return std::make_shared<SoftmaxCrossEntropyOutputLayer>(record.inputDim, record.outputDim);
+    case LayerKind::SampledSoftmaxOutput:
+        return std::make_shared<SampledSoftmaxOutputLayer>(record.inputDim, record.outputDim, static_cast<int32_t>(record.option));
+    case LayerKind::HierarchicalSoftmaxOutput:
+        return std::make_shared<HierarchicalSoftmaxOutputLayer>(record.inputDim, record.outputDim);
+    case LayerKind::LowRank:
+        return DispatchActivation(activation, [&](auto policy) -> std::shared_ptr<BaseLayer>
+        {
+            return std::make_shared<LowRankLayer<decltype(policy)>>(record.inputDim, record.outputDim, static_cast<int32_t>(record.option));
+        });
+    case LayerKind::Embedding:
+        return std::make_shared<EmbeddingLayer>(record.inputDim, record.outputDim / record.inputDim, static_cast<int32_t>(record.option));
+    }
+    return nullptr;
+}
+
+// Restore a LayerSet from a checkpoint without copying the weights: the
+// layers view the mapped file, which stays mapped while any layer uses it.
+// Returns nullptr if the checkpoint is missing or malformed.
+std::shared_ptr<LayerSet> LoadCheckpoint(
+    const std::string& path,
+    std::shared_ptr<CheckpointReader>* readerOut = nullptr)
+{
+    auto reader = std::make_shared<CheckpointReader>();
+    if (!reader->open(path))
+    {
+        return nullptr;
+    }
+
+    int32_t topologySection = reader->findSection(CheckpointSectionKind::Topology, 0, 0);
+    if (topologySection < 0 || !reader->verifySection(topologySection) ||
+        reader->entry(topologySection).size % sizeof(CheckpointLayerRecord) != 0)
+    {
+        std::cerr << "checkpoint " << path << " has no valid topology" << std::endl;
+        return nullptr;
+    }
+
+    const CheckpointLayerRecord* records =
+        reinterpret_cast<const CheckpointLayerRecord*>(reader->sectionData(topologySection));
+    size_t layerCount = reader->entry(topologySection).size / sizeof(CheckpointLayerRecord);
+
+    if (layerCount == 0)
+    {
+        std::cerr << "checkpoint " << path << " has no layers" << std::endl;
+        return nullptr;
+    }
+
+    auto layers = std::make_shared<LayerSet>();
+    for (uint32_t layerIndex = 0; layerIndex < layerCount; ++layerIndex)
+    {
+        const char* problem = CheckLayerRecord(records[layerIndex]);
+        if (problem == nullptr && layerIndex > 0 && records[layerIndex].inputDim != records[layerIndex - 1].outputDim)
+        {
+            problem = "layer input does not match the previous layer";
+        }
+        if (problem != nullptr)
+        {
+            std::cerr << "checkpoint " << path << " layer " << layerIndex << ": " << problem << std::endl;
+            return nullptr;
+        }
+        auto layer = CreateLayer(records[layerIndex]);
+
+        auto params = layer->parameters();
+        if (params.size() != records[layerIndex].parameterCount)
+        {
+            std::cerr << "checkpoint " << path << " does not match layer " << layerIndex << std::endl;
+            return nullptr;
+        }
+
+        for (uint32_t slot = 0; slot < params.size(); ++slot)
+        {
+            int32_t section = reader->findSection(CheckpointSectionKind::Parameter, layerIndex, slot);
+            if (section < 0 || reader->entry(section).size != params[slot].count * sizeof(float))
+            {
+                std::cerr << "checkpoint " << path << " is missing parameters of layer " << layerIndex << std::endl;
+                return nullptr;
+            }
+            params[slot].buffer->attach(
+                reinterpret_cast<float*>(reader->sectionData(section)), params[slot].count, reader, section);
+        }
+
+        layers->push_back(layer);
+    }
+
+    if (readerOut != nullptr)
+    {
+        *readerOut = reader;
+    }
+    return layers;
+}
+
+// Restore the state of 'optimizer' from a checkpoint written with one of
+// the same kind for the same network. Returns false, leaving the optimizer
+// alone, if the checkpoint has no such state.
+bool RestoreOptimizerState(CheckpointReader& reader, Optimizer& optimizer)
+{
+    int32_t recordSection = reader.findSection(CheckpointSectionKind::OptimizerState, kCheckpointOptimizerRecordLayer, 0);
+    if (recordSection < 0 || !reader.verifySection(recordSection) ||
+        reader.entry(recordSection).size != sizeof(CheckpointOptimizerRecord))
+    {
+        return false;
+    }
+    const CheckpointOptimizerRecord* record =
+        reinterpret_cast<const CheckpointOptimizerRecord*>(reader.sectionData(recordSection));
+    if (record->kind != static_cast<uint32_t>(optimizer.Options().kind))
+    {
+        std::cerr << "checkpoint optimizer state is for another optimizer" << std::endl;
+        return false;
+    }
+
+    auto states = optimizer.stateArrays();
+    std::vector<int32_t> sections;
+    for (auto& state : states)
+    {
+        int32_t section = reader.findSection(CheckpointSectionKind::OptimizerState, state.layer, state.slot);
+        if (section < 0 || reader.entry(section).size != state.count * sizeof(float) || !reader.verifySection(section))
+        {
+            std::cerr << "checkpoint optimizer state does not match layer " << state.layer << std::endl;
+            return false;
+        }
+        sections.push_back(section);
+    }
+    for (size_t k = 0; k < states.size(); ++k)
+    {
+        const float* data = reinterpret_cast<const float*>(reader.sectionData(sections[k]));
+        std::copy(data, data + states[k].count, states[k].data);
+    }
+    optimizer.setStep(record->step);
+    return true;
+}
+
+// Timings and volume of background checkpoints.
+struct CheckpointStats
+{
+    uint64_t snapshots = 0;           // snapshots taken by the training thread
+    uint64_t superseded = 0;          // snapshots replaced by a newer one before being written
+    uint64_t written = 0;
+    uint64_t failed = 0;
+    uint64_t bytesWritten = 0;
+    double snapshotSeconds = 0;       // time the training thread spent copying weights
+    double lastSnapshotSeconds = 0;
+    double writeSeconds = 0;          // time the writer thread spent checksumming and writing
+    double lastWriteSeconds = 0;
+
+    void print(std::ostream& stream) const
+    {
+        double bytesPerSecond = writeSeconds > 0 ? bytesWritten / writeSeconds : 0;
+        stream << "checkpoints: " << written << " written, " << failed << " failed, "
+            << superseded << " superseded of " << snapshots << " snapshots" << std::endl;
+        stream << "  snapshot stall: last " << lastSnapshotSeconds * 1e3 << " ms, total "
+            << snapshotSeconds * 1e3 << " ms" << std::endl;
+        stream << "  write latency: last " << lastWriteSeconds * 1e3 << " ms, "
+            << bytesWritten / (1024.0 * 1024.0) << " MB at " << bytesPerSecond / (1024.0 * 1024.0) << " MB/s" << std::endl;
+    }
+};
+
+// Writes checkpoints on a background thread so training never waits on disk.
+//
+// Double buffered: snapshot() copies the weights into whichever image the
+// writer is not currently streaming to disk and returns. If the writer falls
+// behind, a pending snapshot is replaced by the newer one instead of queueing.
+class AsyncCheckpointWriter
+{
+public:
+    AsyncCheckpointWriter(const std::string& path, bool directIO = false)
+        : _path(path),
+        _directIO(directIO),
+        _pending(-1),
+        _writing(-1),
+        _stop(false)
+    {
+        _thread = std::thread([this]() { run(); });
+    }
+
+    ~AsyncCheckpointWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _thread.join();
+    }
+
+    // copy the current weights and optimizer state; only the copy runs on the calling thread.
+    void snapshot(LayerSet& layers, const Optimizer* optimizer = nullptr)
+    {
+        auto start = Clock::now();
+        std::unique_lock<std::mutex> lock(_mutex);
+        int32_t target = (_writing == 0) ? 1 : 0;
+        if (_pending >= 0)
+        {
+            // reuse the pending image, it has not been picked up yet.
+            target = _pending;
+            _pending = -1;
+            _stats.superseded++;
+        }
+        lock.unlock();
+
+        std::vector<CheckpointLayerRecord> topology;
+        CheckpointOptimizerRecord optimizerRecord = {};
+        BuildCheckpointImage(CollectCheckpointSections(layers, topology, optimizer, &optimizerRecord), _images[target]);
+
+        lock.lock();
+        _pending = target;
+        double elapsed = SecondsSince(start);
+        _stats.snapshots++;
+        _stats.snapshotSeconds += elapsed;
+        _stats.lastSnapshotSeconds = elapsed;
+        lock.unlock();
+        _wake.notify_all();
+    }
+
+    // block until every snapshot taken so far is on disk.
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [this]() { return _pending < 0 && _writing < 0; });
+    }
+
+    CheckpointStats stats()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [this]() { return _stop || _pending >= 0; });
+            if (_pending < 0)
+            {
+                break;
+            }
+
+            _writing = _pending;
+            _pending = -1;
+            lock.unlock();
+
+            auto start = Clock::now();
+            CheckpointImage& image = _images[_writing];
+            FinalizeCheckpointImage(image);
+            bool written = WriteCheckpointImage(_path, image, _directIO);
+            double elapsed = SecondsSince(start);
+
+            lock.lock();
+            _writing = -1;
+            _stats.written += written ? 1 : 0;
+            _stats.failed += written ? 0 : 1;
+            _stats.bytesWritten += written ? image.size() : 0;
+            _stats.writeSeconds += elapsed;
+            _stats.lastWriteSeconds = elapsed;
+            _idle.notify_all();
+        }
+    }
+
+    std::string _path;
+    bool _directIO;
+    CheckpointImage _images[2];
+    int32_t _pending;   // image waiting to be written, -1 if none
+    int32_t _writing;   // image owned by the writer thread, -1 if none
+    bool _stop;
+    CheckpointStats _stats;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    std::thread _thread;
+};
+
+////////////////////////////////////////
+// Pruning
+//
+// Zeroes the smallest weights of the hidden fully connected layers of a
+// trained network. InferenceSession runs layers left with few nonzero
+// blocks through BlockSparseForward. Block pruning is the mode that
+// produces those; Unstructured and NM zero single weights, which at the
+// same sparsity leaves most blocks partly filled.
+////////////////////////////////////////
+
+enum class PruningMode
+{
+    Unstructured,       // the weights of smallest magnitude in the layer
+    NM,                 // all but the n largest of every m consecutive weights feeding an output
+    Block,              // the BlockSparseWeights blocks of smallest L2 norm
+};
+
+struct PruningOptions
+{
+    PruningMode mode = PruningMode::Unstructured;
+    // fraction of weights (Block: of blocks) to zero, for Unstructured and Block.
+    float sparsity = 0.9f;
+    int32_t n = 2;
+    int32_t m = 4;
+};
+
+// zeroes the 'count' entries of 'scores' with the lowest score, by calling prune(index).
+template <typename Prune>
+void PruneLowest(const std::vector<float>& scores, size_t count, Prune prune)
+{
+    std::vector<uint32_t> order(scores.size());
+    for (uint32_t k = 0; k < order.size(); ++k)
+    {
+        order[k] = k;
+    }
+    count = std::min(count, order.size());
+    std::nth_element(order.begin(), order.begin() + count, order.end(),
+        [&](uint32_t a, uint32_t b) { return scores[a] < scores[b]; });
+    for (size_t k = 0; k < count; ++k)
+    {
+        prune(order[k]);
+    }
+}
+
+// prune an input major inputDim x outputDim weight matrix in place.
+void PruneWeights(float* weights, int32_t inputDim, int32_t outputDim, const PruningOptions& options)
+{
+    size_t total = static_cast<size_t>(inputDim) * outputDim;
+    switch (options.mode)
+    {
+    case PruningMode::Unstructured:
+    {
+        std::vector<float> magnitude(total);
+        for (size_t k = 0; k < total; ++k)
+        {
+            magnitude[k] = std::abs(weights[k]);
+        }
+        PruneLowest(magnitude, static_cast<size_t>(options.sparsity * total), [&](uint32_t k) { weights[k] = 0.0f; });
+        break;
+    }
+
+    case PruningMode::NM:
+    {
+        assert(options.n > 0 && options.n <= options.m);
+        std::vector<int32_t> group(options.m);
+        for (int32_t j = 0; j < outputDim; ++j)
+        {
+            for (int32_t i0 = 0; i0 < inputDim; i0 += options.m)
+            {
+                int32_t length = std::min(options.m, inputDim - i0);
+                for (int32_t k = 0; k < length; ++k)
+                {
+                    group[k] = i0 + k;
+                }
+                auto magnitude = [&](int32_t i) { return std::abs(weights[static_cast<size_t>(i) * outputDim + j]); };
+                std::sort(group.begin(), group.begin() + length, [&](int32_t a, int32_t b) { return magnitude(a) > magnitude(b); });
+                for (int32_t k = options.n; k < length; ++k)
+                {
+                    weights[static_cast<size_t>(group[k]) * outputDim + j] = 0.0f;
+                }
+            }
+        }
+        break;
+    }
+
+    case PruningMode::Block:
+    {
+        int32_t panels = (outputDim + DenseTileColumns - 1) / DenseTileColumns;
+        std::vector<float> norm(static_cast<size_t>(panels) * inputDim, 0.0f);
+        for (int32_t i = 0; i < inputDim; ++i)
+        {
+            for (int32_t j = 0; j < outputDim; ++j)
+            {
+                float w = weights[static_cast<size_t>(i) * outputDim + j];
+                norm[static_cast<size_t>(j / DenseTileColumns) * inputDim + i] += w * w;
+            }
+        }
+        PruneLowest(norm, static_cast<size_t>(options.sparsity * norm.size()), [&](uint32_t k)
+        {
+            int32_t i = k % inputDim;
+            int32_t j0 = (k / inputDim) * DenseTileColumns;
+            float* block = weights + static_cast<size_t>(i) * outputDim + j0;
+            std::fill(block, block + std::min(DenseTileColumns, outputDim - j0), 0.0f);
+        });
+        break;
+    }
+    }
+}
+
+// prune the weights of every hidden fully connected layer, returns how many were pruned.
+int32_t PruneLayers(LayerSet& layers, const PruningOptions& options)
+{
+    int32_t pruned = 0;
+    for (auto layer : layers)
+    {
+        if (layer->Kind() != LayerKind::FullyConnectedHidden)
+        {
+            continue;
+        }
+        WeightBuffer* weights = layer->parameters()[0].buffer;
+        weights->ensureVerified();
+        PruneWeights(weights->data(), layer->InputDim(), layer->OutputDim(), options);
+        ++pruned;
+    }
+    return pruned;
+}
+
+////////////////////////////////////////
+// Low rank factorization
+//
+// Replaces the weights of a trained hidden fully connected layer by their
+// best rank r approximation U * V (see LowRankLayer), from a truncated SVD.
+// The SVD is randomized: a few subspace iterations find an orthonormal
+// basis Q of the dominant column space of W, and the small matrix
+// B = Q^T * W is decomposed exactly with Jacobi rotations.
+////////////////////////////////////////
+
+// orthonormalize the columns of a row major rows x columns matrix in
+// place, by modified Gram-Schmidt applied twice. Columns that are linearly
+// dependent on the previous ones become zero.
+void OrthonormalizeColumns(std::vector<double>& a, int32_t rows, int32_t columns)
+{
+    for (int32_t pass = 0; pass < 2; ++pass)
+    {
+        for (int32_t j = 0; j < columns; ++j)
+        {
+            for (int32_t p = 0; p < j; ++p)
+            {
+                double dot = 0.0;
+                for (int32_t i = 0; i < rows; ++i)
+                {
+                    dot += a[static_cast<size_t>(i) * columns + p] * a[static_cast<size_t>(i) * columns + j];
+                }
+                for (int32_t i = 0; i < rows; ++i)
+                {
+                    a[static_cast<size_t>(i) * columns + j] -= dot * a[static_cast<size_t>(i) * columns + p];
+                }
+            }
+            double norm = 0.0;
+            for (int32_t i = 0; i < rows; ++i)
+            {
+                norm += a[static_cast<size_t>(i) * columns + j] * a[static_cast<size_t>(i) * columns + j];
+            }
+            norm = std::sqrt(norm);
+            double scale = norm > 1e-12 ? 1.0 / norm : 0.0;
+            for (int32_t i = 0; i < rows; ++i)
+            {
+                a[static_cast<size_t>(i) * columns + j] *= scale;
+            }
+        }
+    }
+}
+
+// eigen decomposition of a symmetric n x n matrix by cyclic Jacobi
+// rotations. On return the diagonal of 'a' holds the eigenvalues and the
+// columns of 'vectors' the matching eigenvectors.
+void SymmetricEigen(std::vector<double>& a, std::vector<double>& vectors, int32_t n)
+{
+    vectors.assign(static_cast<size_t>(n) * n, 0.0);
+    for (int32_t i = 0; i < n; ++i)
+    {
+        vectors[static_cast<size_t>(i) * n + i] = 1.0;
+    }
+    auto at = [&](std::vector<double>& m, int32_t r, int32_t c) -> double& { return m[static_cast<size_t>(r) * n + c]; };
+
+    for (int32_t sweep = 0; sweep < 64; ++sweep)
+    {
+        double off = 0.0;
+        double total = 0.0;
+        for (int32_t p = 0; p < n; ++p)
+        {
+            for (int32_t q = 0; q < n; ++q)
+            {
+                double value = at(a, p, q) * at(a, p, q);
+                total += value;
+                off += p != q ? value : 0.0;
+            }
+        }
+        if (off <= 1e-28 * total)
+        {
+            break;
+        }
+
+        for (int32_t p = 0; p < n - 1; ++p)
+        {
+            for (int32_t q = p + 1; q < n; ++q)
+            {
+                double apq = at(a, p, q);
+                if (apq == 0.0)
+                {
+                    continue;
+                }
+                double theta = (at(a, q, q) - at(a, p, p)) / (2.0 * apq);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::abs(theta) + std::sqrt(theta * theta + 1.0));
+                double c = 1.0 / std::sqrt(t * t + 1.0);
+                double s = t * c;
+                // a = P^T * a * P, vectors = vectors * P.
+                for (int32_t r = 0; r < n; ++r)
+                {
+                    double arp = at(a, r, p);
+                    double arq = at(a, r, q);
+                    at(a, r, p) = c * arp - s * arq;
+                    at(a, r, q) = s * arp + c * arq;
+                    double vrp = at(vectors, r, p);
+                    double vrq = at(vectors, r, q);
+                    at(vectors, r, p) = c * vrp - s * vrq;
+                    at(vectors, r, q) = s * vrp + c * vrq;
+                }
+                for (int32_t r = 0; r < n; ++r)
+                {
+                    double apr = at(a, p, r);
+                    double aqr = at(a, q, r);
+                    at(a, p, r) = c * apr - s * aqr;
+                    at(a, q, r) = s * apr + c * aqr;
+                }
+            }
+        }
+    }
+}
+
+// rank 'rank' approximation of an input major inputDim x outputDim weight
+// matrix: writes U (inputDim x rank) and V (rank x outputDim), with the
+// singular values split evenly between the two so both train at a similar
+// scale. Returns the relative error ||W - U * V|| / ||W|| (Frobenius).
+double FactorizeWeights(
+    const float* weights,
+    int32_t inputDim,
+    int32_t outputDim,
+    int32_t rank,
+    float* u,
+    float* v,
+    int32_t powerIterations = 4)
+{
+    assert(rank > 0 && rank <= std::min(inputDim, outputDim));
+    // a few extra basis vectors make the top 'rank' directions much more accurate.
+    int32_t k = std::min(rank + 8, std::min(inputDim, outputDim));
+    size_t in = static_cast<size_t>(inputDim);
+    size_t out = static_cast<size_t>(outputDim);
+
+    // q = W * z for z out x k, and z = W^T * q.
+    auto multiply = [&](const std::vector<double>& z, std::vector<double>& q)
+    {
+        q.assign(in * k, 0.0);
+        for (size_t i = 0; i < in; ++i)
+        {
+            for (size_t j = 0; j < out; ++j)
+            {
+                double w = weights[i * out + j];
+                for (int32_t c = 0; c < k; ++c)
+                {
+                    q[i * k + c] += w * z[j * k + c];
+                }
+            }
+        }
+    };
+    auto multiplyTransposed = [&](const std::vector<double>& q, std::vector<double>& z)
+    {
+        z.assign(out * k, 0.0);
+        for (size_t i = 0; i < in; ++i)
+        {
+            for (size_t j = 0; j < out; ++j)
+            {
+                double w = weights[i * out + j];
+                for (int32_t c = 0; c < k; ++c)
+                {
+                    z[j * k + c] += w * q[i * k + c];
+                }
+            }
+        }
+    };
+
+    std::vector<double> z(out * k);
+    std::vector<double> q;
+    std::normal_distribution<double> distribution(0.0, 1.0);
+    std::mt19937 engine;
+    std::generate(z.begin(), z.end(), [&]() { return distribution(engine); });
+    multiply(z, q);
+    for (int32_t iteration = 0; iteration < powerIterations; ++iteration)
+    {
+        OrthonormalizeColumns(q, inputDim, k);
+        multiplyTransposed(q, z);
+        OrthonormalizeColumns(z, outputDim, k);
+        multiply(z, q);
+    }
+    OrthonormalizeColumns(q, inputDim, k);
+
+    // W ~ Q * B with B = Q^T * W, stored transposed (out x k).
+    std::vector<double> b;
+    multiplyTransposed(q, b);
+    // eigen vectors of B * B^T are the left singular vectors of B.
+    std::vector<double> gram(static_cast<size_t>(k) * k, 0.0);
+    for (size_t j = 0; j < out; ++j)
+    {
+        for (int32_t r = 0; r < k; ++r)
+        {
+            for (int32_t c = 0; c < k; ++c)
+            {
+                gram[static_cast<size_t>(r) * k + c] += b[j * k + r] * b[j * k + c];
+            }
+        }
+    }
+    std::vector<double> vectors;
+    SymmetricEigen(gram, vectors, k);
+    std::vector<int32_t> order(k);
+    for (int32_t c = 0; c < k; ++c)
+    {
+        order[c] = c;
+    }
+    std::sort(order.begin(), order.end(), [&](int32_t x, int32_t y)
+    {
+        return gram[static_cast<size_t>(x) * k + x] > gram[static_cast<size_t>(y) * k + y];
+    });
+
+    for (int32_t r = 0; r < rank; ++r)
+    {
+        int32_t e = order[r];
+        double sigma = std::sqrt(std::max(gram[static_cast<size_t>(e) * k + e], 0.0));
+        double scale = sigma > 1e-12 ? std::sqrt(sigma) : 0.0;
+        double inverse = sigma > 1e-12 ? 1.0 / scale : 0.0;
+        // U column r = Q * e * sqrt(sigma), V row r = e^T * B / sqrt(sigma).
+        for (size_t i = 0; i < in; ++i)
+        {
+            double sum = 0.0;
+            for (int32_t c = 0; c < k; ++c)
+            {
+                sum += q[i * k + c] * vectors[static_cast<size_t>(c) * k + e];
+            }
+            u[i * rank + r] = static_cast<float>(sum * scale);
+        }
+        for (size_t j = 0; j < out; ++j)
+        {
+            double sum = 0.0;
+            for (int32_t c = 0; c < k; ++c)
+            {
+                sum += b[j * k + c] * vectors[static_cast<size_t>(c) * k + e];
+            }
+            v[static_cast<size_t>(r) * out + j] = static_cast<float>(sum * inverse);
+        }
+    }
+
+    double error = 0.0;
+    double norm = 0.0;
+    std::vector<double> row(out);
+    for (size_t i = 0; i < in; ++i)
+    {
+        std::fill(row.begin(), row.end(), 0.0);
+        for (int32_t r = 0; r < rank; ++r)
+        {
+            double ui = u[i * rank + r];
+            for (size_t j = 0; j < out; ++j)
+            {
+                row[j] += ui * v[static_cast<size_t>(r) * out + j];
+            }
+        }
+        for (size_t j = 0; j < out; ++j)
+        {
+            double w = weights[i * out + j];
+            error += (w - row[j]) * (w - row[j]);
+            norm += w * w;
+        }
+    }
+    return norm > 0.0 ? std::sqrt(error / norm) : 0.0;
+}
+
+// a LowRankLayer approximating a trained hidden fully connected layer,
+// with the same bias and activation. 'error' receives the relative
+// error of the factorized weights.
+std::shared_ptr<BaseLayer> FactorizeLayer(BaseLayer& layer, int32_t rank, double* error = nullptr)
+{
+    assert(layer.Kind() == LayerKind::FullyConnectedHidden);
+    int32_t inputDim = layer.InputDim();
+    int32_t outputDim = layer.OutputDim();
+    auto factorized = DispatchActivation(layer.OutputActivation(), [&](auto policy) -> std::shared_ptr<BaseLayer>
+    {
+        return std::make_shared<LowRankLayer<decltype(policy)>>(inputDim, outputDim, rank);
+    });
+
+    auto source = layer.parameters();
+    auto target = factorized->parameters();
+    source[0].buffer->ensureVerified();
+    source[1].buffer->ensureVerified();
+    target[0].buffer->assign(target[0].count, 0.0f);
+    target[1].buffer->assign(target[1].count, 0.0f);
+    double relativeError = FactorizeWeights(source[0].buffer->data(), inputDim, outputDim, rank,
+        target[0].buffer->data(), target[1].buffer->data());
+    *target[2].buffer = *source[1].buffer;
+    if (error != nullptr)
+    {
+        *error = relativeError;
+    }
+    return factorized;
+}
+
+// factorize every hidden fully connected layer for which rank 'rank'
+// saves weights, returns how many were replaced.
+int32_t FactorizeLayers(LayerSet& layers, int32_t rank)
+{
+    int32_t factorized = 0;
+    for (auto& layer : layers)
+    {
+        int64_t dense = static_cast<int64_t>(layer->InputDim()) * layer->OutputDim();
+        int64_t lowRank = static_cast<int64_t>(rank) * (layer->InputDim() + layer->OutputDim());
+        if (layer->Kind() != LayerKind::FullyConnectedHidden || lowRank >= dense)
+        {
+            continue;
+        }
+        double error = 0.0;
+        layer = FactorizeLayer(*layer, rank, &error);
+        std::cout << "Factorized " << layer->InputDim() << "x" << layer->OutputDim() << " layer to rank " << rank
+            << ", " << lowRank << " of " << dense << " weights, relative error " << error << std::endl;
+        ++factorized;
+    }
+    return factorized;
+}
+
+////////////////////////////////////////
+// Inference
+//
+// InferenceSession compiles a LayerSet into an immutable plan: the weights
+// of all layers are packed into one aligned arena, every layer becomes a
+// plain op dispatched with a switch, and scratch space is preallocated per
+// calling thread. A session is never modified after construction, so any
+// number of threads can call run() concurrently.
+////////////////////////////////////////
+
+enum class InferenceOpKind : uint32_t
+{
+    Dense,
+    DenseSoftmax,     // dense layer followed by a softmax over each sample
+    ClassMajorSoftmax,        // softmax over class major weights, see ClassMajorOutputLayer
+    HierarchicalSoftmax,
+    Embedding,
+    BlockSparseDense,       // dense layer with pruned weights, see BlockSparseWeights
+    LowRankDense,           // two GEMMs through the rank wide intermediate, see LowRankLayer
+};
+
+// dense layers whose pruned weights keep at most this fraction of blocks
+// run through BlockSparseForward, which wins well before that point.
+const double kBlockSparseMaxDensity = 0.6;
+
+// Set the fields by name, the struct grows with every new kind of op.
+struct InferenceOp
+{
+    InferenceOpKind kind = InferenceOpKind::Dense;
+    int32_t inputDim = 0;
+    int32_t outputDim = 0;
+    size_t weightOffset = 0;        // into the session weight arena
+    size_t biasOffset = 0;
+    ActivationKind activation = ActivationKind::Identity;
+    size_t clusterWeightOffset = 0;     // HierarchicalSoftmax only
+    size_t clusterBiasOffset = 0;
+    size_t sparseWeights = 0;           // BlockSparseDense: index into the session's block sparse weights
+    int32_t rank = 0;                   // LowRankDense, U is at weightOffset and V at factorOffset
+    size_t factorOffset = 0;
+    int32_t vocabularySize = 0;         // Embedding, rows of the table
+};
+
+// Scratch buffers of one caller. Reusing a context avoids any allocation per request.
+struct InferenceContext
+{
+    std::vector<float, AlignedAllocator<float, 64>> buffers[2];
+    std::vector<float, AlignedAllocator<float, 64>> scratch;     // intermediate inside an op
+};
+
+class InferenceSession
+{
+public:
+    InferenceSession(LayerSet& layers)
+        : _inputDim(0),
+        _outputDim(0),
+        _maxDim(0)
+    {
+        assert(!layers.empty());
+        _inputDim = layers[0]->InputDim();
+        _maxDim = _inputDim;
+
+        // first pass sizes the arena, second pass packs the weights.
+        size_t arenaSize = 0;
+        for (auto layer : layers)
+        {
+            for (auto& param : layer->parameters())
+            {
+                arenaSize += AlignCount(param.count);
+            }
+        }
+        _weights.assign(arenaSize, 0.0f);
+
+        size_t offset = 0;
+        int32_t prevDim = _inputDim;
+        for (auto layer : layers)
+        {
+            assert(layer->InputDim() == prevDim);
+            prevDim = layer->OutputDim();
+            _maxDim = std::max(_maxDim, prevDim);
+
+            std::vector<size_t> offsets;
+            for (auto& param : layer->parameters())
+            {
+                assert(param.buffer->size() == param.count);
+                param.buffer->ensureVerified();
+                std::copy(param.buffer->begin(), param.buffer->end(), _weights.begin() + offset);
+                offsets.push_back(offset);
+                offset += AlignCount(param.count);
+            }
+
+            if (layer->Kind() == LayerKind::Input)
+            {
+                // the input layer is a pass through, nothing to run.
+                continue;
+            }
+
+            InferenceOp op;
+            op.inputDim = layer->InputDim();
+            op.outputDim = layer->OutputDim();
+            op.weightOffset = offsets[0];
+            switch (layer->Kind())
+            {
+            case LayerKind::Input:
+                break;
+
+            case LayerKind::FullyConnectedHidden:
+            case LayerKind::FullyConnectedOutput:
+            {
+                op.kind = InferenceOpKind::Dense;
+                op.biasOffset = offsets[1];
+                op.activation = layer->OutputActivation();
+                auto sparse = BlockSparseWeights::FromDense(_weights.data() + offsets[0], layer->InputDim(), layer->OutputDim());
+                if (sparse.density() <= kBlockSparseMaxDensity)
+                {
+                    op.kind = InferenceOpKind::BlockSparseDense;
+                    op.sparseWeights = _sparseWeights.size();
+                    _sparseWeights.push_back(std::move(sparse));
+                }
+                break;
+            }
+
+            case LayerKind::SoftmaxCrossEntropyOutput:
+                op.kind = InferenceOpKind::DenseSoftmax;
+                op.biasOffset = offsets[1];
+                break;
+
+            case LayerKind::SampledSoftmaxOutput:
+                op.kind = InferenceOpKind::ClassMajorSoftmax;
+                op.biasOffset = offsets[1];
+                break;
+
+            case LayerKind::HierarchicalSoftmaxOutput:
+                op.kind = InferenceOpKind::HierarchicalSoftmax;
+                op.biasOffset = offsets[1];
+                op.clusterWeightOffset = offsets[2];
+                op.clusterBiasOffset = offsets[3];
+                break;
+
+            case LayerKind::LowRank:
+                op.kind = InferenceOpKind::LowRankDense;
+                op.biasOffset = offsets[2];
+                op.activation = layer->OutputActivation();
+                op.rank = static_cast<int32_t>(layer->Option());
+                op.factorOffset = offsets[1];
+                _maxRank = std::max(_maxRank, op.rank);
+                break;
+
+            case LayerKind::Embedding:
+                op.kind = InferenceOpKind::Embedding;
+                op.vocabularySize = static_cast<int32_t>(layer->Option());
+                break;
+            }
+            _ops.push_back(op);
+        }
+        _outputDim = prevDim;
+    }
+
+    int32_t InputDim() const { return _inputDim; }
+    int32_t OutputDim() const { return _outputDim; }
+
+    // run 'batch' row major samples through the plan, 'output' receives batch * OutputDim() values.
+    void run(const float* input, float* output, int32_t batch, InferenceContext& context) const
+    {
+        reserve(batch, context);
+        runOps(0, input, output, batch, context);
+        if (_ops.empty())
+        {
+            std::copy(input, input + static_cast<size_t>(batch) * _inputDim, output);
+        }
+    }
+
+    // run a batch of sparse samples: the first op, which has to be a
+    // dense layer, only reads the weight rows of their active features.
+    void run(const SparseBatch& input, float* output, InferenceContext& context) const
+    {
+        assert(!_ops.empty() && (_ops[0].kind == InferenceOpKind::Dense || _ops[0].kind == InferenceOpKind::BlockSparseDense));
+        int32_t batch = input.batchSize();
+        reserve(batch, context);
+        const InferenceOp& op = _ops[0];
+        float* next = (_ops.size() == 1) ? output : context.buffers[0].data();
+        SparseDenseForward(input, _weights.data() + op.weightOffset, _weights.data() + op.biasOffset, next, op.outputDim, op.activation);
+        runOps(1, next, output, batch, context);
+    }
+
+    // single sample convenience, uses a scratch context owned by the calling thread.
+    void run(const float* input, float* output) const
+    {
+        thread_local InferenceContext context;
+        run(input, output, 1, context);
+    }
+
+    std::vector<float> run(const std::vector<float>& input) const
+    {
+        assert(static_cast<int32_t>(input.size()) == _inputDim);
+        std::vector<float> output(_outputDim);
+        run(input.data(), output.data());
+        return output;
+    }
+
+private:
+    void reserve(int32_t batch, InferenceContext& context) const
+    {
+        size_t bufferSize = static_cast<size_t>(batch) * _maxDim;
+        for (auto& buffer : context.buffers)
+        {
+            if (buffer.size() < bufferSize)
+            {
+                buffer.resize(bufferSize);
+            }
+        }
+        if (context.scratch.size() < static_cast<size_t>(batch) * _maxRank)
+        {
+            context.scratch.resize(static_cast<size_t>(batch) * _maxRank);
+        }
+    }
+
+    // runs _ops[firstOp..] on 'current', the input of op firstOp.
+    void runOps(size_t firstOp, const float* current, float* output, int32_t batch, InferenceContext& context) const
+    {
+        for (size_t i = firstOp; i < _ops.size(); ++i)
+        {
+            const InferenceOp& op = _ops[i];
+            // the last op writes straight into the caller's output.
+            float* next = (i + 1 == _ops.size()) ? output : context.buffers[i % 2].data();
+            switch (op.kind)
+            {
+            case InferenceOpKind::Dense:
+                DenseForward(current, _weights.data() + op.weightOffset, _weights.data() + op.biasOffset, next,
+                    batch, op.inputDim, op.outputDim, op.activation);
+                break;
+            case InferenceOpKind::DenseSoftmax:
+                DenseForward(current, _weights.data() + op.weightOffset, _weights.data() + op.biasOffset, next,
+                    batch, op.inputDim, op.outputDim, ActivationKind::Identity);
+                SoftmaxRows(next, batch, op.outputDim);
+                break;
+            case InferenceOpKind::ClassMajorSoftmax:
+                ClassMajorSoftmaxForward(current, _weights.data() + op.weightOffset, _weights.data() + op.biasOffset, next,
+                    batch, op.inputDim, op.outputDim);
+                break;
+            case InferenceOpKind::HierarchicalSoftmax:
+                HierarchicalSoftmaxForward(current, _weights.data() + op.weightOffset, _weights.data() + op.biasOffset,
+                    _weights.data() + op.clusterWeightOffset, _weights.data() + op.clusterBiasOffset, next,
+                    batch, op.inputDim, op.outputDim, HierarchicalClusterSize(op.outputDim));
+                break;
+            case InferenceOpKind::Embedding:
+                EmbeddingLookup(current, _weights.data() + op.weightOffset, next, batch, op.inputDim, op.outputDim / op.inputDim,
+                    op.vocabularySize);
+                break;
+            case InferenceOpKind::BlockSparseDense:
+                BlockSparseForward(current, _sparseWeights[op.sparseWeights], _weights.data() + op.biasOffset, next, batch, op.activation);
+                break;
+            case InferenceOpKind::LowRankDense:
+                DenseForward(current, _weights.data() + op.weightOffset, nullptr, context.scratch.data(),
+                    batch, op.inputDim, op.rank, ActivationKind::Identity);
+                DenseForward(context.scratch.data(), _weights.data() + op.factorOffset, _weights.data() + op.biasOffset, next,
+                    batch, op.rank, op.outputDim, op.activation);
+                break;
+            }
+            current = next;
+        }
+    }
+
+    // keep every parameter array 64 byte aligned inside the arena.
+    static size_t AlignCount(size_t count)
+    {
+        return (count + 15) & ~static_cast<size_t>(15);
+    }
+
+    std::vector<InferenceOp> _ops;
+    std::vector<float, AlignedAllocator<float, 64>> _weights;
+    std::vector<BlockSparseWeights> _sparseWeights;
+    int32_t _inputDim;
+    int32_t _outputDim;
+    int32_t _maxDim;
+    int32_t _maxRank = 0;
+};
+
+// Latency distribution of a set of requests, in microseconds.
+struct LatencySummary
+{
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    double max = 0;
+
+    static LatencySummary FromSamples(std::vector<double>& micros)
+    {
+        LatencySummary summary;
+        if (micros.empty())
+        {
+            return summary;
+        }
+        std::sort(micros.begin(), micros.end());
+        auto at = [&](double quantile) { return micros[std::min(micros.size() - 1, static_cast<size_t>(quantile * micros.size()))]; };
+        summary.p50 = at(0.50);
+        summary.p99 = at(0.99);
+        summary.p999 = at(0.999);
+        summary.max = micros.back();
+        return summary;
+    }
+};
+
+// Issue single sample requests against 'session' from 'threads' threads
+// concurrently and report the per-request latency distribution.
+LatencySummary BenchmarkInferenceLatency(const InferenceSession& session, int32_t threads, int32_t requestsPerThread)
+{
+    std::vector<std::vector<double>> latencies(threads);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (int32_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t]()
+        {
+            std::mt19937 engine(t);
+            std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+            std::vector<float> input(session.InputDim());
+            std::vector<float> output(session.OutputDim());
+            latencies[t].reserve(requestsPerThread);
+            for (int32_t r = 0; r < requestsPerThread; ++r)
+            {
+                for (auto& value : input)
+                {
+                    value = distribution(engine);
+                }
+                auto requestStart = Clock::now();
+                session.run(input.data(), output.data());
+                latencies[t].push_back(SecondsSince(requestStart) * 1e6);
+            }
+        });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    double elapsed = SecondsSince(start);
+
+    std::vector<double> all;
+    for (auto& perThread : latencies)
+    {
+        all.insert(all.end(), perThread.begin(), perThread.end());
+    }
+    LatencySummary summary = LatencySummary::FromSamples(all);
+    std::cout << "inference " << session.InputDim() << "->" << session.OutputDim() << ", " << threads << " threads: "
+        << "p50 " << summary.p50 << " us, p99 " << summary.p99 << " us, p99.9 " << summary.p999 << " us, "
+        << all.size() / elapsed << " requests/s" << std::endl;
+    return summary;
+}
+
+// Knobs of DynamicBatcher: a batch is dispatched once it holds
+// maxBatchSize requests or its oldest request has waited maxDelay.
+struct BatchingOptions
+{
+    int32_t maxBatchSize = 32;
+    std::chrono::microseconds maxDelay = std::chrono::microseconds(200);
+};
+
+// Serving front end for many threads that each submit one sample.
+// Concurrent requests are collected into one batch that runs through the
+// session as a single batched GEMM per layer; every request gets its own future.
+class DynamicBatcher
+{
+public:
+    DynamicBatcher(std::shared_ptr<const InferenceSession> session, BatchingOptions options = BatchingOptions())
+        : _session(session),
+        _options(options),
+        _stop(false),
+        _batches(0),
+        _requests(0)
+    {
+        assert(_options.maxBatchSize > 0);
+        _thread = std::thread([this]() { run(); });
+    }
+
+    ~DynamicBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _thread.join();
+    }
+
+    std::future<std::vector<float>> submit(std::vector<float> input)
+    {
+        assert(static_cast<int32_t>(input.size()) == _session->InputDim());
+        Request request;
+        request.input = std::move(input);
+        request.arrival = Clock::now();
+        auto result = request.result.get_future();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _queue.push_back(std::move(request));
+        bool full = static_cast<int32_t>(_queue.size()) >= _options.maxBatchSize;
+        bool first = _queue.size() == 1;
+        lock.unlock();
+
+        // the worker only needs waking to start a deadline or to dispatch a full batch.
+        if (first || full)
+        {
+            _wake.notify_one();
+        }
+        return result;
+    }
+
+    // average number of requests per dispatched batch.
+    double averageBatchSize() const
+    {
+        uint64_t batches = _batches.load();
+        return batches > 0 ? static_cast<double>(_requests.load()) / batches : 0;
+    }
+
+private:
+    struct Request
+    {
+        std::vector<float> input;
+        std::promise<std::vector<float>> result;
+        Clock::time_point arrival;
+    };
+
+    void run()
+    {
+        InferenceContext context;
+        std::vector<float> inputs;
+        std::vector<float> outputs;
+        std::vector<Request> batch;
+        int32_t inputDim = _session->InputDim();
+        int32_t outputDim = _session->OutputDim();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [this]() { return _stop || !_queue.empty(); });
+            if (_queue.empty())
+            {
+                break;
+            }
+
+            // hold the batch open until it is full or the oldest request hits its deadline.
+            auto deadline = _queue.front().arrival + _options.maxDelay;
+            _wake.wait_until(lock, deadline, [this]()
+            {
+                return _stop || static_cast<int32_t>(_queue.size()) >= _options.maxBatchSize;
+            });
+
+            size_t count = std::min(_queue.size(), static_cast<size_t>(_options.maxBatchSize));
+            batch.clear();
+            for (size_t i = 0; i < count; ++i)
+            {
+                batch.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+            }
+            lock.unlock();
+
+            inputs.resize(count * inputDim);
+            outputs.resize(count * outputDim);
+            for (size_t i = 0; i < count; ++i)
+            {
+                std::copy(batch[i].input.begin(), batch[i].input.end(), inputs.begin() + i * inputDim);
+            }
+
+            _session->run(inputs.data(), outputs.data(), static_cast<int32_t>(count), context);
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto first = outputs.begin() + i * outputDim;
+                batch[i].result.set_value(std::vector<float>(first, first + outputDim));
+            }
+            _batches++;
+            _requests += count;
+
+            lock.lock();
+        }
+    }
+
+    std::shared_ptr<const InferenceSession> _session;
+    BatchingOptions _options;
+    std::deque<Request> _queue;
+    bool _stop;
+    std::atomic<uint64_t> _batches;
+    std::atomic<uint64_t> _requests;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::thread _thread;
+};
+
+// Closed loop load generator: 'clients' threads each submit a request and
+// wait for its result, for 'seconds'. Reports throughput and latency for
+// the given batching options, one point on the throughput/latency curve.
+LatencySummary BenchmarkBatching(
+    std::shared_ptr<const InferenceSession> session,
+    BatchingOptions options,
+    int32_t clients,
+    double seconds)
+{
+    DynamicBatcher batcher(session, options);
+    std::vector<std::vector<double>> latencies(clients);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (int32_t c = 0; c < clients; ++c)
+    {
+        workers.emplace_back([&, c]()
+        {
+            std::mt19937 engine(c);
+            std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+            std::vector<float> input(session->InputDim());
+            while (SecondsSince(start) < seconds)
+            {
+                for (auto& value : input)
+                {
+                    value = distribution(engine);
+                }
+                auto requestStart = Clock::now();
+                batcher.submit(input).get();
+                latencies[c].push_back(SecondsSince(requestStart) * 1e6);
+            }
+        });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    double elapsed = SecondsSince(start);
+
+    std::vector<double> all;
+    for (auto& perClient : latencies)
+    {
+        all.insert(all.end(), perClient.begin(), perClient.end());
+    }
+    LatencySummary summary = LatencySummary::FromSamples(all);
+    std::cout << "batch <= " << options.maxBatchSize << ", delay " << options.maxDelay.count() << " us, "
+        << clients << " clients: " << all.size() / elapsed << " requests/s, p50 " << summary.p50
+        << " us, p99 " << summary.p99 << " us, mean batch " << batcher.averageBatchSize() << std::endl;
+    return summary;
+}
+
+////////////////////////////////////////
+// Static networks
+//
+// For small fixed production models the topology can be spelled out as
+// template arguments, e.g.
+//   Static::StaticNetwork<Static::InputLayer<3>, Static::FC<3, 20>, Static::FC<20, 2>>
+// All dimensions are compile time constants: mismatched layers fail to
+// compile instead of tripping Trainer::validate, the activations live in
+// std::arrays on the stack and every loop is unrolled.
+////////////////////////////////////////
+
+namespace Static
+{
+
+// Unroll<N> is one template instantiation deep per iteration and FC
+// spells out all In * Out multiply-adds, so the layers stay tiny.
+constexpr int32_t MaxUnrolledCount = 256;
+constexpr int32_t MaxUnrolledWeights = 1024;
+
+// calls f(0) ... f(Count - 1) in order. The index is passed as a plain
+// int32_t, not as a constant expression; the calls are unrolled, and once
+// they are inlined the compiler sees each index as a literal and folds it.
+template <int32_t Count>
+struct Unroll
+{
+    template <typename F>
+    static void run(F&& f)
+    {
+        Unroll<Count - 1>::run(f);
+        f(Count - 1);
+    }
+};
+
+template <>
+struct Unroll<0>
+{
+    template <typename F>
+    static void run(F&&) {}
+};
+
+template <int32_t Dim>
+class InputLayer
+{
+public:
+    static constexpr int32_t InputDim = Dim;
+    static constexpr int32_t OutputDim = Dim;
+
+    void forward(const std::array<float, Dim>& input, std::array<float, Dim>& output) const
+    {
+        output = input;
+    }
+
+    bool load(BaseLayer& layer)
+    {
+        return layer.Kind() == LayerKind::Input && layer.InputDim() == Dim;
+    }
+};
+
+template <int32_t In, int32_t Out, ActivationKind Activation = ActivationKind::Sigmoid>
+class FC
+{
+    static_assert(In <= MaxUnrolledCount && Out <= MaxUnrolledCount && In * Out <= MaxUnrolledWeights,
+        "Static::FC unrolls every weight, larger layers belong in an InferenceSession");
+
+public:
+    static constexpr int32_t InputDim = In;
+    static constexpr int32_t OutputDim = Out;
+
+    FC()
+    {
+        _weights.fill(0.0f);
+        _biases.fill(0.0f);
+    }
+
+    void forward(const std::array<float, In>& input, std::array<float, Out>& output) const
+    {
+        std::array<float, Out> sigma = _biases;
+        Unroll<In>::run([&](int32_t i)
+        {
+            Unroll<Out>::run([&](int32_t j)
+            {
+                sigma[j] += input[i] * _weights[i * Out + j];
+            });
+        });
+        Unroll<Out>::run([&](int32_t j)
+        {
+            output[j] = Activate(Activation, sigma[j]);
+        });
+    }
+
+    // copy the weights of a trained fully connected layer with the same shape.
+    bool load(BaseLayer& layer)
+    {
+        if ((layer.Kind() != LayerKind::FullyConnectedHidden && layer.Kind() != LayerKind::FullyConnectedOutput) ||
+            layer.InputDim() != In || layer.OutputDim() != Out || layer.OutputActivation() != Activation)
+        {
+            return false;
+        }
+
+        auto params = layer.parameters();
+        params[0].buffer->ensureVerified();
+        params[1].buffer->ensureVerified();
+        std::copy(params[0].buffer->begin(), params[0].buffer->end(), _weights.begin());
+        std::copy(params[1].buffer->begin(), params[1].buffer->end(), _biases.begin());
+        return true;
+    }
+
+    std::array<float, In * Out>& weights() { return _weights; }
+    std::array<float, Out>& biases() { return _biases; }
+
+private:
+    std::array<float, In * Out> _weights;
+    std::array<float, Out> _biases;
+};
+
+template <typename Last>
+constexpr bool DimensionsChainFrom(std::tuple<Last>*)
+{
+    return true;
+}
+
+template <typename First, typename Second, typename... Rest>
+constexpr bool DimensionsChainFrom(std::tuple<First, Second, Rest...>*)
+{
+    return First::OutputDim == Second::InputDim &&
+        DimensionsChainFrom(static_cast<std::tuple<Second, Rest...>*>(nullptr));
+}
+
+template <typename... Layers>
+class StaticNetwork
+{
+    static_assert(sizeof...(Layers) >= 2, "a network needs at least an input and an output layer");
+    static_assert(DimensionsChainFrom(static_cast<std::tuple<Layers...>*>(nullptr)),
+        "the output dimension of every layer must match the input dimension of the next layer");
+
+    typedef std::tuple<Layers...> LayerTuple;
+
+    template <size_t Index>
+    using LayerAt = typename std::tuple_element<Index, LayerTuple>::type;
+
+public:
+    static constexpr int32_t InputDim = LayerAt<0>::InputDim;
+    static constexpr int32_t OutputDim = LayerAt<sizeof...(Layers) - 1>::OutputDim;
+
+    typedef std::array<float, InputDim> Input;
+    typedef std::array<float, OutputDim> Output;
+
+    Output run(const Input& input) const
+    {
+        return forwardFrom<0>(input);
+    }
+
+    // copy the weights of a trained LayerSet with the same topology.
+    bool load(LayerSet& layers)
+    {
+        return layers.size() == sizeof...(Layers) && loadFrom<0>(layers);
+    }
+
+    template <size_t Index>
+    LayerAt<Index>& layer() { return std::get<Index>(_layers); }
+
+private:
+    template <size_t Index>
+    typename std::enable_if<Index == sizeof...(Layers), Output>::type
+    forwardFrom(const Output& input) const
+    {
+        return input;
+    }
+
+    template <size_t Index>
+    typename std::enable_if<Index < sizeof...(Layers), Output>::type
+    forwardFrom(const std::array<float, LayerAt<Index>::InputDim>& input) const
+    {
+        std::array<float, LayerAt<Index>::OutputDim> output;
+        std::get<Index>(_layers).forward(input, output);
+        return forwardFrom<Index + 1>(output);
+    }
+
+    template <size_t Index>
+    typename std::enable_if<Index == sizeof...(Layers), bool>::type
+    loadFrom(LayerSet&)
+    {
+        return true;
+    }
+
+    template <size_t Index>
+    typename std::enable_if<Index < sizeof...(Layers), bool>::type
+    loadFrom(LayerSet& layers)
+    {
+        return std::get<Index>(_layers).load(*layers[Index]) && loadFrom<Index + 1>(layers);
+    }
+
+    LayerTuple _layers;
+};
+
+} // namespace Static
+
+////////////////////////////////////////
+// Code generation
+//
+// GenerateInferenceSource emits a standalone C++ file that computes the
+// forward pass of one trained LayerSet: every dimension is a literal, small
+// layers are unrolled into straight line dot products, larger ones become
+// loops with constant bounds, and each activation is fused into the
+// expression that produces its input. The weights are either embedded as
+// constant arrays or read in place from a memory mapped checkpoint.
+////////////////////////////////////////
+
+struct CodegenOptions
+{
+    // embed the weights in the source; otherwise the generated code maps this
+    // checkpoint, which has to hold the weights of the LayerSet. It is only
+    // read, to find the offsets of the sections.
+    std::string checkpointPath;
+    // the reader LoadCheckpoint opened on checkpointPath, opened here if null.
+    std::shared_ptr<CheckpointReader> checkpoint;
+    // layers with at most this many multiply-adds are fully unrolled.
+    int64_t unrollLimit = 4096;
+    // emit a main() that reads samples from stdin and prints the outputs.
+    bool emitMain = true;
+};
+
+// 'value' as a C++ float literal that round trips exactly.
+std::string FloatLiteral(float value)
+{
+    std::ostringstream text;
+    text << std::setprecision(9) << value;
+    std::string literal = text.str();
+    if (literal.find_first_of(".e") == std::string::npos)
+    {
+        literal += ".0";
+    }
+    return literal + "f";
+}
+
+std::string ActivationExpression(ActivationKind activation, const std::string& value)
+{
+    switch (activation)
+    {
+    case ActivationKind::Identity:
+        return value;
+    case ActivationKind::Sigmoid:
+        return "1.0f / (1.0f + std::exp(-(" + value + ")))";
+    case ActivationKind::Relu:
+        return "std::fmax(" + value + ", 0.0f)";
+    case ActivationKind::LeakyRelu:
+        return "LeakyRelu(" + value + ")";
+    case ActivationKind::Tanh:
+        return "std::tanh(" + value + ")";
+    case ActivationKind::Gelu:
+        return "Gelu(" + value + ")";
+    }
+    return value;
+}
+
+// definition of the helper an ActivationExpression calls, empty if it needs none.
+std::string ActivationHelperSource(ActivationKind activation)
+{
+    std::ostringstream source;
+    switch (activation)
+    {
+    case ActivationKind::LeakyRelu:
+        source << "static inline float LeakyRelu(float x) { return x > 0.0f ? x : " << FloatLiteral(LeakyReluActivation::Slope) << " * x; }" << std::endl;
+        break;
+    case ActivationKind::Gelu:
+        source << "static inline float Gelu(float x) { return 0.5f * x * (1.0f + std::tanh("
+            << FloatLiteral(GeluActivation::Scale) << " * (x + " << FloatLiteral(GeluActivation::Cubic) << " * x * x * x))); }" << std::endl;
+        break;
+    default:
+        break;
+    }
+    return source.str();
+}
+
+// Returns false if the LayerSet contains a layer kind the generator does not support.
+bool GenerateInferenceSource(LayerSet& layers, std::ostream& out, const CodegenOptions& options = CodegenOptions())
+{
+    struct DenseStage
+    {
+        int32_t inputDim;
+        int32_t outputDim;
+        ActivationKind activation;
+        WeightBuffer* weights;
+        WeightBuffer* biases;
+        uint64_t weightOffset;      // in the checkpoint
+        uint64_t biasOffset;
+        bool softmax;               // normalize the outputs with a softmax
+    };
+
+    // the generated code reads the sections in place, so take their offsets from the file it will map.
+    std::shared_ptr<CheckpointReader> reader = options.checkpointPath.empty() ? nullptr : options.checkpoint;
+    if (!options.checkpointPath.empty() && !reader)
+    {
+        reader = std::make_shared<CheckpointReader>();
+        if (!reader->open(options.checkpointPath))
+        {
+            return false;
+        }
+    }
+
+    std::vector<DenseStage> stages;
+    for (uint32_t layerIndex = 0; layerIndex < layers.size(); ++layerIndex)
+    {
+        auto layer = layers[layerIndex];
+        switch (layer->Kind())
+        {
+        case LayerKind::Input:
+            break;
+        case LayerKind::FullyConnectedHidden:
+        case LayerKind::FullyConnectedOutput:
+        case LayerKind::SoftmaxCrossEntropyOutput:
+        {
+            auto params = layer->parameters();
+            DenseStage stage = { layer->InputDim(), layer->OutputDim(), layer->OutputActivation(), params[0].buffer, params[1].buffer, 0, 0,
+                layer->Kind() == LayerKind::SoftmaxCrossEntropyOutput };
+            stage.weights->ensureVerified();
+            stage.biases->ensureVerified();
+            if (reader)
+            {
+                int32_t weightSection = reader->findSection(CheckpointSectionKind::Parameter, layerIndex, 0);
+                int32_t biasSection = reader->findSection(CheckpointSectionKind::Parameter, layerIndex, 1);
+                if (weightSection < 0 || biasSection < 0 ||
+                    reader->entry(weightSection).size != params[0].count * sizeof(float) ||
+                    reader->entry(biasSection).size != params[1].count * sizeof(float))
+                {
+                    std::cerr << "checkpoint " << options.checkpointPath << " does not hold layer " << layerIndex << std::endl;
+                    return false;
+                }
+                stage.weightOffset = reader->entry(weightSection).offset;
+                stage.biasOffset = reader->entry(biasSection).offset;
+            }
+            stages.push_back(stage);
+            break;
+        }
+        default:
+            std::cerr << "code generation does not support layer " << layerIndex << std::endl;
+            return false;
+        }
+    }
+
+    int32_t inputDim = layers[0]->InputDim();
+    int32_t outputDim = layers.back()->OutputDim();
+
+    out << "// Generated by TahoeNN for a";
+    out << " " << inputDim;
+    for (auto& stage : stages)
+    {
+        out << "-" << stage.outputDim;
+    }
+    out << " network. Do not edit." << std::endl;
+    out << "#include <cmath>" << std::endl;
+    out << "#include <cstdio>" << std::endl;
+    out << "#include <cstdint>" << std::endl;
+    if (reader)
+    {
+        out << "#include <cstring>" << std::endl;
+        out << "#include <fcntl.h>" << std::endl;
+        out << "#include <unistd.h>" << std::endl;
+        out << "#include <sys/mman.h>" << std::endl;
+        out << "#include <sys/stat.h>" << std::endl;
+    }
+    out << std::endl;
+    out << "const int kInputDim = " << inputDim << ";" << std::endl;
+    out << "const int kOutputDim = " << outputDim << ";" << std::endl;
+    out << std::endl;
+    std::set<ActivationKind> activations;
+    for (auto& stage : stages)
+    {
+        activations.insert(stage.activation);
+    }
+    bool anyHelper = false;
+    for (auto activation : activations)
+    {
+        std::string helper = ActivationHelperSource(activation);
+        out << helper;
+        anyHelper = anyHelper || !helper.empty();
+    }
+    if (anyHelper)
+    {
+        out << std::endl;
+    }
+
+    out << std::setprecision(9);
+    if (reader)
+    {
+        const CheckpointSectionEntry& last = reader->entry(reader->sectionCount() - 1);
+        uint64_t fileSize = CheckpointAlign(last.offset + last.size);
+        out << "static const float* W[" << stages.size() << "];" << std::endl;
+        out << "static const float* B[" << stages.size() << "];" << std::endl << std::endl;
+        out << "// map the checkpoint the weights were generated from, returns false if it does not match." << std::endl;
+        out << "bool LoadWeights(const char* path)" << std::endl;
+        out << "{" << std::endl;
+        out << "    int fd = open(path, O_RDONLY);" << std::endl;
+        out << "    struct stat info;" << std::endl;
+        out << "    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size != " << fileSize << ")" << std::endl;
+        out << "    {" << std::endl;
+        out << "        return false;" << std::endl;
+        out << "    }" << std::endl;
+        out << "    void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);" << std::endl;
+        out << "    close(fd);" << std::endl;
+        out << "    if (base == MAP_FAILED || memcmp(base, \"TAHOENN\", 8) != 0)" << std::endl;
+        out << "    {" << std::endl;
+        out << "        return false;" << std::endl;
+        out << "    }" << std::endl;
+        for (size_t s = 0; s < stages.size(); ++s)
+        {
+            out << "    W[" << s << "] = reinterpret_cast<const float*>(static_cast<const char*>(base) + "
+                << stages[s].weightOffset << ");" << std::endl;
+            out << "    B[" << s << "] = reinterpret_cast<const float*>(static_cast<const char*>(base) + "
+                << stages[s].biasOffset << ");" << std::endl;
+        }
+        out << "    return true;" << std::endl;
+        out << "}" << std::endl << std::endl;
+    }
+    else
+    {
+        auto emitArray = [&](const std::string& name, const WeightBuffer& values)
+        {
+            out << "alignas(64) static const float " << name << "[" << values.size() << "] = {";
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                out << (i % 8 == 0 ? "\n    " : " ") << FloatLiteral(values[i]) << ",";
+            }
+            out << "\n};" << std::endl << std::endl;
+        };
+        for (size_t s = 0; s < stages.size(); ++s)
+        {
+            emitArray("W" + std::to_string(s), *stages[s].weights);
+            emitArray("B" + std::to_string(s), *stages[s].biases);
+        }
+    }
+
+    out << "// input: kInputDim floats, output: kOutputDim floats." << std::endl;
+    out << "void TahoeInfer(const float* __restrict input, float* __restrict output)" << std::endl;
+    out << "{" << std::endl;
+    std::string current = "input";
+    for (size_t s = 0; s < stages.size(); ++s)
+    {
+        const DenseStage& stage = stages[s];
+        std::string weights = reader ? "W[" + std::to_string(s) + "]" : "W" + std::to_string(s);
+        std::string biases = reader ? "B[" + std::to_string(s) + "]" : "B" + std::to_string(s);
+        std::string target = (s + 1 == stages.size()) ? "output" : "a" + std::to_string(s);
+        out << "    // dense " << stage.inputDim << " -> " << stage.outputDim << std::endl;
+        if (target != "output")
+        {
+            out << "    float " << target << "[" << stage.outputDim << "];" << std::endl;
+        }
+
+        if (static_cast<int64_t>(stage.inputDim) * stage.outputDim <= options.unrollLimit)
+        {
+            for (int32_t j = 0; j < stage.outputDim; ++j)
+            {
+                std::ostringstream sum;
+                sum << biases << "[" << j << "]";
+                for (int32_t i = 0; i < stage.inputDim; ++i)
+                {
+                    sum << " + " << weights << "[" << static_cast<int64_t>(i) * stage.outputDim + j << "] * " << current << "[" << i << "]";
+                }
+                out << "    " << target << "[" << j << "] = " << ActivationExpression(stage.activation, sum.str()) << ";" << std::endl;
+            }
+        }
+        else
+        {
+            out << "    {" << std::endl;
+            out << "        float sigma[" << stage.outputDim << "];" << std::endl;
+            out << "        for (int j = 0; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            sigma[j] = " << biases << "[j];" << std::endl;
+            out << "        }" << std::endl;
+            out << "        for (int i = 0; i < " << stage.inputDim << "; ++i)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            const float x = " << current << "[i];" << std::endl;
+            out << "            const float* row = " << weights << " + i * " << stage.outputDim << ";" << std::endl;
+            out << "            for (int j = 0; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "            {" << std::endl;
+            out << "                sigma[j] += x * row[j];" << std::endl;
+            out << "            }" << std::endl;
+            out << "        }" << std::endl;
+            out << "        for (int j = 0; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            " << target << "[j] = " << ActivationExpression(stage.activation, "sigma[j]") << ";" << std::endl;
+            out << "        }" << std::endl;
+            out << "    }" << std::endl;
+        }
+        if (stage.softmax)
+        {
+            out << "    {" << std::endl;
+            out << "        float m = " << target << "[0];" << std::endl;
+            out << "        for (int j = 1; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            m = std::fmax(m, " << target << "[j]);" << std::endl;
+            out << "        }" << std::endl;
+            out << "        float sum = 0.0f;" << std::endl;
+            out << "        for (int j = 0; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            " << target << "[j] = std::exp(" << target << "[j] - m);" << std::endl;
+            out << "            sum += " << target << "[j];" << std::endl;
+            out << "        }" << std::endl;
+            out << "        for (int j = 0; j < " << stage.outputDim << "; ++j)" << std::endl;
+            out << "        {" << std::endl;
+            out << "            " << target << "[j] /= sum;" << std::endl;
+            out << "        }" << std::endl;
+            out << "    }" << std::endl;
+        }
+        current = target;
+    }
+    out << "}" << std::endl;
+
+    if (options.emitMain)
+    {
+        out << std::endl;
+        out << "// reads samples of kInputDim whitespace separated floats from stdin, prints one output row per sample." << std::endl;
+        out << "int main(int argc, char** argv)" << std::endl;
+        out << "{" << std::endl;
+        if (reader)
+        {
+            out << "    const char* path = argc > 1 ? argv[1] : \"" << options.checkpointPath << "\";" << std::endl;
+            out << "    if (!LoadWeights(path))" << std::endl;
+            out << "    {" << std::endl;
+            out << "        fprintf(stderr, \"unable to map weights from %s\\n\", path);" << std::endl;
+            out << "        return 1;" << std::endl;
+            out << "    }" << std::endl;
+        }
+        else
+        {
+            out << "    (void)argc;" << std::endl;
+            out << "    (void)argv;" << std::endl;
+        }
+        out << "    float input[kInputDim];" << std::endl;
+        out << "    float output[kOutputDim];" << std::endl;
+        out << "    while (true)" << std::endl;
+        out << "    {" << std::endl;
+        out << "        for (int i = 0; i < kInputDim; ++i)" << std::endl;
+        out << "        {" << std::endl;
+        out << "            if (scanf(\"%f\", &input[i]) != 1)" << std::endl;
+        out << "            {" << std::endl;
+        out << "                return 0;" << std::endl;
+        out << "            }" << std::endl;
+        out << "        }" << std::endl;
+        out << "        TahoeInfer(input, output);" << std::endl;
+        out << "        for (int j = 0; j < kOutputDim; ++j)" << std::endl;
+        out << "        {" << std::endl;
+        out << "            printf(j + 1 < kOutputDim ? \"%.9g \" : \"%.9g\\n\", output[j]);" << std::endl;
+        out << "        }" << std::endl;
+        out << "    }" << std::endl;
+        out << "}" << std::endl;
+    }
+    return static_cast<bool>(out);
+}
+
+////////////////////////////////////////
+// Validation
+//
+// AsyncValidator measures a network on a held out feed while it trains.
+// submit() copies the weights into an InferenceSession on the training
+// thread, which is the only cost training sees; the pass over the
+// validation feed runs on background threads. Like AsyncCheckpointWriter,
+// a snapshot still waiting when a newer one arrives is replaced by it.
+////////////////////////////////////////
+
+struct ValidationResult
+{
+    uint64_t samplesSeen = 0;       // training samples seen when the weights were taken
+    uint64_t samples = 0;           // validation samples evaluated
+    double loss = 0;                // mean loss per sample
+    double accuracy = 0;            // fraction of samples whose top output is the target class
+    double seconds = 0;             // duration of the pass
+};
+
+struct ValidationOptions
+{
+    int32_t batchSize = 256;
+    int32_t threads = 1;            // evaluation threads, best left to cores training does not use
+    // called on a validation thread with every result, instead of printing it.
+    std::function<void(const ValidationResult&)> callback;
+};
+
+class AsyncValidator
+{
+public:
+    AsyncValidator(std::shared_ptr<IDataFeed> feed, const ValidationOptions& options = ValidationOptions())
+        : _feed(feed),
+        _options(options)
+    {
+        assert(options.batchSize > 0 && options.threads > 0);
+        _thread = std::thread([this]() { run(); });
+    }
+
+    ~AsyncValidator()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _thread.join();
+    }
+
+    // queue a pass over the current weights of 'layers'.
+    void submit(LayerSet& layers, uint64_t samplesSeen)
+    {
+        Snapshot snapshot;
+        snapshot.session = std::make_shared<const InferenceSession>(layers);
+        snapshot.samplesSeen = samplesSeen;
+        // output layers of the softmax family produce probabilities, scored by cross entropy.
+        LayerKind kind = layers.back()->Kind();
+        snapshot.probabilities = kind == LayerKind::SoftmaxCrossEntropyOutput || kind == LayerKind::SampledSoftmaxOutput
+            || kind == LayerKind::HierarchicalSoftmaxOutput;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _superseded += _pending.session ? 1 : 0;
+        _pending = std::move(snapshot);
+        lock.unlock();
+        _wake.notify_all();
+    }
+
+    // block until every submitted snapshot is evaluated or superseded.
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [this]() { return !_pending.session && !_running; });
+    }
+
+    std::vector<ValidationResult> results()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _results;
+    }
+
+    uint64_t Superseded()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _superseded;
+    }
+
+private:
+    struct Snapshot
+    {
+        std::shared_ptr<const InferenceSession> session;
+        uint64_t samplesSeen = 0;
+        bool probabilities = false;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [this]() { return _stop || _pending.session; });
+            if (!_pending.session)
+            {
+                break;
+            }
+            Snapshot snapshot = std::move(_pending);
+            _pending = Snapshot();
+            _running = true;
+            lock.unlock();
+
+            ValidationResult result;
+            bool evaluated = evaluate(snapshot, result);
+            if (evaluated)
+            {
+                if (_options.callback)
+                {
+                    _options.callback(result);
+                }
+                else
+                {
+                    std::cout << "validation after " << result.samplesSeen << " samples: loss " << result.loss
+                        << ", accuracy " << 100.0 * result.accuracy << "% over " << result.samples << " samples in "
+                        << result.seconds * 1e3 << " ms" << std::endl;
+                }
+            }
+
+            lock.lock();
+            if (evaluated)
+            {
+                _results.push_back(result);
+            }
+            _running = false;
+            _idle.notify_all();
+        }
+    }
+
+    // one pass over the feed; the threads pull batches from it in turn.
+    bool evaluate(const Snapshot& snapshot, ValidationResult& result)
+    {
+        if (_passes > 0 && !_feed->reset())
+        {
+            std::cerr << "validation feed cannot be replayed, skipping validation" << std::endl;
+            return false;
+        }
+        _passes++;
+
+        auto start = Clock::now();
+        const InferenceSession& session = *snapshot.session;
+        int32_t outputDim = session.OutputDim();
+        std::mutex feedMutex;
+        std::vector<ValidationResult> partial(_options.threads);
+        auto worker = [&](int32_t t)
+        {
+            InferenceContext context;
+            MiniBatch batch;
+            std::vector<float> output;
+            ValidationResult& sums = partial[t];
+            while (true)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(feedMutex);
+                    if (!_feed->getNextBatch(_options.batchSize, batch))
+                    {
+                        break;
+                    }
+                }
+                output.resize(static_cast<size_t>(batch.size) * outputDim);
+                session.run(batch.inputs.data(), output.data(), batch.size, context);
+                for (int32_t k = 0; k < batch.size; ++k)
+                {
+                    const float* y = output.data() + static_cast<size_t>(k) * outputDim;
+                    const float* t = batch.targets.data() + static_cast<size_t>(k) * outputDim;
+                    double loss = 0;
+                    for (int32_t j = 0; j < outputDim; ++j)
+                    {
+                        if (snapshot.probabilities)
+                        {
+                            loss -= t[j] != 0.0f ? t[j] * std::log(std::max(y[j], 1e-30f)) : 0.0;
+                        }
+                        else
+                        {
+                            loss += 0.5 * (y[j] - t[j]) * (y[j] - t[j]);
+                        }
+                    }
+                    sums.loss += loss;
+                    sums.accuracy += TargetClass(y, outputDim) == TargetClass(t, outputDim) ? 1 : 0;
+                }
+                sums.samples += batch.size;
+            }
+        };
+
+        std::vector<std::thread> helpers;
+        for (int32_t t = 1; t < _options.threads; ++t)
+        {
+            helpers.emplace_back(worker, t);
+        }
+        worker(0);
+        for (auto& helper : helpers)
+        {
+            helper.join();
+        }
+
+        result.samplesSeen = snapshot.samplesSeen;
+        for (auto& sums : partial)
+        {
+            result.samples += sums.samples;
+            result.loss += sums.loss;
+            result.accuracy += sums.accuracy;
+        }
+        if (result.samples > 0)
+        {
+            result.loss /= result.samples;
+            result.accuracy /= result.samples;
+        }
+        result.seconds = SecondsSince(start);
+        return true;
+    }
+
+    std::shared_ptr<IDataFeed> _feed;
+    ValidationOptions _options;
+    uint64_t _passes = 0;       // only touched by the validation thread
+    Snapshot _pending;
+    bool _running = false;
+    bool _stop = false;
+    uint64_t _superseded = 0;
+    std::vector<ValidationResult> _results;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    std::thread _thread;
+};
+
+/////////////////////////////////////////////
+// Trainer - This class does the actual training
+////////////////////////////////////////////
+class Trainer
+{   
+public:
+    Trainer(
+        std::shared_ptr<LayerSet> layerSet, 
+        std::shared_ptr<IDataFeed> dataFeed,
+        const OptimizerOptions& optimizerOptions = OptimizerOptions()
+    ) : _layers(layerSet),
+    _dataFeed(dataFeed)
+    {
+        validate();
+        initializeWeights();
+        fuseLayers();
+        setOptimizer(optimizerOptions);
+    }
+ 
+    void validate()
+    {
+        std::cout << "Validating Layer Set" << std::endl;
+        // ensure that there are atleast two layers.
+        assert(_layers->size() >= 2); 
+
+        int32_t prevLayerSize = (*_layers)[0]->InputDim();
+
+        for (auto layer : *_layers)
+        {
+            assert(prevLayerSize == layer->InputDim());
+            prevLayerSize = layer->OutputDim();
+        }
+
+        // the output layer computes the loss.
+        assert(dynamic_cast<ILossLayer*>(_layers->back().get()) != nullptr);
+
+        // feature ids have no gradient, so embeddings directly follow the InputLayer.
+        for (size_t i = 2; i < _layers->size(); ++i)
+        {
+            assert((*_layers)[i]->Kind() != LayerKind::Embedding);
+        }
+
+        // sparse input goes straight to the first layer after the InputLayer, which cannot be the output layer.
+        auto input = std::dynamic_pointer_cast<InputLayer>((*_layers)[0]);
+        if (input && input->Sparse())
+        {
+            assert(_layers->size() >= 3 && (*_layers)[1]->AcceptsSparseInput());
+        }
+    }
+
+    void initializeWeights()
+    {
+        // this initializes weights to random,
+        // layers restored from a checkpoint (see LoadCheckpoint) keep their weights.
+        for (auto layer : *_layers)
+        {
+            if (!layer->hasWeights())
+            {
+                layer->initializeWeights();
+            }
+
+            for (auto& param : layer->parameters())
+            {
+                // row sparse gradients only hold the rows a step touched.
+                param.gradient->assign(param.rows ? 0 : param.count, 0.0f);
+            }
+        }
+    }
+
+    // Fusion pass over the LayerSet, building the stages train() runs:
+    //  - InputLayers are pass throughs and are dropped; the first stage
+    //    reads the sample straight from the data feed.
+    //  - every fully connected stage applies its activation in the GEMM
+    //    epilogue (see DenseForward).
+    //  - the output stage computes activation, loss and the output delta in
+    //    that same epilogue (ILossLayer::forwardLoss).
+    //  - on the way back each stage applies the derivative of the previous
+    //    stage's activation while writing its input delta.
+    void fuseLayers()
+    {
+        _stages.clear();
+        for (auto layer : *_layers)
+        {
+            if (layer->Kind() == LayerKind::Input)
+            {
+                continue;
+            }
+            _stages.push_back({ layer.get(), layer->OutputActivation() });
+        }
+        assert(!_stages.empty());
+        _lossLayer = dynamic_cast<ILossLayer*>(_stages.back().layer);
+        _activations.resize(_stages.size());
+        _deltas.resize(_stages.size());
+    }
+
+    // replaces the optimizer, dropping the state of the previous one.
+    void setOptimizer(const OptimizerOptions& options)
+    {
+        _optimizer.reset(new Optimizer(*_layers, options));
+    }
+
+    Optimizer& optimizer() { return *_optimizer; }
+
+    // resume the optimizer from a checkpoint of this network, see LoadCheckpoint.
+    bool restoreOptimizer(CheckpointReader& reader)
+    {
+        return RestoreOptimizerState(reader, *_optimizer);
+    }
+
+    bool saveCheckpoint(const std::string& path)
+    {
+        return SaveCheckpoint(*_layers, path, _optimizer.get());
+    }
+
+    // checkpoint to 'path' in the background every 'interval' samples and at the end of train().
+    void enableCheckpointing(const std::string& path, uint64_t interval, bool directIO = false)
+    {
+        assert(interval > 0);
+        _checkpointWriter.reset(new AsyncCheckpointWriter(path, directIO));
+        _checkpointInterval = interval;
+    }
+
+    // measure the network on 'feed' every 'interval' samples and at the end of
+    // train(), on background threads while training goes on; see AsyncValidator.
+    void enableValidation(std::shared_ptr<IDataFeed> feed, uint64_t interval, const ValidationOptions& options = ValidationOptions())
+    {
+        assert(interval > 0);
+        _validator.reset(new AsyncValidator(feed, options));
+        _validationInterval = interval;
+    }
+
+    // results of the validation passes finished so far.
+    std::vector<ValidationResult> validationResults()
+    {
+        return _validator ? _validator->results() : std::vector<ValidationResult>();
+    }
+
+    // 'epochs' passes over the data feed, which is reset between passes.
+    // Returns the mean loss of the last epoch.
+    double train(uint32_t epochs = 1)
+    {
+        double loss = 0;
+        for (uint32_t epoch = 0; epoch < epochs; ++epoch)
+        {
+            if (epoch > 0 && !_dataFeed->reset())
+            {
+                std::cerr << "data feed cannot be replayed, stopping after " << epoch << " epochs" << std::endl;
+                break;
+            }
+            loss = trainEpoch(epoch);
+        }
+
+        if (_checkpointWriter)
+        {
+            _checkpointWriter->snapshot(*_layers, _optimizer.get());
+            _checkpointWriter->flush();
+            _checkpointWriter->stats().print(std::cout);
+        }
+        if (_validator)
+        {
+            if (_validatedAt != _samplesSeen)
+            {
+                _validator->submit(*_layers, _samplesSeen);
+                _validatedAt = _samplesSeen;
+            }
+            _validator->flush();
+        }
+        return loss;
+    }
+
+    // samples per step of train(), read with IDataFeed::getNextBatchView when above 1.
+    void setBatchSize(int32_t batchSize)
+    {
+        assert(batchSize > 0);
+        _batchSize = batchSize;
+    }
+
+    // Gradient accumulation: trainStep runs a batch as micro-batches of at
+    // most 'samples' samples, accumulating their gradients, and the
+    // optimizer still steps once per batch. 0 picks the largest micro-batch
+    // whose activations and deltas fit in half of the L2 cache, so a large
+    // batch trains with the cache behavior of a small one.
+    void setMicroBatchSize(int32_t samples = 0)
+    {
+        assert(samples >= 0);
+        if (samples == 0)
+        {
+            // per sample: the input, and activations plus deltas of every stage.
+            size_t floats = _stages[0].layer->InputDim();
+            for (auto& stage : _stages)
+            {
+                floats += 2 * static_cast<size_t>(stage.layer->OutputDim());
+            }
+            size_t fit = L2CacheBytes() / 2 / (floats * sizeof(float));
+            // multiples of 4 keep the 4 sample kernels (see DenseGradientRow) busy.
+            samples = static_cast<int32_t>(std::min<size_t>(fit >= 4 ? fit & ~static_cast<size_t>(3) : std::max<size_t>(fit, 1),
+                std::numeric_limits<int32_t>::max()));
+        }
+        _microBatchSize = samples;
+    }
+
+    int32_t MicroBatchSize() const { return _microBatchSize; }
+
+    // one pass until the data feed runs out, returns the mean loss.
+    double trainEpoch(uint32_t epoch)
+    {
+        InputData input;
+        double lossSum = 0;
+        uint64_t samples = 0;
+        const MiniBatch* batch = nullptr;
+        auto first = std::dynamic_pointer_cast<InputLayer>((*_layers)[0]);
+        bool sparse = first && first->Sparse();
+        auto start = Clock::now();
+        while (_batchSize > 1 && sparse && nextSparseBatch(input))
+        {
+            int32_t size = _sparseInput.batchSize();
+            lossSum += trainStep(_sparseInput, _sparseTargets.data());
+            _optimizer->step();
+            samples += size;
+            addSamplesSeen(size);
+        }
+        while (_batchSize > 1 && !sparse && _dataFeed->getNextBatchView(_batchSize, _batch, batch))
+        {
+            lossSum += trainStep(batch->inputs.data(), batch->targets.data(), batch->size);
+            _optimizer->step();
+            samples += batch->size;
+            addSamplesSeen(batch->size);
+        }
+        while(_batchSize == 1 && _dataFeed->getNext(input))
+        {
+            float loss = 0;
+            if (input._sparse)
+            {
+                _sparseInput.clear();
+                _sparseInput.addSample(input._inputIndices.data(), input._input.data(), input._input.size());
+                loss = trainStep(_sparseInput, input._target.data());
+            }
+            else
+            {
+                loss = trainStep(input._input.data(), input._target.data(), 1);
+            }
+            _optimizer->step();
+            lossSum += loss;
+            samples++;
+            addSamplesSeen(1);
+        }
+
+        double elapsed = SecondsSince(start);
+        double meanLoss = samples > 0 ? lossSum / samples : 0;
+        std::cout << "epoch " << epoch << ": trained " << samples << " samples, mean loss " << meanLoss
+            << ", " << (elapsed > 0 ? samples / elapsed : 0) << " samples/s" << std::endl;
+        return meanLoss;
+    }
+
+    // forward and backward pass over one batch of row major samples, in
+    // micro-batches when setMicroBatchSize asked for them. Leaves the
+    // gradients of the batch in the layers for optimizer().step() and
+    // returns the summed loss.
+    float trainStep(const float* input, const float* target, int32_t batchSize)
+    {
+        zeroGradients();
+        size_t inputDim = _stages[0].layer->InputDim();
+        size_t targetDim = _stages.back().layer->OutputDim();
+        float loss = 0;
+        // 64 bit, first + _microBatchSize overflows when the micro-batch size is near INT32_MAX.
+        for (int64_t first = 0; first < batchSize; first += _microBatchSize)
+        {
+            int32_t count = static_cast<int32_t>(std::min<int64_t>(_microBatchSize, batchSize - first));
+            const float* microInput = input + first * inputDim;
+            // every micro-batch contributes its share of the mean over the whole batch.
+            loss += forwardStages(microInput, nullptr, target + first * targetDim, count, 1.0f / batchSize);
+            backStages(microInput, nullptr, count);
+        }
+        return loss;
+    }
+
+    // same for a batch of sparse samples, needs a sparse InputLayer.
+    float trainStep(const SparseBatch& input, const float* target)
+    {
+        zeroGradients();
+        float loss = forwardProp(input, target);
+        backProp(input);
+        return loss;
+    }
+    
+    float forwardProp(const float* input, const float* target, int32_t batchSize)
+    {
+        return forwardStages(input, nullptr, target, batchSize, 1.0f / batchSize);
+    }
+
+    float forwardProp(const SparseBatch& input, const float* target)
+    {
+        assert(_stages.size() >= 2 && _stages[0].layer->AcceptsSparseInput());
+        return forwardStages(nullptr, &input, target, input.batchSize(), 1.0f / input.batchSize());
+    }
+
+    void backProp(const float* input, int32_t batchSize)
+    {
+        backStages(input, nullptr, batchSize);
+    }
+
+    void backProp(const SparseBatch& input)
+    {
+        backStages(nullptr, &input, input.batchSize());
+    }
+
+    void zeroGradients()
+    {
+        for (auto& stage : _stages)
+        {
+            stage.layer->zeroGradients();
+        }
+    }
+
+private:
+    // gathers up to _batchSize samples of a sparse feed into _sparseInput
+    // and _sparseTargets, false once the feed is exhausted. 'sample' is scratch.
+    bool nextSparseBatch(InputData& sample)
+    {
+        _sparseInput.clear();
+        _sparseTargets.clear();
+        while (_sparseInput.batchSize() < _batchSize && _dataFeed->getNext(sample))
+        {
+            if (sample._sparse)
+            {
+                _sparseInput.addSample(sample._inputIndices.data(), sample._input.data(), sample._input.size());
+            }
+            else
+            {
+                // a dense sample is given by its nonzeros.
+                _sparseIndices.clear();
+                _sparseValues.clear();
+                for (size_t i = 0; i < sample._input.size(); ++i)
+                {
+                    if (sample._input[i] != 0.0f)
+                    {
+                        _sparseIndices.push_back(static_cast<int32_t>(i));
+                        _sparseValues.push_back(sample._input[i]);
+                    }
+                }
+                _sparseInput.addSample(_sparseIndices.data(), _sparseValues.data(), _sparseIndices.size());
+            }
+            _sparseTargets.insert(_sparseTargets.end(), sample._target.begin(), sample._target.end());
+        }
+        return _sparseInput.batchSize() > 0;
+    }
+
+    // count trained samples, checkpointing and validating as intervals pass.
+    void addSamplesSeen(uint64_t count)
+    {
+        uint64_t previous = _samplesSeen;
+        _samplesSeen += count;
+        if (_checkpointWriter && _samplesSeen / _checkpointInterval != previous / _checkpointInterval)
+        {
+            _checkpointWriter->snapshot(*_layers, _optimizer.get());
+        }
+        if (_validator && _samplesSeen / _validationInterval != previous / _validationInterval)
+        {
+            _validator->submit(*_layers, _samplesSeen);
+            _validatedAt = _samplesSeen;
+        }
+    }
+
+    // the first stage reads either the dense 'input' or 'sparseInput'.
+    // The output delta is scaled by 'gradientScale'.
+    float forwardStages(const float* input, const SparseBatch* sparseInput, const float* target, int32_t batchSize, float gradientScale)
+    {
+        const float* current = input;
+        for (size_t s = 0; s < _stages.size(); ++s)
+        {
+            BaseLayer* layer = _stages[s].layer;
+            size_t size = static_cast<size_t>(batchSize) * layer->OutputDim();
+            _activations[s].resize(size);
+            _deltas[s].resize(size);
+            if (s + 1 < _stages.size())
+            {
+                if (s == 0 && sparseInput != nullptr)
+                {
+                    layer->forwardPropSparse(*sparseInput, _activations[s].data());
+                }
+                else
+                {
+                    layer->forwardProp(current, _activations[s].data(), batchSize);
+                }
+            }
+            else
+            {
+                return _lossLayer->forwardLoss(current, target, _activations[s].data(), _deltas[s].data(),
+                    batchSize, gradientScale);
+            }
+            current = _activations[s].data();
+        }
+        return 0;
+    }
+
+    void backStages(const float* input, const SparseBatch* sparseInput, int32_t batchSize)
+    {
+        for (size_t s = _stages.size(); s-- > 0;)
+        {
+            if (s == 0 && sparseInput != nullptr)
+            {
+                _stages[s].layer->backPropSparse(*sparseInput, _deltas[s].data());
+                continue;
+            }
+            const float* stageInput = (s == 0) ? input : _activations[s - 1].data();
+            // nothing upstream of the first stage needs a delta.
+            float* inputDelta = (s == 0) ? nullptr : _deltas[s - 1].data();
+            ActivationKind inputActivation = (s == 0) ? ActivationKind::Identity : _stages[s - 1].activation;
+            const float* inputPreActivation = (s == 0) ? nullptr : _stages[s - 1].layer->PreActivations();
+            _stages[s].layer->backProp(stageInput, _deltas[s].data(), inputDelta, inputActivation, inputPreActivation, batchSize);
+        }
+    }
+
+    struct Stage
+    {
+        BaseLayer* layer;
+        ActivationKind activation;
+    };
+
+    std::shared_ptr<LayerSet> _layers;
+    std::shared_ptr<IDataFeed> _dataFeed;
+    std::vector<Stage> _stages;
+    ILossLayer* _lossLayer = nullptr;
+    std::vector<std::vector<float>> _activations;
+    std::vector<std::vector<float>> _deltas;
+    SparseBatch _sparseInput;
+    std::vector<float> _sparseTargets;
+    std::vector<int32_t> _sparseIndices;
+    std::vector<float> _sparseValues;
+    MiniBatch _batch;
+    int32_t _batchSize = 1;
+    int32_t _microBatchSize = std::numeric_limits<int32_t>::max();     // whole batches unless setMicroBatchSize
+    uint64_t _samplesSeen = 0;
+    std::unique_ptr<Optimizer> _optimizer;
+    std::unique_ptr<AsyncCheckpointWriter> _checkpointWriter;
+    uint64_t _checkpointInterval = 0;
+    std::unique_ptr<AsyncValidator> _validator;
+    uint64_t _validationInterval = 0;
+    uint64_t _validatedAt = 0;
+};
+
+////////////////////////////////////////
+// Hyperparameter sweeps
+//
+// RunSweep trains variants of a network side by side in one process. A
+// BroadcastDataFeed reads and decodes the data once for all of them, and
+// each variant trains on its own thread pinned to its own group of cores.
+////////////////////////////////////////
+
+// restrict the calling thread, and the threads it starts later, to
+// 'cores'. Returns false where thread affinity is not supported.
+bool PinThreadToCores(const std::vector<int32_t>& cores)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int32_t core : cores)
+    {
+        CPU_SET(core, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cores;
+    return false;
+#endif
+}
+
+struct SweepVariant
+{
+    std::string name;
+    std::shared_ptr<LayerSet> layers;
+    OptimizerOptions optimizer;
+};
+
+struct SweepResult
+{
+    std::string name;
+    double loss = 0;            // mean training loss of the last epoch
+    double seconds = 0;
+};
+
+// trains every variant for 'epochs' passes over 'source' in batches of
+// 'batchSize'. The cores are split evenly between the variants, and the
+// optimizer of each variant uses the cores of its group.
+std::vector<SweepResult> RunSweep(
+    std::shared_ptr<IDataFeed> source,
+    const std::vector<SweepVariant>& variants,
+    uint32_t epochs,
+    int32_t batchSize = 64)
+{
+    int32_t count = static_cast<int32_t>(variants.size());
+    assert(count > 0);
+    auto broadcast = std::make_shared<BroadcastDataFeed>(source, count, batchSize);
+    int32_t cores = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+    int32_t groupSize = std::max(1, cores / count);
+    // every consumer is taken before any reads, so all variants see every batch.
+    std::vector<std::shared_ptr<IDataFeed>> feeds;
+    for (int32_t i = 0; i < count; ++i)
+    {
+        feeds.push_back(broadcast->consumer(i));
+    }
+
+    std::vector<SweepResult> results(count);
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            std::vector<int32_t> group;
+            for (int32_t k = 0; k < groupSize; ++k)
+            {
+                group.push_back((i * groupSize + k) % cores);
+            }
+            PinThreadToCores(group);
+
+            // built after pinning, so the trainer's buffers are first touched by its own cores.
+            OptimizerOptions optimizer = variants[i].optimizer;
+            optimizer.threads = groupSize;
+            auto start = Clock::now();
+            Trainer trainer(variants[i].layers, std::move(feeds[i]), optimizer);
+            trainer.setBatchSize(batchSize);
+            results[i].name = variants[i].name;
+            results[i].loss = trainer.train(epochs);
+            results[i].seconds = SecondsSince(start);
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    return results;
+}
+
+////////////////////////////////////////
+// Tests, run with "TahoeNN test"
+////////////////////////////////////////
+
+// prints the outcome of one check and returns it.
+bool TestResult(const std::string& name, bool passed, double error)
+{
+    std::cout << (passed ? "PASS " : "FAIL ") << name << " (error " << error << ")" << std::endl;
+    return passed;
+}
+
+void FillRandom(float* data, size_t count, std::mt19937& engine, float scale)
+{
+    std::uniform_real_distribution<float> distribution(-scale, scale);
+    for (size_t k = 0; k < count; ++k)
+    {
+        data[k] = distribution(engine);
+    }
+}
+
+// initialized weights replaced by values in [-scale, scale], the [0, 1]
+// default saturates sigmoids and hides most of the gradient.
+void RandomizeLayers(LayerSet& layers, std::mt19937& engine, float scale = 0.5f)
+{
+    for (auto layer : layers)
+    {
+        layer->initializeWeights();
+        for (auto& param : layer->parameters())
+        {
+            FillRandom(param.buffer->data(), param.buffer->size(), engine, scale);
+        }
+    }
+}
+
+// feed for Trainers that are only driven through trainStep.
+class EmptyDataFeed : public IDataFeed
+{
+public:
+    bool getNext(InputData&) override { return false; }
+};
+
+// copies of the weights of the layers, one per parameter array.
+std::vector<std::vector<float>> CopyWeights(LayerSet& layers)
+{
+    std::vector<std::vector<float>> weights;
+    for (auto layer : layers)
+    {
+        for (auto& param : layer->parameters())
+        {
+            weights.emplace_back(param.buffer->begin(), param.buffer->end());
+        }
+    }
+    return weights;
+}
+
+// copies of the gradients a step left in the layers, one per parameter array.
+std::vector<std::vector<float>> CopyGradients(LayerSet& layers)
+{
+    std::vector<std::vector<float>> gradients;
+    for (auto layer : layers)
+    {
+        for (auto& param : layer->parameters())
+        {
+            gradients.emplace_back(param.gradient->begin(), param.gradient->end());
+        }
+    }
+    return gradients;
+}
+
+// Largest relative difference between the gradients of Trainer::trainStep
+// and central differences of the mean loss, over every weight of 'layers'.
+// 'prepare', if set, runs before every evaluation of the loss, for layers
+// that have to be put back into the same state to give the same loss.
+double GradientCheckError(std::shared_ptr<LayerSet> layers, const float* input, const float* target, int32_t batchSize,
+    const std::function<void()>& prepare = std::function<void()>())
+{
+    auto loss = [&](Trainer& trainer)
+    {
+        if (prepare)
+        {
+            prepare();
+        }
+        return trainer.forwardProp(input, target, batchSize);
+    };
+    Trainer trainer(layers, std::make_shared<EmptyDataFeed>());
+    if (prepare)
+    {
+        prepare();
+    }
+    trainer.trainStep(input, target, batchSize);
+    auto gradients = CopyGradients(*layers);
+
+    const float step = 1e-3f;
+    double worst = 0;
+    size_t array = 0;
+    for (auto layer : *layers)
+    {
+        for (auto& param : layer->parameters())
+        {
+            float* weights = param.buffer->data();
+            for (size_t k = 0; k < param.count; ++k)
+            {
+                float saved = weights[k];
+                weights[k] = saved + step;
+                double plus = loss(trainer);
+                weights[k] = saved - step;
+                double minus = loss(trainer);
+                weights[k] = saved;
+                double numeric = (plus - minus) / (2 * step * batchSize);
+                double analytic = gradients[array][k];
+                double error = std::fabs(numeric - analytic) / std::max(1e-2, std::fabs(numeric) + std::fabs(analytic));
+                worst = std::max(worst, error);
+            }
+            array++;
+        }
+    }
+    return worst;
+}
+
+// the fused stages of Trainer: activations in the GEMM epilogue, the loss
+// and output delta in the output layer, derivatives applied on the way back.
+bool TestDenseGradients()
+{
+    bool passed = true;
+    std::mt19937 engine(7);
+    const int32_t batchSize = 5;
+    std::vector<float> input(batchSize * 5);
+    std::vector<float> target(batchSize * 3);
+    FillRandom(input.data(), input.size(), engine, 1.0f);
+    for (auto& value : target)
+    {
+        value = std::uniform_real_distribution<float>(0.0f, 1.0f)(engine);
+    }
+
+    for (ActivationKind kind : { ActivationKind::Identity, ActivationKind::Sigmoid, ActivationKind::Relu,
+        ActivationKind::LeakyRelu, ActivationKind::Tanh, ActivationKind::Gelu })
+    {
+        DispatchActivation(kind, [&](auto policy)
+        {
+            typedef decltype(policy) Activation;
+            // widths around SimdWidth exercise both the vector loops and their tails.
+            auto layers = std::make_shared<LayerSet>(LayerSet({
+                std::make_shared<InputLayer>(5),
+                std::make_shared<FullyConnectedLayer<Activation>>(5, 11),
+                std::make_shared<FullyConnectedLayer<Activation>>(11, 9),
+                std::make_shared<SquaredErrorOutputLayer<Activation>>(9, 3)
+            }));
+            RandomizeLayers(*layers, engine);
+            double error = GradientCheckError(layers, input.data(), target.data(), batchSize);
+            passed &= TestResult("dense gradients, activation " + std::to_string(static_cast<uint32_t>(kind)), error < 2e-2, error);
+        });
+    }
+    return passed;
+}
+
+// The fused online normalizer pass of SoftmaxCrossEntropyOutputLayer
+// against a plain softmax and cross entropy in double. Inputs and weights
+// are small dyadic fractions and biases integers, so every logit is exact
+// in float and only the softmax itself is compared, at logits up to 1e4.
+bool TestSoftmaxCrossEntropy()
+{
+    bool passed = true;
+    std::mt19937 engine(11);
+    const int32_t inputDim = 6;
+    const int32_t classes = 10000;
+    const int32_t batchSize = 3;
+    const float gradientScale = 1.0f / batchSize;
+    auto dyadic = [&](int32_t range, float unit)
+    {
+        return std::uniform_int_distribution<int32_t>(-range, range)(engine) * unit;
+    };
+
+    for (float biasRange : { 3.0f, 1e4f })
+    {
+        SoftmaxCrossEntropyOutputLayer output(inputDim, classes);
+        BaseLayer& layer = output;
+        ILossLayer& loss = output;
+        layer.initializeWeights();
+        auto params = layer.parameters();
+        float* weights = params[0].buffer->data();
+        float* biases = params[1].buffer->data();
+        for (size_t k = 0; k < params[0].count; ++k)
+        {
+            weights[k] = dyadic(32, 1.0f / 64);
+        }
+        for (int32_t j = 0; j < classes; ++j)
+        {
+            biases[j] = dyadic(static_cast<int32_t>(biasRange), 1.0f);
+        }
+        // near ties at the top, where a stability bug would show.
+        for (int32_t j = 0; j < 4; ++j)
+        {
+            biases[j] = biasRange - j;
+        }
+
+        std::vector<float> input(batchSize * inputDim);
+        for (auto& value : input)
+        {
+            value = dyadic(4, 0.25f);
+        }
+        // one hot on a top class, one hot on a class far below it, and a distribution.
+        std::vector<float> target(static_cast<size_t>(batchSize) * classes, 0.0f);
+        target[1] = 1.0f;
+        int32_t low = static_cast<int32_t>(std::min_element(biases, biases + classes) - biases);
+        target[classes + low] = 1.0f;
+        target[2 * classes + 0] = 0.5f;
+        target[2 * classes + 2] = 0.3f;
+        target[2 * classes + 7] = 0.2f;
+
+        std::vector<float> probabilities(target.size());
+        std::vector<float> delta(target.size());
+        float value = loss.forwardLoss(input.data(), target.data(), probabilities.data(), delta.data(), batchSize, gradientScale);
+
+        double expectedLoss = 0;
+        double probabilityError = 0;
+        double deltaError = 0;
+        bool finite = std::isfinite(value);
+        std::vector<double> logits(classes);
+        for (int32_t b = 0; b < batchSize; ++b)
+        {
+            for (int32_t j = 0; j < classes; ++j)
+            {
+                double z = biases[j];
+                for (int32_t i = 0; i < inputDim; ++i)
+                {
+                    z += static_cast<double>(input[b * inputDim + i]) * weights[static_cast<size_t>(i) * classes + j];
+                }
+                logits[j] = z;
+            }
+            double maxLogit = *std::max_element(logits.begin(), logits.end());
+            double sum = 0;
+            for (double z : logits)
+            {
+                sum += std::exp(z - maxLogit);
+            }
+            double logSum = maxLogit + std::log(sum);
+            for (int32_t j = 0; j < classes; ++j)
+            {
+                size_t k = static_cast<size_t>(b) * classes + j;
+                double p = std::exp(logits[j] - logSum);
+                expectedLoss += target[k] * (logSum - logits[j]);
+                probabilityError = std::max(probabilityError, std::fabs(probabilities[k] - p));
+                deltaError = std::max(deltaError, std::fabs(delta[k] - gradientScale * (p - target[k])));
+                finite &= std::isfinite(probabilities[k]) && std::isfinite(delta[k]);
+            }
+        }
+        double lossError = std::fabs(value - expectedLoss) / std::max(1.0, std::fabs(expectedLoss));
+        std::string name = "softmax cross entropy, logits up to " + std::to_string(static_cast<int32_t>(biasRange));
+        passed &= TestResult(name + ", loss", finite && lossError < 1e-5, lossError);
+        passed &= TestResult(name + ", probabilities", finite && probabilityError < 1e-5, probabilityError);
+        passed &= TestResult(name + ", delta p - target", finite && deltaError < 1e-5, deltaError);
+    }
+    return passed;
+}
+
+// gradients accumulated over micro-batches equal those of the whole batch.
+bool TestMicroBatches()
+{
+    std::mt19937 engine(13);
+    const int32_t batchSize = 10;
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(7),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(7, 12),
+        std::make_shared<SoftmaxCrossEntropyOutputLayer>(12, 5)
+    }));
+    RandomizeLayers(*layers, engine);
+    std::vector<float> input(batchSize * 7);
+    std::vector<float> target(batchSize * 5, 0.0f);
+    FillRandom(input.data(), input.size(), engine, 1.0f);
+    for (int32_t b = 0; b < batchSize; ++b)
+    {
+        target[b * 5 + b % 5] = 1.0f;
+    }
+
+    Trainer trainer(layers, std::make_shared<EmptyDataFeed>());
+    float wholeLoss = trainer.trainStep(input.data(), target.data(), batchSize);
+    auto whole = CopyGradients(*layers);
+    trainer.setMicroBatchSize(3);
+    float microLoss = trainer.trainStep(input.data(), target.data(), batchSize);
+    auto micro = CopyGradients(*layers);
+
+    double error = std::fabs(wholeLoss - microLoss) / std::max(1.0f, std::fabs(wholeLoss));
+    for (size_t a = 0; a < whole.size(); ++a)
+    {
+        for (size_t k = 0; k < whole[a].size(); ++k)
+        {
+            error = std::max(error, static_cast<double>(std::fabs(whole[a][k] - micro[a][k])));
+        }
+    }
+    return TestResult("micro-batches of 3 against a whole batch of 10", error < 1e-5, error);
+}
+
+// a batch fed as sparse CSR rows trains exactly like the same batch fed dense.
+bool TestSparseInput()
+{
+    const int32_t inputDim = 40;
+    const int32_t batchSize = 3;
+    std::shared_ptr<LayerSet> networks[2];
+    for (int32_t n = 0; n < 2; ++n)
+    {
+        std::mt19937 engine(17);
+        networks[n] = std::make_shared<LayerSet>(LayerSet({
+            std::make_shared<InputLayer>(inputDim, n == 1),
+            std::make_shared<FullyConnectedLayer<ReluActivation>>(inputDim, 9),
+            std::make_shared<SquaredErrorOutputLayer<SigmoidActivation>>(9, 3)
+        }));
+        RandomizeLayers(*networks[n], engine);
+    }
+
+    std::mt19937 engine(19);
+    std::vector<float> dense(batchSize * inputDim, 0.0f);
+    std::vector<float> target(batchSize * 3);
+    FillRandom(target.data(), target.size(), engine, 1.0f);
+    SparseBatch sparse;
+    for (int32_t b = 0; b < batchSize; ++b)
+    {
+        std::vector<int32_t> indices = { b, 7 + b, 20, 39 - 2 * b };
+        std::vector<float> values(indices.size());
+        FillRandom(values.data(), values.size(), engine, 1.0f);
+        for (size_t k = 0; k < indices.size(); ++k)
+        {
+            dense[b * inputDim + indices[k]] = values[k];
+        }
+        sparse.addSample(indices.data(), values.data(), indices.size());
+    }
+
+    Trainer denseTrainer(networks[0], std::make_shared<EmptyDataFeed>());
+    Trainer sparseTrainer(networks[1], std::make_shared<EmptyDataFeed>());
+    float denseLoss = denseTrainer.trainStep(dense.data(), target.data(), batchSize);
+    float sparseLoss = sparseTrainer.trainStep(sparse, target.data());
+    auto denseGradients = CopyGradients(*networks[0]);
+    auto sparseGradients = CopyGradients(*networks[1]);
+
+    double error = std::fabs(denseLoss - sparseLoss);
+    for (size_t a = 0; a < denseGradients.size(); ++a)
+    {
+        for (size_t k = 0; k < denseGradients[a].size(); ++k)
+        {
+            error = std::max(error, static_cast<double>(std::fabs(denseGradients[a][k] - sparseGradients[a][k])));
+        }
+    }
+    return TestResult("sparse input against the same batch dense", error < 1e-6, error);
+}
+
+// Epochs in batches of 4 from a feed of sparse samples against the same
+// samples dense. With SGD the row sparse update of the first layer has to
+// match the dense one; with Adam weight rows of features absent from a
+// step must not move in it.
+bool TestSparseBatches()
+{
+    const int32_t inputDim = 40;
+    std::mt19937 engine(47);
+    std::vector<InputData> denseData;
+    std::vector<InputData> sparseData;
+    for (int32_t n = 0; n < 10; ++n)
+    {
+        std::vector<int32_t> indices = { n, 11 + n % 5, 29 - n };
+        std::vector<float> values(indices.size());
+        std::vector<float> target(2);
+        FillRandom(values.data(), values.size(), engine, 1.0f);
+        FillRandom(target.data(), target.size(), engine, 1.0f);
+        std::vector<float> dense(inputDim, 0.0f);
+        for (size_t k = 0; k < indices.size(); ++k)
+        {
+            dense[indices[k]] = values[k];
+        }
+        denseData.emplace_back(dense, target);
+        InputData sparse(values, target);
+        sparse._sparse = true;
+        sparse._inputIndices = indices;
+        sparseData.push_back(sparse);
+    }
+
+    auto network = [&](bool sparse)
+    {
+        std::mt19937 weights(53);
+        auto layers = std::make_shared<LayerSet>(LayerSet({
+            std::make_shared<InputLayer>(inputDim, sparse),
+            std::make_shared<FullyConnectedLayer<TanhActivation>>(inputDim, 6),
+            std::make_shared<SquaredErrorOutputLayer<IdentityActivation>>(6, 2)
+        }));
+        RandomizeLayers(*layers, weights);
+        return layers;
+    };
+    OptimizerOptions sgd;
+    sgd.kind = OptimizerKind::Sgd;
+    sgd.learningRate = 0.1f;
+    std::shared_ptr<LayerSet> layers[2] = { network(false), network(true) };
+    for (int32_t n = 0; n < 2; ++n)
+    {
+        Trainer trainer(layers[n], std::make_shared<StaticDataFeed>(n == 0 ? denseData : sparseData), sgd);
+        trainer.setBatchSize(4);
+        trainer.trainEpoch(0);
+    }
+    auto denseWeights = CopyWeights(*layers[0]);
+    auto sparseWeights = CopyWeights(*layers[1]);
+    double error = 0;
+    for (size_t a = 0; a < denseWeights.size(); ++a)
+    {
+        for (size_t k = 0; k < denseWeights[a].size(); ++k)
+        {
+            error = std::max(error, static_cast<double>(std::fabs(denseWeights[a][k] - sparseWeights[a][k])));
+        }
+    }
+    bool passed = TestResult("sparse batches against dense batches, SGD", error < 1e-6, error);
+
+    // Adam: after a step on the first sample, a step on the last one,
+    // which shares no feature with it, moves only the rows of the last.
+    OptimizerOptions adam;
+    adam.learningRate = 0.01f;
+    auto adamLayers = network(true);
+    Trainer trainer(adamLayers, std::make_shared<EmptyDataFeed>(), adam);
+    SparseBatch sparse;
+    for (int32_t n : { 0, 9 })
+    {
+        sparse.clear();
+        sparse.addSample(sparseData[n]._inputIndices.data(), sparseData[n]._input.data(), sparseData[n]._input.size());
+        trainer.trainStep(sparse, sparseData[n]._target.data());
+        auto before = CopyWeights(*adamLayers);
+        trainer.optimizer().step();
+        auto after = CopyWeights(*adamLayers);
+        if (n == 0)
+        {
+            continue;
+        }
+        size_t wrong = 0;
+        const auto& rows = sparseData[n]._inputIndices;
+        for (int32_t row = 0; row < inputDim; ++row)
+        {
+            bool active = std::find(rows.begin(), rows.end(), row) != rows.end();
+            for (int32_t j = 0; j < 6; ++j)
+            {
+                wrong += (before[0][row * 6 + j] != after[0][row * 6 + j]) != active ? 1 : 0;
+            }
+        }
+        passed &= TestResult("Adam moves only the rows of active features", wrong == 0, static_cast<double>(wrong));
+    }
+    return passed;
+}
+
+// ids outside the table look up zeros and get no gradient row.
+bool TestEmbeddingIds()
+{
+    EmbeddingLayer embedding(4, 3, 5);
+    BaseLayer& layer = embedding;
+    layer.initializeWeights();
+    layer.zeroGradients();
+    std::vector<float> ids = { 2.0f, -1.0f, 5.0f, std::numeric_limits<float>::quiet_NaN() };
+    std::vector<float> output(ids.size() * 3, 1.0f);
+    std::vector<float> delta(output.size(), 1.0f);
+    layer.forwardProp(ids.data(), output.data(), 1);
+    layer.backProp(ids.data(), delta.data(), nullptr, ActivationKind::Identity, nullptr, 1);
+
+    const float* row = layer.parameters()[0].buffer->data() + 2 * 3;
+    bool passed = std::equal(row, row + 3, output.begin()) && embedding.InvalidIds() == 3;
+    for (size_t k = 3; k < output.size(); ++k)
+    {
+        passed &= output[k] == 0.0f;
+    }
+    auto rows = layer.parameters()[0].rows;
+    passed &= rows->size() == 1 && (*rows)[0] == 2;
+    return TestResult("embedding ids outside the table", passed, 0);
+}
+
+// backProp over the micro-batches of one step: each batch adds the rows
+// of its new ids, and the rows added earlier keep their sums.
+bool TestEmbeddingGradientRows()
+{
+    const int32_t dim = 3;
+    EmbeddingLayer embedding(2, dim, 8);
+    BaseLayer& layer = embedding;
+    layer.initializeWeights();
+    layer.zeroGradients();
+    std::vector<std::vector<float>> batches = { { 0.0f, 1.0f }, { 1.0f, 3.0f }, { 4.0f, 0.0f } };
+    std::vector<float> expected(8 * dim, 0.0f);
+    float value = 1.0f;
+    for (auto& ids : batches)
+    {
+        std::vector<float> delta(ids.size() * dim);
+        for (size_t k = 0; k < delta.size(); ++k)
+        {
+            delta[k] = value;
+            expected[static_cast<size_t>(ids[k / dim]) * dim + k % dim] += value;
+            value *= 2.0f;
+        }
+        layer.backProp(ids.data(), delta.data(), nullptr, ActivationKind::Identity, nullptr, 1);
+    }
+
+    auto param = layer.parameters()[0];
+    std::vector<int32_t> rows = *param.rows;
+    bool passed = rows == std::vector<int32_t>({ 0, 1, 3, 4 }) && param.gradient->size() == rows.size() * dim;
+    for (size_t r = 0; passed && r < rows.size(); ++r)
+    {
+        passed = std::equal(param.gradient->data() + r * dim, param.gradient->data() + (r + 1) * dim,
+            expected.begin() + rows[r] * dim);
+    }
+    layer.zeroGradients();
+    passed &= param.rows->empty() && param.gradient->empty();
+    return TestResult("embedding gradient rows accumulate across micro-batches", passed, 0);
+}
+
+// a checkpoint round trip, and checkpoints whose topology records carry
+// valid checksums but impossible contents are rejected.
+bool TestCheckpointTopology()
+{
+    std::mt19937 engine(23);
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(4),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(4, 6),
+        std::make_shared<SquaredErrorOutputLayer<SigmoidActivation>>(6, 2)
+    }));
+    RandomizeLayers(*layers, engine);
+    const std::string path = "tahoe_test.ckpt";
+    auto loaded = SaveCheckpoint(*layers, path) ? LoadCheckpoint(path) : nullptr;
+    InferenceSession session(*layers);
+    std::vector<float> input = { 0.1f, -0.2f, 0.3f, -0.4f };
+    bool passed = TestResult("checkpoint round trip", loaded && InferenceSession(*loaded).run(input) == session.run(input), 0);
+
+    std::vector<std::function<void(std::vector<CheckpointLayerRecord>&)>> corruptions = {
+        [](std::vector<CheckpointLayerRecord>& records) { records[1].kind = 9; },
+        [](std::vector<CheckpointLayerRecord>& records) { records[1].activation = 7; },
+        [](std::vector<CheckpointLayerRecord>& records) { records[0].inputDim = 0; },
+        [](std::vector<CheckpointLayerRecord>& records) { records[2].inputDim = 5; },
+        [](std::vector<CheckpointLayerRecord>& records) { records[0].outputDim = -4; },
+    };
+    bool rejected = true;
+    for (auto& corrupt : corruptions)
+    {
+        std::vector<CheckpointLayerRecord> topology;
+        auto sections = CollectCheckpointSections(*layers, topology);
+        corrupt(topology);
+        CheckpointImage image;
+        BuildCheckpointImage(sections, image);
+        FinalizeCheckpointImage(image);
+        rejected &= WriteCheckpointImage(path, image, false) && LoadCheckpoint(path) == nullptr;
+    }
+    std::remove(path.c_str());
+    return TestResult("corrupt topology records rejected", rejected, 0) && passed;
+}
+
+// Optimizer steps split over its worker pool against the same steps on
+// the calling thread alone. Each value is updated by exactly one work item
+// either way, so the weights have to be identical.
+bool TestOptimizerThreads()
+{
+    std::mt19937 engine(31);
+    OptimizerOptions options;
+    options.kind = OptimizerKind::AdamW;
+    options.learningRate = 0.01f;
+    // 300 x 257 weights are more than one Optimizer::kChunk.
+    std::vector<std::shared_ptr<LayerSet>> layers;
+    std::vector<std::unique_ptr<Optimizer>> optimizers;
+    for (int32_t threads : { 1, 4 })
+    {
+        std::mt19937 weights(37);
+        layers.push_back(std::make_shared<LayerSet>(LayerSet({
+            std::make_shared<InputLayer>(300),
+            std::make_shared<FullyConnectedLayer<ReluActivation>>(300, 257),
+            std::make_shared<SquaredErrorOutputLayer<IdentityActivation>>(257, 3)
+        })));
+        RandomizeLayers(*layers.back(), weights);
+        options.threads = threads;
+        optimizers.emplace_back(new Optimizer(*layers.back(), options));
+    }
+
+    for (int32_t step = 0; step < 5; ++step)
+    {
+        std::vector<float> gradient;
+        for (size_t n = 0; n < layers.size(); ++n)
+        {
+            size_t offset = 0;
+            for (auto layer : *layers[n])
+            {
+                for (auto& param : layer->parameters())
+                {
+                    param.gradient->assign(param.count, 0.0f);
+                    if (n == 0)
+                    {
+                        gradient.resize(offset + param.count);
+                        FillRandom(gradient.data() + offset, param.count, engine, 1.0f);
+                    }
+                    std::copy(gradient.begin() + offset, gradient.begin() + offset + param.count, param.gradient->data());
+                    offset += param.count;
+                }
+            }
+            optimizers[n]->step();
+        }
+    }
+
+    bool passed = true;
+    auto single = CopyWeights(*layers[0]);
+    auto pooled = CopyWeights(*layers[1]);
+    for (size_t k = 0; k < single.size(); ++k)
+    {
+        passed &= single[k] == pooled[k];
+    }
+    return TestResult("optimizer pool against a single thread", passed, 0);
+}
+
+// Two of three BroadcastDataFeed consumers are taken and read shuffled
+// epochs of 200 samples side by side. The untaken one must not hold up
+// the producer, both see every sample, and whole batches are shared
+// instead of copied into the scratch batch.
+bool TestBroadcastFeed()
+{
+    std::vector<InputData> data;
+    for (int32_t i = 0; i < 200; ++i)
+    {
+        data.emplace_back(std::vector<float>{ static_cast<float>(i), 1.0f }, std::vector<float>{ static_cast<float>(i) });
+    }
+    auto broadcast = std::make_shared<BroadcastDataFeed>(std::make_shared<StaticDataFeed>(data, true, 41), 3, 16, 4);
+    std::vector<std::shared_ptr<IDataFeed>> feeds = { broadcast->consumer(0), broadcast->consumer(2) };
+
+    const int32_t epochs = 3;
+    std::vector<double> sums(feeds.size(), 0);
+    std::vector<int64_t> samples(feeds.size(), 0);
+    std::vector<int32_t> copied(feeds.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < feeds.size(); ++c)
+    {
+        threads.emplace_back([&, c]()
+        {
+            MiniBatch scratch;
+            const MiniBatch* batch = nullptr;
+            for (int32_t epoch = 0; epoch < epochs; ++epoch)
+            {
+                if (epoch > 0 && !feeds[c]->reset())
+                {
+                    return;
+                }
+                while (feeds[c]->getNextBatchView(16, scratch, batch))
+                {
+                    copied[c] += batch == &scratch ? 1 : 0;
+                    samples[c] += batch->size;
+                    for (float target : batch->targets)
+                    {
+                        sums[c] += target;
+                    }
+                }
+            }
+            feeds[c].reset();
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    bool passed = true;
+    for (size_t c = 0; c < feeds.size(); ++c)
+    {
+        passed &= copied[c] == 0 && samples[c] == epochs * 200 && sums[c] == epochs * 19900.0;
+    }
+    return TestResult("broadcast feed with an untaken consumer", passed, 0);
+}
+
+// AugmentationPipeline::apply on a batch whose rows end in a scalar tail:
+// normalization against the formula, noise and mask statistics, and the
+// same augmentation for the same seed.
+bool TestAugmentation()
+{
+    std::mt19937 engine(43);
+    const int32_t inputDim = 37;
+    MiniBatch batch;
+    std::vector<float> row(inputDim);
+    for (int32_t k = 0; k < 400; ++k)
+    {
+        FillRandom(row.data(), inputDim, engine, 4.0f);
+        batch.add(row.data(), inputDim, row.data(), 1);
+    }
+    std::vector<float> mean(inputDim);
+    std::vector<float> deviation(inputDim);
+    FillRandom(mean.data(), inputDim, engine, 1.0f);
+    FillRandom(deviation.data(), inputDim, engine, 1.0f);
+    for (auto& value : deviation)
+    {
+        value = std::fabs(value) + 0.5f;
+    }
+
+    AugmentationPipeline normalize;
+    normalize.normalize(mean, deviation);
+    MiniBatch normalized = batch;
+    normalize.apply(normalized, inputDim, 1);
+    double error = 0;
+    for (size_t i = 0; i < batch.inputs.size(); ++i)
+    {
+        size_t j = i % inputDim;
+        error = std::max(error, std::fabs(static_cast<double>(normalized.inputs[i]) - (batch.inputs[i] - mean[j]) / deviation[j]));
+    }
+    bool passed = TestResult("augmentation normalize", error < 1e-5, error);
+
+    AugmentationPipeline random;
+    random.noise(0.5f).mask(0.25f);
+    MiniBatch first = batch;
+    MiniBatch second = batch;
+    random.apply(first, inputDim, 7);
+    random.apply(second, inputDim, 7);
+    size_t masked = 0;
+    double squares = 0;
+    for (size_t i = 0; i < batch.inputs.size(); ++i)
+    {
+        double added = first.inputs[i] - batch.inputs[i];
+        masked += first.inputs[i] == 0.0f ? 1 : 0;
+        squares += first.inputs[i] == 0.0f ? 0.0 : added * added;
+    }
+    double maskedFraction = static_cast<double>(masked) / batch.inputs.size();
+    double deviationSeen = std::sqrt(squares / (batch.inputs.size() - masked));
+    error = std::max(std::fabs(maskedFraction - 0.25) / 0.25, std::fabs(deviationSeen - 0.5) / 0.5);
+    return TestResult("augmentation noise and mask", first.inputs == second.inputs && error < 0.05, error) && passed;
+}
+
+// contents of a file, empty if it cannot be read.
+std::string ReadFileBytes(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::ostringstream bytes;
+    bytes << file.rdbuf();
+    return bytes.str();
+}
+
+// Compiles the source GenerateInferenceSource emits, with the weights
+// embedded and mapped from the checkpoint, and compares what it prints
+// with InferenceSession. The generated code calls std::exp where the
+// session uses SimdExp, so the outputs only agree to a tolerance.
+// Skipped when there is no C++ compiler on the path.
+bool TestGeneratedSource()
+{
+    if (std::system("c++ --version > /dev/null 2>&1") != 0)
+    {
+        std::cout << "SKIP generated source, no compiler" << std::endl;
+        return true;
+    }
+
+    std::mt19937 engine(29);
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(6),
+        std::make_shared<FullyConnectedLayer<SigmoidActivation>>(6, 10),
+        std::make_shared<FullyConnectedLayer<LeakyReluActivation>>(10, 40),
+        std::make_shared<SoftmaxCrossEntropyOutputLayer>(40, 5)
+    }));
+    RandomizeLayers(*layers, engine, 1.0f);
+    const int32_t samples = 4;
+    std::vector<float> inputs(samples * 6);
+    FillRandom(inputs.data(), inputs.size(), engine, 2.0f);
+    std::ofstream inputFile("tahoe_codegen.in");
+    inputFile << std::setprecision(9);
+    for (float value : inputs)
+    {
+        inputFile << value << " ";
+    }
+    inputFile.close();
+
+    const std::string checkpointPath = "tahoe_test.ckpt";
+    std::shared_ptr<CheckpointReader> reader;
+    auto loaded = SaveCheckpoint(*layers, checkpointPath) ? LoadCheckpoint(checkpointPath, &reader) : nullptr;
+    std::string checkpointBytes = ReadFileBytes(checkpointPath);
+    InferenceSession session(*layers);
+
+    bool passed = loaded != nullptr;
+    double worst = 0;
+    for (bool mapped : { false, true })
+    {
+        CodegenOptions options;
+        // the 6x10 layer is unrolled, the 10x40 and 40x5 layers run as loops.
+        options.unrollLimit = 64;
+        if (mapped)
+        {
+            options.checkpointPath = checkpointPath;
+            options.checkpoint = reader;
+        }
+        std::ofstream source("tahoe_codegen.cpp");
+        passed &= loaded && GenerateInferenceSource(*loaded, source, options);
+        source.close();
+        passed &= std::system("c++ -O2 -o tahoe_codegen tahoe_codegen.cpp") == 0 &&
+            std::system("./tahoe_codegen < tahoe_codegen.in > tahoe_codegen.out") == 0;
+
+        std::ifstream outputFile("tahoe_codegen.out");
+        for (int32_t n = 0; n < samples; ++n)
+        {
+            std::vector<float> expected = session.run(std::vector<float>(inputs.begin() + n * 6, inputs.begin() + (n + 1) * 6));
+            for (float value : expected)
+            {
+                float generated;
+                passed &= static_cast<bool>(outputFile >> generated);
+                worst = std::max(worst, std::fabs(static_cast<double>(generated) - value) / std::max(1.0f, std::fabs(value)));
+            }
+        }
+    }
+    passed &= ReadFileBytes(checkpointPath) == checkpointBytes;
+
+    loaded.reset();
+    reader.reset();
+    for (const char* path : { "tahoe_codegen.in", "tahoe_codegen.out", "tahoe_codegen.cpp", "tahoe_codegen", checkpointPath.c_str() })
+    {
+        std::remove(path);
+    }
+    return TestResult("generated source matches the session", passed && worst < 1e-5, worst);
+}
+
+// A flipped byte in a parameter section fails that section's lazy
+// checksum and no other, and a section table with a valid checksum whose
+// offset + size wraps around 2^64 is rejected when the file is opened.
+bool TestCheckpointSections()
+{
+    std::mt19937 engine(59);
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(4),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(4, 6),
+        std::make_shared<SquaredErrorOutputLayer<SigmoidActivation>>(6, 2)
+    }));
+    RandomizeLayers(*layers, engine);
+    const std::string path = "tahoe_test.ckpt";
+    bool passed = SaveCheckpoint(*layers, path);
+    std::string bytes = ReadFileBytes(path);
+    auto write = [&](const std::string& contents)
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), contents.size());
+    };
+
+    CheckpointReader reader;
+    passed &= reader.open(path);
+    int32_t weights = reader.findSection(CheckpointSectionKind::Parameter, 1, 0);
+    int32_t biases = reader.findSection(CheckpointSectionKind::Parameter, 1, 1);
+    passed &= weights >= 0 && biases >= 0;
+    if (passed)
+    {
+        std::string flipped = bytes;
+        flipped[reader.entry(weights).offset + 5] ^= 0x10;
+        write(flipped);
+        CheckpointReader corrupt;
+        passed &= corrupt.open(path) && !corrupt.verifySection(weights) && corrupt.verifySection(biases);
+    }
+    passed = TestResult("flipped parameter byte fails its checksum", passed, 0) && passed;
+
+    CheckpointHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    std::vector<CheckpointSectionEntry> table(header.sectionCount);
+    memcpy(table.data(), bytes.data() + sizeof(header), table.size() * sizeof(CheckpointSectionEntry));
+    // offset + size wraps around to 64.
+    table[0].size = std::numeric_limits<uint64_t>::max() - table[0].offset + 65;
+    header.tableChecksum = Checksum64(table.data(), table.size() * sizeof(CheckpointSectionEntry));
+    std::string wrapped = bytes;
+    memcpy(&wrapped[0], &header, sizeof(header));
+    memcpy(&wrapped[sizeof(header)], table.data(), table.size() * sizeof(CheckpointSectionEntry));
+    write(wrapped);
+    CheckpointReader invalid;
+    bool rejected = !invalid.open(path);
+    std::remove(path.c_str());
+    return TestResult("section size wrapping around is rejected", rejected, 0) && passed;
+}
+
+// Snapshots taken faster than the writer thread syncs them to disk. Each
+// snapshot is either written or superseded by a newer one, and after
+// flush() the file holds the last one, byte for byte what a synchronous
+// save of the same weights writes.
+bool TestAsyncCheckpointWriter()
+{
+    std::mt19937 engine(61);
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(64),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(64, 256),
+        std::make_shared<SquaredErrorOutputLayer<SigmoidActivation>>(256, 4)
+    }));
+    RandomizeLayers(*layers, engine);
+    OptimizerOptions options;
+    options.kind = OptimizerKind::Adam;
+    Optimizer optimizer(*layers, options);
+    const std::string path = "tahoe_test.ckpt";
+    const std::string syncPath = "tahoe_test_sync.ckpt";
+    CheckpointStats stats;
+    {
+        AsyncCheckpointWriter writer(path);
+        for (int32_t snapshot = 0; snapshot < 50 && writer.stats().superseded == 0; ++snapshot)
+        {
+            RandomizeLayers(*layers, engine);
+            writer.snapshot(*layers, &optimizer);
+        }
+        writer.flush();
+        stats = writer.stats();
+    }
+    bool counted = stats.superseded > 0 && stats.failed == 0 && stats.written + stats.superseded == stats.snapshots;
+    counted &= stats.bytesWritten >= stats.written * kCheckpointAlignment;
+    bool passed = TestResult("async checkpoint stats count every snapshot", counted, 0);
+
+    auto loaded = LoadCheckpoint(path);
+    std::vector<float> input(64);
+    FillRandom(input.data(), input.size(), engine, 1.0f);
+    bool loadedLast = loaded && InferenceSession(*loaded).run(input) == InferenceSession(*layers).run(input);
+    loadedLast &= SaveCheckpoint(*layers, syncPath, &optimizer) && ReadFileBytes(syncPath) == ReadFileBytes(path);
+    std::remove(path.c_str());
+    std::remove(syncPath.c_str());
+    return TestResult("async checkpoint holds the last snapshot after flush", loadedLast, 0) && passed;
+}
+
+// Blocks of random bits, which do not compress and are stored shuffled
+// only, and of zeros, which do, with a last block that is not full. The
+// feed has to return every sample bit for bit, and a file whose middle
+// block is short has to be rejected.
+bool TestCompressedDataset()
+{
+    std::mt19937 engine(67);
+    const int32_t inputDim = 7;
+    const int32_t targetDim = 2;
+    const uint32_t blockSamples = 16;
+    const size_t sampleCount = 4 * blockSamples + 5;
+    const size_t width = inputDim + targetDim;
+    std::vector<float> samples(sampleCount * width, 0.0f);
+    for (size_t k = 0; k < 2 * blockSamples * width; ++k)
+    {
+        uint32_t bits = engine();
+        std::memcpy(&samples[k], &bits, sizeof(bits));
+    }
+
+    bool shuffled = true;
+    for (size_t count = 0; count < 40; ++count)
+    {
+        std::vector<uint8_t> bytes(count * sizeof(float));
+        std::vector<float> restored(count);
+        ByteShuffle(samples.data(), count, bytes.data());
+        ByteUnshuffle(bytes.data(), count, restored.data());
+        shuffled &= std::memcmp(restored.data(), samples.data(), count * sizeof(float)) == 0;
+    }
+    bool passed = TestResult("byte shuffle round trip", shuffled, 0);
+
+    const std::string path = "tahoe_test.tcd";
+    CompressedDatasetWriter writer(path, inputDim, targetDim, blockSamples);
+    for (size_t k = 0; k < sampleCount; ++k)
+    {
+        writer.add(&samples[k * width], &samples[k * width + inputDim]);
+    }
+    bool written = writer.close();
+    std::string file = ReadFileBytes(path);
+    CompressedDatasetHeader header = {};
+    std::memcpy(&header, file.data(), sizeof(header));
+    std::vector<CompressedBlockEntry> index(header.blockCount);
+    std::memcpy(index.data(), file.data() + header.indexOffset, index.size() * sizeof(CompressedBlockEntry));
+    written &= index.size() == 5 && index[4].samples == 5 &&
+        index[0].codec == static_cast<uint32_t>(BlockCodec::Shuffled) &&
+        index[2].codec == static_cast<uint32_t>(BlockCodec::ShuffledLz) && index[2].size < index[0].size;
+
+    CompressedFeedOptions options;
+    options.threads = 2;
+    CompressedDataFeed feed(path, options);
+    InputData sample;
+    size_t read = 0;
+    bool identical = feed.good();
+    while (identical && feed.getNext(sample))
+    {
+        identical = read < sampleCount &&
+            std::memcmp(sample._input.data(), &samples[read * width], inputDim * sizeof(float)) == 0 &&
+            std::memcmp(sample._target.data(), &samples[read * width + inputDim], targetDim * sizeof(float)) == 0;
+        read++;
+    }
+    passed = TestResult("compressed dataset round trip", written && identical && read == sampleCount, 0) && passed;
+
+    // move a sample from the second block to the last, the sample count still adds up.
+    index[1].samples--;
+    index[4].samples++;
+    std::memcpy(&file[header.indexOffset], index.data(), index.size() * sizeof(CompressedBlockEntry));
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(file.data(), file.size());
+    }
+    bool rejected = !CompressedDataFeed(path, options).good();
+    std::remove(path.c_str());
+    return TestResult("short middle block rejected", rejected, 0) && passed;
+}
+
+// ParseCsvFloat against strtof, bit for bit, over random decimal
+// strings and over decimals that round to a double halfway between two
+// floats, where rounding the double again would be off by one ulp.
+// Then a CSV file read in chunks much shorter than its lines, so numbers
+// and rows are cut by every chunk, has to come back row for row.
+bool TestCsvParsing()
+{
+    std::mt19937 engine(71);
+    auto randomDecimal = [&]()
+    {
+        std::string text = (engine() % 4 == 0) ? "-" : "";
+        int32_t integerDigits = engine() % 12;
+        int32_t fractionDigits = engine() % 12;
+        if (integerDigits + fractionDigits == 0)
+        {
+            integerDigits = 1;
+        }
+        for (int32_t k = 0; k < integerDigits; ++k)
+        {
+            text += static_cast<char>('0' + engine() % 10);
+        }
+        if (fractionDigits > 0)
+        {
+            text += '.';
+        }
+        for (int32_t k = 0; k < fractionDigits; ++k)
+        {
+            text += static_cast<char>('0' + engine() % 10);
+        }
+        if (engine() % 3 == 0)
+        {
+            text += "e" + std::to_string(static_cast<int32_t>(engine() % 51) - 25);
+        }
+        return text;
+    };
+    auto matchesStrtof = [](const std::string& text)
+    {
+        float value = 0;
+        const char* end = ParseCsvFloat(text.c_str(), text.c_str() + text.size(), value);
+        char* expectedEnd = nullptr;
+        float expected = std::strtof(text.c_str(), &expectedEnd);
+        return end == expectedEnd && std::memcmp(&value, &expected, sizeof(value)) == 0;
+    };
+
+    int32_t mismatches = 0;
+    for (int32_t k = 0; k < 100000; ++k)
+    {
+        mismatches += matchesStrtof(randomDecimal()) ? 0 : 1;
+    }
+    std::uniform_real_distribution<float> magnitudes(1.0f, 1e5f);
+    for (int32_t k = 0; k < 20000; ++k)
+    {
+        float low = magnitudes(engine);
+        double halfway = (static_cast<double>(low) + std::nextafter(low, 2e5f)) / 2;
+        // the shortest decimal that still reads as the halfway double,
+        // 16 digits keep most mantissas on the fast path.
+        char text[32];
+        for (int32_t precision = 15; precision <= 17; ++precision)
+        {
+            std::snprintf(text, sizeof(text), "%.*g", precision, halfway);
+            if (std::strtod(text, nullptr) == halfway)
+            {
+                break;
+            }
+        }
+        mismatches += matchesStrtof(text) ? 0 : 1;
+    }
+    bool passed = TestResult("csv floats match strtof", mismatches == 0, mismatches);
+
+    const std::string path = "tahoe_test.csv";
+    std::vector<float> expected;
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        for (int32_t row = 0; row < 300; ++row)
+        {
+            for (int32_t column = 0; column < 4; ++column)
+            {
+                std::string text = randomDecimal();
+                expected.push_back(std::strtof(text.c_str(), nullptr));
+                file << text << (column < 3 ? "," : (row % 7 == 0 ? "\r\n" : "\n"));
+            }
+            if (row % 50 == 0)
+            {
+                file << "\n";
+            }
+        }
     }
-
-    // simply return the input as output.
-    void forwardProp(std::vector<float>& input, std::vector<float>& output)
+    bool split = true;
+    for (size_t chunkBytes : { 1, 7, 64, 4096 })
     {
-        std::cout << "forward prop from Input Layer" << std::endl;
-        output.resize(input.size());
-        // copy input to output, as the input layer does not apply any transformation.
-        std::copy(input.begin(), input.end(), output.begin());
+        CsvOptions options;
+        options.inputColumns = 3;
+        options.targetColumns = 1;
+        options.chunkBytes = chunkBytes;
+        options.threads = 3;
+        CsvDataFeed feed(path, options);
+        InputData sample;
+        std::vector<float> values;
+        while (feed.getNext(sample))
+        {
+            values.insert(values.end(), sample._input.begin(), sample._input.end());
+            values.insert(values.end(), sample._target.begin(), sample._target.end());
+        }
+        split &= feed.SkippedRows() == 0 && values.size() == expected.size() &&
+            std::memcmp(values.data(), expected.data(), values.size() * sizeof(float)) == 0;
     }
+    std::remove(path.c_str());
+    return TestResult("csv rows survive chunks split at newlines", split, 0) && passed;
+}
 
-    void backProp()
+// Shard readers that run at very different speeds, so the fast ones
+// exhaust their shards and steal from the slow ones. Under either
+// partition every sample has to be read exactly once per epoch.
+bool TestShardedDataset()
+{
+    const size_t sampleCount = 1003;
+    const int32_t shards = 4;
+    const int32_t epochs = 3;
+    std::vector<InputData> samples;
+    for (size_t k = 0; k < sampleCount; ++k)
     {
+        samples.emplace_back(std::vector<float>(1, static_cast<float>(k)), std::vector<float>(1, 0.0f));
+    }
+    auto dataset = std::make_shared<InMemoryDataset>(samples);
 
+    bool passed = true;
+    for (ShardPartition partition : { ShardPartition::Range, ShardPartition::Stride })
+    {
+        for (bool shuffle : { false, true })
+        {
+            ShardOptions options;
+            options.partition = partition;
+            options.shuffle = shuffle;
+            options.seed = 73;
+            auto sharded = std::make_shared<ShardedDataset>(dataset, shards, options);
+            // reads[epoch][sample], every reader adds the samples it got.
+            std::vector<std::vector<std::atomic<int32_t>>> reads(epochs);
+            for (auto& epoch : reads)
+            {
+                epoch = std::vector<std::atomic<int32_t>>(sampleCount);
+            }
+            std::vector<std::thread> readers;
+            for (int32_t index = 0; index < shards; ++index)
+            {
+                readers.emplace_back([&, index]()
+                {
+                    auto feed = sharded->shard(index);
+                    InputData sample;
+                    for (int32_t epoch = 0; epoch < epochs; ++epoch)
+                    {
+                        while (feed->getNext(sample))
+                        {
+                            reads[epoch][static_cast<size_t>(sample._input[0])]++;
+                            if (index == 0)
+                            {
+                                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                            }
+                        }
+                        feed->reset();
+                    }
+                });
+            }
+            for (auto& reader : readers)
+            {
+                reader.join();
+            }
+            bool once = sharded->Steals() > 0;
+            for (auto& epoch : reads)
+            {
+                once &= std::all_of(epoch.begin(), epoch.end(), [](const std::atomic<int32_t>& count) { return count == 1; });
+            }
+            std::string name = std::string(partition == ShardPartition::Range ? "range" : "stride") +
+                (shuffle ? " shuffled" : "") + " shards read every sample once per epoch";
+            passed = TestResult(name, once, 0) && passed;
+        }
     }
-};
+    return passed;
+}
 
-// Implementation of a Fully Connected Layer
-class FullyConnectedHiddenLayer : public BaseLayer
+// The class major output layers. Sampled softmax draws new negatives
+// every batch, so its sampler is restarted before every loss, and its
+// loss is checked against the sampled loss with the log expected count
+// corrections computed here in double. The hierarchical softmax gradient
+// is exact, and its inference distribution has to sum to 1 and agree
+// with classProbability.
+bool TestClassMajorOutputs()
 {
+    std::mt19937 engine(79);
+    const int32_t batchSize = 4;
+    const int32_t inputDim = 6;
+    const int32_t hiddenDim = 8;
+    const int32_t classes = 10;
+    const int32_t negatives = 5;
+    std::vector<float> input(batchSize * inputDim);
+    std::vector<float> hidden(batchSize * hiddenDim);
+    std::vector<float> target(batchSize * classes, 0.0f);
+    FillRandom(input.data(), input.size(), engine, 1.0f);
+    FillRandom(hidden.data(), hidden.size(), engine, 1.0f);
+    for (int32_t b = 0; b < batchSize; ++b)
+    {
+        target[b * classes + engine() % classes] = 1.0f;
+    }
 
-public:
+    auto sampled = std::make_shared<SampledSoftmaxOutputLayer>(hiddenDim, classes, negatives);
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(inputDim),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(inputDim, hiddenDim),
+        sampled
+    }));
+    RandomizeLayers(*layers, engine);
+    // cross entropies of 10 classes are summed in float, the central
+    // differences carry about 1e-2 of rounding noise.
+    const double tolerance = 3e-2;
+    double error = GradientCheckError(layers, input.data(), target.data(), batchSize, [&]() { sampled->reseed(17); });
+    bool passed = TestResult("sampled softmax gradients", error < tolerance, error);
 
-    FullyConnectedHiddenLayer(
-        int32_t inputDim, 
-        int32_t outputDim)
-        : BaseLayer(inputDim, outputDim)
+    auto output = std::make_shared<SampledSoftmaxOutputLayer>(hiddenDim, classes, negatives);
+    auto single = std::make_shared<LayerSet>(LayerSet({ std::make_shared<InputLayer>(hiddenDim), output }));
+    RandomizeLayers(*single, engine);
+    Trainer trainer(single, std::make_shared<EmptyDataFeed>());
+    output->reseed(17);
+    double loss = trainer.forwardProp(hidden.data(), target.data(), batchSize);
+    LogUniformSampler sampler(classes, 17);
+    std::vector<int32_t> drawn(negatives);
+    for (auto& c : drawn)
     {
+        c = sampler.sample();
+    }
+    auto params = output->parameters();
+    const float* weights = params[0].buffer->data();
+    const float* biases = params[1].buffer->data();
+    double expected = 0;
+    for (int32_t b = 0; b < batchSize; ++b)
+    {
+        const float* x = hidden.data() + b * hiddenDim;
+        int32_t label = TargetClass(target.data() + b * classes, classes);
+        auto logit = [&](int32_t c)
+        {
+            double sum = biases[c];
+            for (int32_t k = 0; k < hiddenDim; ++k)
+            {
+                sum += static_cast<double>(weights[c * hiddenDim + k]) * x[k];
+            }
+            return sum - std::log(negatives * sampler.probability(c));
+        };
+        double normalizer = std::exp(logit(label));
+        for (int32_t c : drawn)
+        {
+            normalizer += c == label ? 0.0 : std::exp(logit(c));
+        }
+        expected += std::log(normalizer) - logit(label);
     }
+    error = std::fabs(loss - expected) / std::max(1.0, std::fabs(expected));
+    passed = TestResult("sampled softmax loss with expected count correction", error < 1e-5, error) && passed;
 
-protected:
+    auto hierarchical = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(inputDim),
+        std::make_shared<FullyConnectedLayer<TanhActivation>>(inputDim, hiddenDim),
+        std::make_shared<HierarchicalSoftmaxOutputLayer>(hiddenDim, classes)
+    }));
+    RandomizeLayers(*hierarchical, engine);
+    error = GradientCheckError(hierarchical, input.data(), target.data(), batchSize);
+    passed = TestResult("hierarchical softmax gradients", error < tolerance, error) && passed;
 
-    virtual void initializeWeights() override
+    auto layer = std::make_shared<HierarchicalSoftmaxOutputLayer>(hiddenDim, classes);
+    LayerSet tree({ std::make_shared<InputLayer>(hiddenDim), layer });
+    RandomizeLayers(tree, engine);
+    InferenceSession session(tree);
+    double worst = 0;
+    for (int32_t b = 0; b < batchSize; ++b)
     {
-        _weights.reserve(_inputDim * _outputDim);
-        _weights.assign(_inputDim * _outputDim, 0.0);
-        VectorRandomInitialize(_weights);
+        std::vector<float> x(hidden.begin() + b * hiddenDim, hidden.begin() + (b + 1) * hiddenDim);
+        std::vector<float> probabilities = session.run(x);
+        double sum = 0;
+        for (int32_t c = 0; c < classes; ++c)
+        {
+            sum += probabilities[c];
+            worst = std::max(worst, static_cast<double>(std::fabs(probabilities[c] - layer->classProbability(x.data(), c))));
+        }
+        worst = std::max(worst, std::fabs(sum - 1.0));
     }
-    
-    virtual void forwardProp(std::vector<float>& input, std::vector<float>& output) override
+    return TestResult("hierarchical probabilities sum to 1", worst < 1e-5, worst) && passed;
+}
+
+// FactorizeWeights on a matrix of known rank has to recover it up to
+// float rounding, and leave a clear error one rank lower. The LowRankLayer
+// FactorizeLayer builds from it has to compute what the dense layer does.
+bool TestFactorizeWeights()
+{
+    std::mt19937 engine(83);
+    const int32_t inputDim = 40;
+    const int32_t outputDim = 30;
+    const int32_t rank = 5;
+    const int32_t batchSize = 3;
+    std::vector<float> a(inputDim * rank);
+    std::vector<float> b(rank * outputDim);
+    FillRandom(a.data(), a.size(), engine, 1.0f);
+    FillRandom(b.data(), b.size(), engine, 1.0f);
+    auto dense = std::make_shared<FullyConnectedLayer<TanhActivation>>(inputDim, outputDim);
+    LayerSet layers({ std::make_shared<InputLayer>(inputDim), dense });
+    RandomizeLayers(layers, engine);
+    float* weights = dense->parameters()[0].buffer->data();
+    for (int32_t i = 0; i < inputDim; ++i)
     {
-        std::cout << "Forward prop from Fully Connected Layer" << std::endl;
-        // perform forward propagation
+        for (int32_t j = 0; j < outputDim; ++j)
+        {
+            float sum = 0;
+            for (int32_t r = 0; r < rank; ++r)
+            {
+                sum += a[i * rank + r] * b[r * outputDim + j];
+            }
+            weights[i * outputDim + j] = sum;
+        }
+    }
 
-        // initialize a vector to hold the sigma
-        std::vector<float> sigma(_outputDim, 0.0);
+    std::vector<float> u(inputDim * rank);
+    std::vector<float> v(rank * outputDim);
+    double exact = FactorizeWeights(weights, inputDim, outputDim, rank, u.data(), v.data());
+    double truncated = FactorizeWeights(weights, inputDim, outputDim, rank - 1, u.data(), v.data());
+    bool passed = TestResult("factorized weights of rank " + std::to_string(rank), exact < 1e-5 && truncated > 1e-2, exact);
 
-        // this holds the activations / output
-        output.resize(_outputDim); 
+    double error = 1.0;
+    auto factorized = FactorizeLayer(*dense, rank, &error);
+    LayerSet lowRank({ layers[0], factorized });
+    InferenceSession denseSession(layers);
+    InferenceSession lowRankSession(lowRank);
+    double worst = 0;
+    for (int32_t b = 0; b < batchSize; ++b)
+    {
+        std::vector<float> input(inputDim);
+        FillRandom(input.data(), input.size(), engine, 1.0f);
+        std::vector<float> expected = denseSession.run(input);
+        std::vector<float> output = lowRankSession.run(input);
+        for (int32_t j = 0; j < outputDim; ++j)
+        {
+            worst = std::max(worst, static_cast<double>(std::fabs(output[j] - expected[j])));
+        }
+    }
+    return TestResult("low rank layer matches the dense layer", error < 1e-5 && worst < 1e-4, worst) && passed;
+}
 
-        for (int i = 0; i < input.size(); ++i)
+// Every pruning mode on a matrix with a partial N:M group and a partial
+// panel: Unstructured and Block zero their fraction of the weights or
+// blocks, NM leaves at most n nonzeros in every group of m, and the
+// survivors are the largest. BlockSparseForward on the pruned weights has
+// to match DenseForward, for batches that use both tile kernels.
+bool TestPruneWeights()
+{
+    std::mt19937 engine(89);
+    const int32_t inputDim = 50;
+    const int32_t outputDim = 2 * DenseTileColumns + 5;
+    const size_t total = static_cast<size_t>(inputDim) * outputDim;
+    const int32_t panels = (outputDim + DenseTileColumns - 1) / DenseTileColumns;
+    std::vector<float> dense(total);
+    FillRandom(dense.data(), dense.size(), engine, 1.0f);
+    std::vector<float> bias(outputDim);
+    FillRandom(bias.data(), bias.size(), engine, 1.0f);
+    auto zeros = [](const std::vector<float>& weights)
+    {
+        return static_cast<size_t>(std::count(weights.begin(), weights.end(), 0.0f));
+    };
+    // no pruned weight (or block) is larger than a kept one.
+    auto keepsLargest = [](const std::vector<float>& scores, const std::vector<bool>& kept)
+    {
+        float largestPruned = 0;
+        float smallestKept = std::numeric_limits<float>::max();
+        for (size_t k = 0; k < scores.size(); ++k)
         {
-            int32_t startWeightIndex = i * _outputDim;
-            int32_t endWeightIndex = startWeightIndex + _outputDim;
-            // for ith neuron, perform a dot product with all the weights that are coming from that neuron
-            for (int j = startWeightIndex; j < endWeightIndex; ++j)
+            if (kept[k])
+            {
+                smallestKept = std::min(smallestKept, scores[k]);
+            }
+            else
             {
-                assert(j - startWeightIndex >= 0 && j - startWeightIndex < _outputDim);
-                assert((j - startWeightIndex) < sigma.size());
-                assert(j < _weights.size());
-                
-                sigma[j - startWeightIndex] += _weights[j] * input[i];     
+                largestPruned = std::max(largestPruned, scores[k]);
             }
         }
+        return largestPruned <= smallestKept;
+    };
 
-        // apply the sigmoid function on the sigma to get the activations.
-        for (int i = 0; i < sigma.size(); ++i)
-        {   
-            output[i] = 1 / 1 + exp(-sigma[i]); 
+    bool passed = true;
+    // one pruned copy per mode, reserved so the references below stay valid.
+    std::vector<std::vector<float>> prunedWeights;
+    prunedWeights.reserve(3);
 
-#ifdef DEBUG_PRINT
-            double param, fractpart, intpart;
-            fractpart = modf(output[i] , &intpart);
-            if (fractpart == 0.0)
+    PruningOptions options;
+    options.sparsity = 0.7f;
+    prunedWeights.push_back(dense);
+    std::vector<float>& unstructured = prunedWeights.back();
+    PruneWeights(unstructured.data(), inputDim, outputDim, options);
+    std::vector<float> magnitudes(total);
+    std::vector<bool> kept(total);
+    for (size_t k = 0; k < total; ++k)
+    {
+        magnitudes[k] = std::abs(dense[k]);
+        kept[k] = unstructured[k] != 0.0f;
+    }
+    bool fraction = zeros(unstructured) == static_cast<size_t>(options.sparsity * total) && keepsLargest(magnitudes, kept);
+    passed = TestResult("unstructured pruning zeroes its fraction", fraction, 0) && passed;
+
+    options.mode = PruningMode::NM;
+    options.n = 2;
+    options.m = 4;
+    prunedWeights.push_back(dense);
+    std::vector<float>& nm = prunedWeights.back();
+    PruneWeights(nm.data(), inputDim, outputDim, options);
+    bool groups = true;
+    for (int32_t j = 0; j < outputDim; ++j)
+    {
+        for (int32_t i0 = 0; i0 < inputDim; i0 += options.m)
+        {
+            int32_t length = std::min(options.m, inputDim - i0);
+            std::vector<float> scores;
+            std::vector<bool> groupKept;
+            for (int32_t i = i0; i < i0 + length; ++i)
             {
-                std::cout << "Fract Part is 0 : " << output[i] << std::endl;
+                scores.push_back(std::abs(dense[static_cast<size_t>(i) * outputDim + j]));
+                groupKept.push_back(nm[static_cast<size_t>(i) * outputDim + j] != 0.0f);
             }
-#endif
-            assert(output[i] >= 0);
+            int32_t nonzero = static_cast<int32_t>(std::count(groupKept.begin(), groupKept.end(), true));
+            groups &= nonzero == std::min(options.n, length) && keepsLargest(scores, groupKept);
         }
+    }
+    passed = TestResult("2:4 pruning keeps 2 of every 4 weights", groups, 0) && passed;
 
-#ifdef DEBUG_PRINT
-        for (auto elem : sigma)
+    options.mode = PruningMode::Block;
+    options.sparsity = 0.8f;
+    prunedWeights.push_back(dense);
+    std::vector<float>& block = prunedWeights.back();
+    PruneWeights(block.data(), inputDim, outputDim, options);
+    std::vector<float> norms(static_cast<size_t>(panels) * inputDim, 0.0f);
+    std::vector<bool> blockKept(norms.size(), false);
+    for (int32_t i = 0; i < inputDim; ++i)
+    {
+        for (int32_t j = 0; j < outputDim; ++j)
         {
-            std::cout << elem << ":"; 
+            size_t k = static_cast<size_t>(i) * outputDim + j;
+            size_t b = static_cast<size_t>(j / DenseTileColumns) * inputDim + i;
+            norms[b] += dense[k] * dense[k];
+            blockKept[b] = blockKept[b] || block[k] != 0.0f;
         }
-        std::cout << " " << std::endl;
+    }
+    size_t prunedBlocks = static_cast<size_t>(options.sparsity * norms.size());
+    auto sparse = BlockSparseWeights::FromDense(block.data(), inputDim, outputDim);
+    fraction = static_cast<size_t>(std::count(blockKept.begin(), blockKept.end(), false)) == prunedBlocks &&
+        sparse.blockRow.size() == norms.size() - prunedBlocks && keepsLargest(norms, blockKept);
+    passed = TestResult("block pruning zeroes its fraction of blocks", fraction, 0) && passed;
 
-        for (auto elem : output)
+    double worst = 0;
+    for (auto& weights : prunedWeights)
+    {
+        auto packed = BlockSparseWeights::FromDense(weights.data(), inputDim, outputDim);
+        for (int32_t batch : { 1, 3, 4, 6 })
         {
-            std::cout << elem << ":";
+            std::vector<float> input(static_cast<size_t>(batch) * inputDim);
+            FillRandom(input.data(), input.size(), engine, 1.0f);
+            std::vector<float> expected(static_cast<size_t>(batch) * outputDim);
+            std::vector<float> output(expected.size());
+            DenseForward(input.data(), weights.data(), bias.data(), expected.data(), batch, inputDim, outputDim, ActivationKind::Tanh);
+            BlockSparseForward(input.data(), packed, bias.data(), output.data(), batch, ActivationKind::Tanh);
+            for (size_t k = 0; k < output.size(); ++k)
+            {
+                worst = std::max(worst, static_cast<double>(std::fabs(output[k] - expected[k])));
+            }
         }
+    }
+    return TestResult("block sparse forward matches dense on pruned weights", worst < 1e-5, worst) && passed;
+}
 
-        std::cout << " " << std::endl;
-#endif
+// Client threads submitting to a DynamicBatcher, once with batches that
+// fill up and once with batches that never fill and go out at their
+// deadline. Every client has to get the result of its own input, the
+// one InferenceSession::run gives for it alone.
+bool TestDynamicBatcher()
+{
+    std::mt19937 engine(97);
+    const int32_t inputDim = 12;
+    const int32_t clients = 8;
+    const int32_t requests = 40;
+    LayerSet layers({
+        std::make_shared<InputLayer>(inputDim),
+        std::make_shared<FullyConnectedLayer<ReluActivation>>(inputDim, 20),
+        std::make_shared<SoftmaxCrossEntropyOutputLayer>(20, 5)
+    });
+    RandomizeLayers(layers, engine);
+    auto session = std::make_shared<const InferenceSession>(layers);
+    std::vector<std::vector<float>> inputs(clients * requests, std::vector<float>(inputDim));
+    for (auto& input : inputs)
+    {
+        FillRandom(input.data(), input.size(), engine, 1.0f);
+    }
 
+    bool passed = true;
+    for (bool fill : { true, false })
+    {
+        BatchingOptions options;
+        options.maxBatchSize = fill ? 4 : 1000;
+        options.maxDelay = std::chrono::microseconds(fill ? 100000 : 500);
+        DynamicBatcher batcher(session, options);
+        std::vector<double> worst(clients, 0.0);
+        std::vector<std::thread> threads;
+        for (int32_t client = 0; client < clients; ++client)
+        {
+            threads.emplace_back([&, client]()
+            {
+                // filling clients keep all their requests in flight, the others one at a time.
+                std::vector<std::future<std::vector<float>>> results;
+                for (int32_t r = 0; r < requests; ++r)
+                {
+                    results.push_back(batcher.submit(inputs[client * requests + r]));
+                    if (!fill)
+                    {
+                        results.back().wait();
+                    }
+                }
+                for (int32_t r = 0; r < requests; ++r)
+                {
+                    std::vector<float> output = results[r].get();
+                    std::vector<float> expected = session->run(inputs[client * requests + r]);
+                    for (size_t k = 0; k < expected.size(); ++k)
+                    {
+                        worst[client] = std::max(worst[client], static_cast<double>(std::fabs(output[k] - expected[k])));
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        double error = *std::max_element(worst.begin(), worst.end());
+        std::string name = fill ? "batched requests get their own results" : "requests sent at the deadline get their own results";
+        // full batches are only held back by a 100 ms deadline, they go out as soon as 4 requests wait.
+        bool batched = !fill || batcher.averageBatchSize() > 2.0;
+        passed = TestResult(name, error < 1e-6 && batched, error) && passed;
     }
+    return passed;
+}
 
-    virtual void backProp() override
+// An IDX image and label pair read back as pixels and one-hot labels,
+// and image sizes whose product wraps around 64 bits are rejected.
+bool TestIdxHeader()
+{
+    const std::string imagesPath = "tahoe_test_images.idx";
+    const std::string labelsPath = "tahoe_test_labels.idx";
+    auto write = [](const std::string& path, std::vector<uint32_t> sizes, size_t dataBytes)
     {
+        std::string bytes = { 0, 0, 0x08, static_cast<char>(sizes.size()) };
+        for (uint32_t size : sizes)
+        {
+            for (int32_t shift = 24; shift >= 0; shift -= 8)
+            {
+                bytes += static_cast<char>(size >> shift);
+            }
+        }
+        for (size_t k = 0; k < dataBytes; ++k)
+        {
+            bytes += static_cast<char>(k % 10);
+        }
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), bytes.size());
+    };
 
+    write(imagesPath, { 3, 2, 2 }, 12);
+    write(labelsPath, { 3 }, 3);
+    IdxOptions options;
+    options.scale = 1.0f;
+    InputData sample;
+    IdxDataset dataset(imagesPath, labelsPath, options);
+    bool passed = dataset.good() && dataset.Size() == 3 && dataset.InputDim() == 4;
+    if (passed)
+    {
+        dataset.read(2, sample);
+        passed = sample._input == std::vector<float>({ 8.0f, 9.0f, 0.0f, 1.0f }) && sample._target[2] == 1.0f;
     }
-};
+    passed = TestResult("idx images and labels", passed, 0);
+
+    // 2^22 x 2^21 x 2^21 pixels is 2^64, which wraps to 0 and used to fit any file.
+    write(imagesPath, { 1u << 22, 1u << 21, 1u << 21 }, 16);
+    write(labelsPath, { 1u << 22 }, 1u << 22);
+    bool rejected = !IdxDataset(imagesPath, labelsPath, options).good();
+    std::remove(imagesPath.c_str());
+    std::remove(labelsPath.c_str());
+    return TestResult("idx sizes overflowing 64 bits are rejected", rejected, 0) && passed;
+}
 
-class FullyConnectedOutputLayer : public FullyConnectedHiddenLayer
+// Runs every test, returns the number that failed.
+int tests()
 {
-public:
+    int failed = 0;
+    failed += TestDenseGradients() ? 0 : 1;
+    failed += TestSoftmaxCrossEntropy() ? 0 : 1;
+    failed += TestMicroBatches() ? 0 : 1;
+    failed += TestSparseInput() ? 0 : 1;
+    failed += TestSparseBatches() ? 0 : 1;
+    failed += TestEmbeddingIds() ? 0 : 1;
+    failed += TestEmbeddingGradientRows() ? 0 : 1;
+    failed += TestCheckpointTopology() ? 0 : 1;
+    failed += TestCheckpointSections() ? 0 : 1;
+    failed += TestAsyncCheckpointWriter() ? 0 : 1;
+    failed += TestGeneratedSource() ? 0 : 1;
+    failed += TestOptimizerThreads() ? 0 : 1;
+    failed += TestBroadcastFeed() ? 0 : 1;
+    failed += TestAugmentation() ? 0 : 1;
+    failed += TestCompressedDataset() ? 0 : 1;
+    failed += TestCsvParsing() ? 0 : 1;
+    failed += TestShardedDataset() ? 0 : 1;
+    failed += TestClassMajorOutputs() ? 0 : 1;
+    failed += TestFactorizeWeights() ? 0 : 1;
+    failed += TestPruneWeights() ? 0 : 1;
+    failed += TestDynamicBatcher() ? 0 : 1;
+    failed += TestIdxHeader() ? 0 : 1;
+    std::cout << (failed == 0 ? "all tests passed" : std::to_string(failed) + " tests failed") << std::endl;
+    return failed;
+}
+
+////////////////////////////////////////
+// Benchmarks, selected by the first command line argument
+////////////////////////////////////////
 
-    FullyConnectedOutputLayer(int32_t inputDim, int32_t outputDim)
-        : FullyConnectedHiddenLayer(inputDim, outputDim)
+// fully connected network with the given layer widths and random weights.
+std::shared_ptr<LayerSet> CreateBenchmarkLayers(const std::vector<int32_t>& widths)
+{
+    auto layers = std::make_shared<LayerSet>();
+    layers->push_back(std::make_shared<InputLayer>(widths[0]));
+    for (size_t i = 1; i < widths.size(); ++i)
     {
+        if (i + 1 < widths.size())
+        {
+            layers->push_back(std::make_shared<FullyConnectedHiddenLayer>(widths[i - 1], widths[i]));
+        }
+        else
+        {
+            layers->push_back(std::make_shared<FullyConnectedOutputLayer>(widths[i - 1], widths[i]));
+        }
+    }
 
+    for (auto layer : *layers)
+    {
+        layer->initializeWeights();
     }
+    return layers;
+}
 
-protected:
+// p50/p99 latency of single sample requests through InferenceSession.
+void BenchmarkInference()
+{
+    int32_t cores = std::max(1u, std::thread::hardware_concurrency());
+    for (auto widths : std::vector<std::vector<int32_t>>{ { 3, 20, 2 }, { 256, 512, 512, 10 } })
+    {
+        auto layers = CreateBenchmarkLayers(widths);
+        InferenceSession session(*layers);
+        BenchmarkInferenceLatency(session, 1, 100000);
+        if (cores > 1)
+        {
+            BenchmarkInferenceLatency(session, cores, 100000);
+        }
+    }
+}
 
+// nanoseconds per single sample inference of the 3-20-2 model in main(),
+// through the compile time network and through InferenceSession.
+void BenchmarkStaticNetwork()
+{
+    auto layers = CreateBenchmarkLayers({ 3, 20, 2 });
+    Static::StaticNetwork<Static::InputLayer<3>, Static::FC<3, 20>, Static::FC<20, 2>> network;
+    bool loaded = network.load(*layers);
+    assert(loaded);
+    (void)loaded;
+    InferenceSession session(*layers);
 
-    void backProp() override
+    const int32_t iterations = 10000000;
+    std::array<float, 3> input = { { 0.5f, 0.5f, 0.5f } };
+    double sink = 0;
+    auto start = Clock::now();
+    for (int32_t i = 0; i < iterations; ++i)
     {
-        // First Calculate the Cost Function
-            
+        input[i % 3] = (i & 255) * (1.0f / 256);
+        sink += network.run(input)[0];
+    }
+    double staticNanos = SecondsSince(start) * 1e9 / iterations;
 
-        
+    std::array<float, 2> output;
+    start = Clock::now();
+    for (int32_t i = 0; i < iterations; ++i)
+    {
+        input[i % 3] = (i & 255) * (1.0f / 256);
+        session.run(input.data(), output.data());
+        sink += output[0];
     }
-};
+    double sessionNanos = SecondsSince(start) * 1e9 / iterations;
 
-typedef std::vector<std::shared_ptr<BaseLayer>> LayerSet;
+    std::cout << "3-20-2 inference: StaticNetwork " << staticNanos << " ns, InferenceSession "
+        << sessionNanos << " ns (checksum " << sink << ")" << std::endl;
+}
 
-////////////////////////////////////////
-// Input Data and Data Source Related Stuff
-////////////////////////////////////////
+// throughput/latency tradeoff of DynamicBatcher across batch sizes and latency budgets.
+void BenchmarkBatchingCurve()
+{
+    auto layers = CreateBenchmarkLayers({ 256, 512, 512, 10 });
+    auto session = std::make_shared<const InferenceSession>(*layers);
+    const int32_t clients = 64;
+    for (int32_t maxBatchSize : { 1, 8, 32, 64 })
+    {
+        for (int32_t delayMicros : { 50, 500, 2000 })
+        {
+            BatchingOptions options;
+            options.maxBatchSize = maxBatchSize;
+            options.maxDelay = std::chrono::microseconds(delayMicros);
+            BenchmarkBatching(session, options, clients, 1.0);
+        }
+    }
+}
 
-struct InputData
+// Speedup of BlockSparseForward over DenseForward against the density
+// left by pruning, for the hidden layer shapes of the benchmark networks.
+void BenchmarkPruning()
 {
-    std::vector<float> _input;
-    std::vector<float> _target;
-};
+    struct Variant
+    {
+        const char* name;
+        PruningOptions options;
+    };
+    std::vector<Variant> variants;
+    for (float sparsity : { 0.5f, 0.7f, 0.8f, 0.9f, 0.95f })
+    {
+        PruningOptions options;
+        options.mode = PruningMode::Block;
+        options.sparsity = sparsity;
+        variants.push_back({ "block", options });
+    }
+    PruningOptions unstructured;
+    unstructured.sparsity = 0.9f;
+    variants.push_back({ "unstructured", unstructured });
+    PruningOptions nm;
+    nm.mode = PruningMode::NM;
+    variants.push_back({ "2:4", nm });
 
-// source for the input data to neural network
-// This is a generic class that exposes an interface to fetch input sample
-// one by one. Concrete implementations can be backed by either a database, or a static dataset
-class IDataFeed
+    std::cout << std::fixed << std::setprecision(2);
+    for (auto shape : std::vector<std::pair<int32_t, int32_t>>{ { 256, 512 }, { 512, 512 }, { 1024, 1024 } })
+    {
+        int32_t inputDim = shape.first;
+        int32_t outputDim = shape.second;
+        FullyConnectedHiddenLayer layer(inputDim, outputDim);
+        WeightBuffer dense = *layer.parameters()[0].buffer;
+        dense.assign(static_cast<size_t>(inputDim) * outputDim, 0.0f);
+        VectorRandomInitialize(dense);
+        std::vector<float> bias(outputDim, 0.0f);
+
+        for (int32_t batch : { 1, 32 })
+        {
+            std::vector<float> input(static_cast<size_t>(batch) * inputDim, 0.5f);
+            std::vector<float> output(static_cast<size_t>(batch) * outputDim);
+            // enough repetitions for about 1 GFLOP of dense work.
+            int32_t iterations = std::max(1, static_cast<int32_t>(5e8 / (static_cast<double>(inputDim) * outputDim * batch)));
+
+            auto start = Clock::now();
+            for (int32_t i = 0; i < iterations; ++i)
+            {
+                DenseForward(input.data(), dense.data(), bias.data(), output.data(), batch, inputDim, outputDim, ActivationKind::Sigmoid);
+            }
+            double denseSeconds = SecondsSince(start);
+
+            for (auto& variant : variants)
+            {
+                WeightBuffer pruned = dense;
+                PruneWeights(pruned.data(), inputDim, outputDim, variant.options);
+                auto sparse = BlockSparseWeights::FromDense(pruned.data(), inputDim, outputDim);
+                size_t nonzero = std::count_if(pruned.begin(), pruned.end(), [](float w) { return w != 0.0f; });
+
+                start = Clock::now();
+                for (int32_t i = 0; i < iterations; ++i)
+                {
+                    BlockSparseForward(input.data(), sparse, bias.data(), output.data(), batch, ActivationKind::Sigmoid);
+                }
+                double sparseSeconds = SecondsSince(start);
+
+                std::cout << inputDim << "x" << outputDim << " batch " << std::setw(2) << batch << "  "
+                    << std::setw(12) << variant.name
+                    << "  weight density " << static_cast<double>(nonzero) / pruned.size()
+                    << "  block density " << sparse.density()
+                    << "  speedup " << denseSeconds / sparseSeconds << "x" << std::endl;
+            }
+        }
+    }
+    std::cout << std::defaultfloat;
+}
+
+// inputDim -> FC<Relu> hidden -> SoftmaxCE classes, the network of the MNIST benchmarks.
+std::shared_ptr<LayerSet> CreateMnistLayers(int32_t inputDim, int32_t hidden, int32_t classes)
 {
-public:
-    virtual bool getNext(InputData& input) = 0;   
-};
+    auto layers = std::make_shared<LayerSet>(LayerSet({
+        std::make_shared<InputLayer>(inputDim),
+        std::make_shared<FullyConnectedLayer<ReluActivation>>(inputDim, hidden),
+        std::make_shared<SoftmaxCrossEntropyOutputLayer>(hidden, classes)
+    }));
+    // Glorot uniform weights, the default [0, 1] initialization does not train a network this wide.
+    std::mt19937 engine(1);
+    for (auto layer : *layers)
+    {
+        layer->initializeWeights();
+        auto params = layer->parameters();
+        if (params.empty())
+        {
+            continue;
+        }
+        float limit = std::sqrt(6.0f / (layer->InputDim() + layer->OutputDim()));
+        std::uniform_real_distribution<float> distribution(-limit, limit);
+        for (auto& weight : *params[0].buffer)
+        {
+            weight = distribution(engine);
+        }
+    }
+    return layers;
+}
 
-class StaticDataFeed : public IDataFeed
+// Standard accuracy and throughput regression workload: a 784-128-10
+// network trained on MNIST with Adam, reporting training throughput and
+// test accuracy after every epoch.
+void BenchmarkMnist(
+    const std::string& trainImages,
+    const std::string& trainLabels,
+    const std::string& testImages,
+    const std::string& testLabels,
+    uint32_t epochs)
 {
-public:
+    auto train = std::make_shared<IdxDataset>(trainImages, trainLabels);
+    auto test = std::make_shared<IdxDataset>(testImages, testLabels);
+    if (!train->good() || !test->good() || train->InputDim() != test->InputDim())
+    {
+        return;
+    }
 
-    StaticDataFeed(std::vector<InputData> dataset)
-        : _dataset(dataset),
-        _currentOffset(0)
+    auto layers = CreateMnistLayers(train->InputDim(), 128, train->Classes());
+    auto feed = std::make_shared<IdxDataFeed>(train, true, 1);
+    Trainer trainer(layers, feed);
+    trainer.setBatchSize(64);
+    // test accuracy after every epoch, measured while the next one trains.
+    ValidationOptions validation;
+    validation.threads = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()) - 1);
+    trainer.enableValidation(std::make_shared<IdxDataFeed>(test), train->Size(), validation);
+    trainer.train(epochs);
+}
+
+// sweep over learning rates and hidden widths of the MNIST network, all
+// variants trained at once from one IdxDataFeed.
+void BenchmarkSweep(const std::string& images, const std::string& labels, uint32_t epochs)
+{
+    auto dataset = std::make_shared<IdxDataset>(images, labels);
+    if (!dataset->good())
     {
-        std::cout << "dataset size: " << _dataset.size() << "   " << _dataset[0]._input.size() << std::endl;
+        return;
     }
 
-    bool getNext(InputData& input) override
+    std::vector<SweepVariant> variants;
+    for (int32_t hidden : { 64, 128 })
     {
-        if (_currentOffset < _dataset.size())
+        for (float learningRate : { 0.001f, 0.003f })
         {
-            input =  _dataset[_currentOffset++];   
-            return true;
+            SweepVariant variant;
+            variant.name = "hidden " + std::to_string(hidden) + ", learning rate " + std::to_string(learningRate);
+            variant.layers = CreateMnistLayers(dataset->InputDim(), hidden, dataset->Classes());
+            variant.optimizer.learningRate = learningRate;
+            variants.push_back(variant);
         }
+    }
 
-        return false;
+    auto start = Clock::now();
+    auto results = RunSweep(std::make_shared<IdxDataFeed>(dataset, true, 1), variants, epochs);
+    double elapsed = SecondsSince(start);
+    for (auto& result : results)
+    {
+        std::cout << result.name << ": loss " << result.loss << " after " << result.seconds << " s" << std::endl;
     }
-    
-private:
-    std::vector<InputData> _dataset;
-    int32_t _currentOffset;
-};
+    double samples = static_cast<double>(dataset->Size()) * epochs * variants.size();
+    std::cout << variants.size() << " variants: " << samples / elapsed << " samples/s overall, data decoded once" << std::endl;
+}
 
-/////////////////////////////////////////////
-// Trainer - This class does the actual training
-////////////////////////////////////////////
-class Trainer
+int main(int argc, char** argv)
 {   
-public:
-    Trainer(
-        std::shared_ptr<LayerSet> layerSet, 
-        std::shared_ptr<IDataFeed> dataFeed
-    ) : _layers(layerSet),
-    _dataFeed(dataFeed)
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "test")
     {
-        validate();
-        initializeWeights();
+        return tests() == 0 ? 0 : 1;
     }
- 
-    void validate()
+    if (mode == "bench-inference")
     {
-        std::cout << "Validating Layer Set" << std::endl;
-        // ensure that there are atleast two layers.
-        assert(_layers->size() >= 2); 
-
-        int32_t prevLayerSize = (*_layers)[0]->InputDim();
-
-        for (auto layer : *_layers)
+        BenchmarkInference();
+        return 0;
+    }
+    if (mode == "bench-batching")
+    {
+        BenchmarkBatchingCurve();
+        return 0;
+    }
+    if (mode == "bench-pruning")
+    {
+        BenchmarkPruning();
+        return 0;
+    }
+    if (mode == "factorize")
+    {
+        // factorize <checkpoint> <output checkpoint> <rank>
+        if (argc < 5)
         {
-            assert(prevLayerSize == layer->InputDim());
-            prevLayerSize = layer->OutputDim();
+            std::cerr << "usage: TahoeNN factorize <checkpoint> <output checkpoint> <rank>" << std::endl;
+            return 1;
+        }
+        auto trained = LoadCheckpoint(argv[2]);
+        if (!trained)
+        {
+            return 1;
         }
+        FactorizeLayers(*trained, std::atoi(argv[4]));
+        return SaveCheckpoint(*trained, argv[3]) ? 0 : 1;
     }
-
-    void initializeWeights()
+    if (mode == "bench-mnist")
     {
-        // this initializes weights to random,
-        // in future, we can possibly import the weights from a file / dump etc.
-        for (auto layer : *_layers)
+        // bench-mnist <train images> <train labels> <test images> <test labels> [epochs]
+        if (argc < 6)
         {
-            layer->initializeWeights();
+            std::cerr << "usage: TahoeNN bench-mnist <train images> <train labels> <test images> <test labels> [epochs]" << std::endl;
+            return 1;
         }
+        BenchmarkMnist(argv[2], argv[3], argv[4], argv[5], argc > 6 ? std::atoi(argv[6]) : 5);
+        return 0;
     }
-
-    void train()
+    if (mode == "bench-sweep")
     {
-        InputData input;
-        while(_dataFeed->getNext(input))
+        // bench-sweep <images> <labels> [epochs]
+        if (argc < 4)
         {
-            forwardProp(input);
+            std::cerr << "usage: TahoeNN bench-sweep <images> <labels> [epochs]" << std::endl;
+            return 1;
         }
+        BenchmarkSweep(argv[2], argv[3], argc > 4 ? std::atoi(argv[4]) : 3);
+        return 0;
     }
-    
-    void forwardProp(InputData& input)
+    if (mode == "compress-csv")
     {
-        std::vector<float> currentInput = input._input;
-        std::vector<float> output;
-        for (auto layer : *_layers)
+        // compress-csv <csv> <output> <input columns> <target columns>
+        if (argc < 6)
+        {
+            std::cerr << "usage: TahoeNN compress-csv <csv> <output> <input columns> <target columns>" << std::endl;
+            return 1;
+        }
+        CsvOptions options;
+        options.inputColumns = std::atoi(argv[4]);
+        options.targetColumns = std::atoi(argv[5]);
+        CsvDataFeed csv(argv[2], options);
+        CompressedDatasetWriter writer(argv[3], options.inputColumns, options.targetColumns);
+        MiniBatch batch;
+        while (csv.getNextBatch(4096, batch))
+        {
+            for (int32_t k = 0; k < batch.size; ++k)
+            {
+                writer.add(batch.inputs.data() + static_cast<size_t>(k) * options.inputColumns,
+                    batch.targets.data() + static_cast<size_t>(k) * options.targetColumns);
+            }
+        }
+        if (!csv.good() || !writer.close())
         {
-            layer->forwardProp(currentInput, output);
-            currentInput = output;
+            return 1;
         }
+        std::cout << writer.RawBytes() << " bytes of samples stored in " << writer.StoredBytes() << " bytes, "
+            << csv.SkippedRows() << " malformed rows skipped" << std::endl;
+        return 0;
+    }
+    if (mode == "bench-static")
+    {
+        BenchmarkStaticNetwork();
+        return 0;
+    }
+    if (mode == "codegen")
+    {
+        // codegen <checkpoint> <output.cpp> [--mmap]
+        if (argc < 4)
+        {
+            std::cerr << "usage: TahoeNN codegen <checkpoint> <output.cpp> [--mmap]" << std::endl;
+            return 1;
+        }
+        CodegenOptions options;
+        auto trained = LoadCheckpoint(argv[2], &options.checkpoint);
+        std::ofstream source(argv[3]);
+        if (argc > 4 && std::string(argv[4]) == "--mmap")
+        {
+            // the generated code maps the input checkpoint as it is, nothing is rewritten.
+            options.checkpointPath = argv[2];
+        }
+        return trained && GenerateInferenceSource(*trained, source, options) ? 0 : 1;
     }
 
-private:
-    std::shared_ptr<LayerSet> _layers;
-    std::shared_ptr<IDataFeed> _dataFeed;
-};
-
-// basic sanity tests
-void tests()
-{
-    // Test 1
-}
-
-int main()
-{   
     // create layers
     std::shared_ptr<LayerSet> layers(new LayerSet({
         std::make_shared<InputLayer>(3),
@@ -337,9 +10840,9 @@ int main()
     };
 
     std::cout << staticData.size() << "   " << staticData[0]._input.size() << std::endl;
-    std::shared_ptr<IDataFeed> dataFeed(new StaticDataFeed(staticData));
+    std::shared_ptr<IDataFeed> dataFeed(new StaticDataFeed(staticData, true));
 
     auto trainer = std::make_shared<Trainer>(layers, dataFeed);
-    trainer->train();
+    trainer->train(3);
     return 0;
 }